@@ -30,78 +30,191 @@
 #include <sys/socket.h>
 #endif
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define HAVE_CRC32C_SSE42 1
+#endif
+
 #include "circllhist.h"
-#include "cdflib.h"
 
-/* A search for inverse binmomial CDF values...
- * Given a set of N retain each element with probability p resulting in M...
- * tgt [0,1] is the placement on the CDF...
- * It is reasonable to call this with drand48()
+/* Binomial sampling for downsampling: given N elements each retained with
+ * probability p, draw how many are retained.  Small means use inversion,
+ * everything else BTPE (Kachitvichyanukul & Schmeiser, "Binomial random
+ * variate generation", CACM 1988), both as in numpy.  Uniform variates in
+ * [0,1) come from the caller, so the sampler itself holds no state.
  */
-
-static inline double cumbin_r(double s, double n, double pr, double ompr) {
-  double cum, ccum;
-  cumbin(&s, &n, &pr, &ompr, &cum, &ccum);
-  return cum;
-}
-
-static unsigned long binomial_reduce_random(unsigned long N, double pr, double tgt) {
-  if(pr == 1) return N;
-  if(pr == 0) return 0;
-
-  unsigned long left = 0, right = N;
-  unsigned long i = (double)N * pr; // we guess where we're likely to end up.
-  unsigned long bias = (double)N * 0.005; // then bias only the first bisection to reduce steps.
-  if(bias < 2) bias = 2;
-
-  // this are for calculating the CDF value
-  double ompr = 1.0 - pr;
-  double n = N;
-  double cum = 0;
-  double s = i;
-
-  while(right > left) {
-    s = i;
-    cum = cumbin_r(s, n, pr, ompr);
-    if(i == right) {             // if i==left, we don't have the correct `cum` to compare to,
-                                 // we'll hit this case next iteration
-      if(right - left == 1) {    // since we're not looking for an exact match, but just under
-        if(tgt <= cum) return i; // this
-        else return i-1;         // or that
-      }
-    }
-    if(tgt <= cum) {
-      if(i == 0) return 0;
-      right = i;
+typedef double (*hist_uniform_func)(void *);
+
+static int64_t
+binomial_inversion(int64_t n, double p, hist_uniform_func uniform, void *closure) {
+  double q = 1.0 - p, qn = exp(n * log(q)), np = n * p;
+  double bound_d = np + 10.0 * sqrt(np * q + 1), px = qn, u;
+  int64_t x = 0, bound = (bound_d < (double)n) ? (int64_t)bound_d : n;
+  u = uniform(closure);
+  while(u > px) {
+    x++;
+    if(x > bound) {
+      x = 0;
+      px = qn;
+      u = uniform(closure);
     }
     else {
-      if(i == N) return N;
-      left = i;
+      u -= px;
+      px = ((n - x + 1) * p * px) / (x * q);
     }
+  }
+  return x;
+}
+
+/* p <= 0.5 */
+static int64_t
+binomial_btpe(int64_t n, double p, hist_uniform_func uniform, void *closure) {
+  double r = p, q = 1.0 - p;
+  double fm = n * r + r;
+  int64_t m = (int64_t)floor(fm);
+  double p1 = floor(2.195 * sqrt(n * r * q) - 4.6 * q) + 0.5;
+  double xm = m + 0.5, xl = xm - p1, xr = xm + p1;
+  double c = 0.134 + 20.5 / (15.3 + m);
+  double a, laml, lamr, p2, p3, p4, nrq = n * r * q;
+  double u, v, x, s, f, rho, t, alpha, x1, x2, f1, f2, z, z2, w, w2;
+  int64_t y, k, i;
+
+  a = (fm - xl) / (fm - xl * r);
+  laml = a * (1.0 + a / 2.0);
+  a = (xr - fm) / (xr * q);
+  lamr = a * (1.0 + a / 2.0);
+  p2 = p1 * (1.0 + 2.0 * c);
+  p3 = p2 + c / laml;
+  p4 = p3 + c / lamr;
 
-    // We don't necessarily bisect.  B/c binomial distributions tend to be so tight,
-    // we can artificially limit our first bisection by about 50x.  We'll rarely be wrong
-    // and we return to straight bisection on subsequent iterations, so it will only ever
-    // cost an extra step when we're unlucky.
-    unsigned long skip = (right - left) / bias;
-    if(bias != 2 && skip < 1) skip = (right - left) / 2;
-    if(skip < 1) skip = 1;
-
-    // because we may not simply bisect we have a conditional
-    if(tgt <= cum) {
-      i = right - skip;
+  while(1) {
+    u = uniform(closure) * p4;
+    v = uniform(closure);
+    if(u <= p1) {
+      /* triangular region, accept immediately */
+      return (int64_t)floor(xm - p1 * v + u);
+    }
+    if(u <= p2) {
+      /* parallelograms */
+      x = xl + (u - p1) / c;
+      v = v * c + 1.0 - fabs(m - x + 0.5) / p1;
+      if(v > 1.0) continue;
+      y = (int64_t)floor(x);
+    }
+    else if(u <= p3) {
+      /* left exponential tail */
+      if(v == 0.0) continue;
+      y = (int64_t)floor(xl + log(v) / laml);
+      if(y < 0) continue;
+      v = v * (u - p2) * laml;
     }
     else {
-      i = left + skip;
+      /* right exponential tail */
+      if(v == 0.0) continue;
+      y = (int64_t)floor(xr - log(v) / lamr);
+      if(y > n) continue;
+      v = v * (u - p3) * lamr;
+    }
+
+    k = (y > m) ? y - m : m - y;
+    if(k <= 20 || k >= nrq / 2.0 - 1) {
+      /* explicit evaluation of f(y) / f(m) */
+      s = r / q;
+      a = s * (n + 1);
+      f = 1.0;
+      if(m < y) for(i=m+1;i<=y;i++) f *= (a / i - s);
+      else if(m > y) for(i=y+1;i<=m;i++) f /= (a / i - s);
+      if(v > f) continue;
+      return y;
     }
-    // simple bisection on subsequent iterations.
-    bias = 2;
+
+    /* squeeze using upper and lower bounds on log(f(y)) */
+    rho = (k / nrq) * ((k * (k / 3.0 + 0.625) + 0.16666666666666666) / nrq + 0.5);
+    t = -(double)k * k / (2 * nrq);
+    alpha = log(v);
+    if(alpha < t - rho) return y;
+    if(alpha > t + rho) continue;
+
+    /* final acceptance/rejection via Stirling's formula */
+    x1 = y + 1;
+    f1 = m + 1;
+    z = n + 1 - m;
+    w = n - y + 1;
+    x2 = x1 * x1;
+    f2 = f1 * f1;
+    z2 = z * z;
+    w2 = w * w;
+    if(alpha > (xm * log(f1 / x1) + (n - m + 0.5) * log(z / w) +
+                (y - m) * log(w * r / (x1 * q)) +
+                (13680. - (462. - (132. - (99. - 140. / f2) / f2) / f2) / f2) / f1 / 166320. +
+                (13680. - (462. - (132. - (99. - 140. / z2) / z2) / z2) / z2) / z / 166320. +
+                (13680. - (462. - (132. - (99. - 140. / x2) / x2) / x2) / x2) / x1 / 166320. +
+                (13680. - (462. - (132. - (99. - 140. / w2) / w2) / w2) / w2) / w / 166320.))
+      continue;
+    return y;
+  }
+}
+
+static uint64_t
+binomial_reduce_random(uint64_t N, double pr, hist_uniform_func uniform, void *closure) {
+  int64_t n;
+  double q;
+  if(pr >= 1) return N;
+  if(N == 0 || pr <= 0) return 0;
+  if(N > INT64_MAX) {
+    /* the samplers work on signed counts, split the (rare) huge bins */
+    return binomial_reduce_random(N / 2, pr, uniform, closure) +
+           binomial_reduce_random(N - N / 2, pr, uniform, closure);
+  }
+  n = N;
+  /* sample the smaller of retained/dropped */
+  q = (pr <= 0.5) ? pr : 1.0 - pr;
+  if(q * n <= 30.0) n = binomial_inversion(n, q, uniform, closure);
+  else n = binomial_btpe(n, q, uniform, closure);
+  return (pr <= 0.5) ? (uint64_t)n : N - n;
+}
+
+static double
+drand48_uniform(void *closure) {
+  (void)closure;
+  return drand48();
+}
+
+/* xoshiro256** (Blackman & Vigna), seeded through splitmix64 */
+static inline uint64_t
+rotl64(uint64_t x, int k) {
+  return (x << k) | (x >> (64 - k));
+}
+
+void
+hist_rng_seed(hist_rng_t *rng, uint64_t seed) {
+  int i;
+  for(i=0;i<4;i++) {
+    uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    rng->s[i] = z ^ (z >> 31);
   }
-  return i;
 }
 
-static unsigned long binomial_reduce(unsigned long N, double pr) {
-  return binomial_reduce_random(N, pr, drand48());
+uint64_t
+hist_rng_next(hist_rng_t *rng) {
+  uint64_t *s = rng->s;
+  uint64_t result = rotl64(s[1] * 5, 7) * 9;
+  uint64_t t = s[1] << 17;
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rotl64(s[3], 45);
+  return result;
+}
+
+static double
+rng_uniform(void *closure) {
+  /* the top 53 bits as a double in [0,1) */
+  return (hist_rng_next(closure) >> 11) * (1.0 / 9007199254740992.0);
 }
 
 const hist_allocator_t default_allocator = {
@@ -204,14 +317,118 @@ struct histogram {
   uint16_t allocd; //!< number of allocated bv pairs
   uint16_t used;   //!< number of used bv pairs
   uint32_t fast: 1;
+  uint32_t compact: 1;
+  uint32_t small: 1;    //!< allocated with HIST_INLINE_BINS pairs right after it
+  uint32_t weighted: 1; //!< counts hold IEEE doubles, see weight_of()
+  uint32_t total_valid: 1;
   const hist_allocator_t *allocator;
   struct hist_bv_pair *bvs; //!< pointer to bv-pairs
+  uint32_t *shared; //!< holders of bvs (and fast pages) when shared by hist_clone
+  uint64_t total;   //!< sum of the non-NaN counts, if total_valid
 };
 
 struct histogram_fast {
   struct histogram internal;
   uint16_t *faster[256];
 };
+
+/* Plain histograms start out with their bv pairs in the same allocation and
+ * only move them to the heap once they outgrow it. */
+#define HIST_INLINE_BINS 16
+
+static inline struct hist_bv_pair *
+hist_inline_bvs(histogram_t *hist) {
+  return (struct hist_bv_pair *)(hist + 1);
+}
+
+/* Free a bvs array that hist no longer uses, unless it's the inline one */
+static inline void
+hist_bvs_release(histogram_t *hist, struct hist_bv_pair *bvs) {
+  if(bvs == NULL || (hist->small && bvs == hist_inline_bvs(hist))) return;
+  hist->allocator->free(bvs);
+}
+
+/* One bit per possible bucket, in bucket order (see compact_ordinal), so the
+ * position of a bucket in bvs is the number of bits set below its own. */
+#define COMPACT_WORDS ((MAX_HIST_BINS + 63) / 64)
+#define COMPACT_BLOCK_WORDS 2
+#define COMPACT_BLOCKS ((COMPACT_WORDS + COMPACT_BLOCK_WORDS - 1) / COMPACT_BLOCK_WORDS)
+struct histogram_compact {
+  struct histogram internal;
+  uint16_t rank[COMPACT_BLOCKS];  //!< bits set before each block
+  uint64_t bits[COMPACT_WORDS];
+};
+/* Copy-on-write
+ *
+ * hist_clone hands out a new header pointing at the same bvs (and fast index
+ * pages) and counts the holders in a separately allocated word.  Whoever is
+ * about to modify a shared histogram takes a private copy first, unless
+ * everyone else has let go in the meantime.  Only the owner of a histogram
+ * may modify it, as always, so the count is the only thing that needs to be
+ * atomic.
+ */
+static void
+hist_shared_free(histogram_t *hist) {
+  const hist_allocator_t *a = hist->allocator;
+  if(hist->fast) {
+    struct histogram_fast *hfast = (struct histogram_fast *)hist;
+    int i;
+    for(i=0;i<256;i++) a->free(hfast->faster[i]);
+  }
+  hist_bvs_release(hist, hist->bvs);
+  a->free(hist->shared);
+}
+
+/* Make hist's storage private, keeping its contents if keep is set and
+ * leaving it empty otherwise.  Returns -1 if the copy can't be allocated. */
+static int
+hist_unshare_slow(histogram_t *hist, int keep) {
+  const hist_allocator_t *a = hist->allocator;
+  struct histogram_fast *hfast = (struct histogram_fast *)hist;
+  struct hist_bv_pair *bvs = NULL;
+  uint16_t *pages[256] = { NULL };
+  int i;
+  if(__atomic_load_n(hist->shared, __ATOMIC_ACQUIRE) == 1) {
+    a->free(hist->shared);
+    hist->shared = NULL;
+    if(!keep) hist_clear(hist);
+    return 0;
+  }
+  if(keep) {
+    bvs = a->malloc(hist->allocd * sizeof(*bvs));
+    if(!bvs) return -1;
+    memcpy(bvs, hist->bvs, hist->used * sizeof(*bvs));
+    for(i=0; hist->fast && i<256; i++) {
+      if(!hfast->faster[i]) continue;
+      pages[i] = a->malloc(256 * sizeof(uint16_t));
+      if(!pages[i]) {
+        while(i-- > 0) a->free(pages[i]);
+        a->free(bvs);
+        return -1;
+      }
+      memcpy(pages[i], hfast->faster[i], 256 * sizeof(uint16_t));
+    }
+  }
+  if(__atomic_sub_fetch(hist->shared, 1, __ATOMIC_ACQ_REL) == 0) {
+    /* the others let go while we copied */
+    hist_shared_free(hist);
+  }
+  hist->shared = NULL;
+  hist->bvs = bvs;
+  if(!keep) {
+    hist->allocd = 0;
+    hist->used = 0;
+  }
+  if(hist->fast) memcpy(hfast->faster, pages, sizeof(pages));
+  return 0;
+}
+
+static inline int
+hist_unshare(histogram_t *hist, int keep) {
+  if(hist->shared == NULL) return 0;
+  return hist_unshare_slow(hist, keep);
+}
+
 uint64_t bvl_limits[7] = {
   0x00000000000000ffULL, 0x0000000000000ffffULL,
   0x0000000000ffffffULL, 0x00000000fffffffffULL,
@@ -226,9 +443,43 @@ typedef enum {
   BVL5 = 4,
   BVL6 = 5,
   BVL7 = 6,
-  BVL8 = 7
+  BVL8 = 7,
+  BVDOUBLE = 8 //!< weighted histograms: 8 byte IEEE double, unknown to old readers
 } bvdatum_t;
 
+/* Weighted histograms keep a non-negative IEEE double in the count bits.  We
+ * never store -0.0, so a zero weight is all zero bits and the count == 0 and
+ * count > 0 tests used throughout keep working for both kinds. */
+static inline double
+weight_of(uint64_t bits) {
+  double w;
+  memcpy(&w, &bits, sizeof(w));
+  return w;
+}
+static inline uint64_t
+weight_bits(double w) {
+  uint64_t bits;
+  if(!(w > 0)) w = 0; /* also folds -0.0 and NaN */
+  memcpy(&bits, &w, sizeof(bits));
+  return bits;
+}
+static inline uint64_t
+weight_to_count(double w) {
+  if(!(w > 0)) return 0;
+  if(w >= 18446744073709551615.0) return ~(uint64_t)0;
+  return (uint64_t)(w + 0.5);
+}
+//! The count of bin i as a double, whatever kind of histogram
+static inline double
+bv_weight(const histogram_t *h, int i) {
+  return h->weighted ? weight_of(h->bvs[i].count) : (double)h->bvs[i].count;
+}
+//! The count of bin i as an integer, weights are rounded
+static inline uint64_t
+bv_count(const histogram_t *h, int i) {
+  return h->weighted ? weight_to_count(weight_of(h->bvs[i].count)) : h->bvs[i].count;
+}
+
 static inline int
 hist_bucket_isnan(const hist_bucket_t hb) {
   int aval = abs(hb.val);
@@ -246,9 +497,51 @@ hist_bucket_is_valid(const hist_bucket_t hb) {
   return !hist_bucket_isnan(hb) || (hb.val == hbnan.val && hb.exp == hbnan.exp);
 }
 
+/* Plain histograms keep the total of their non-NaN counts: inserts and
+ * removals adjust it, bulk changes recompute it at the end, and anything
+ * else drops it (see hist_modify) until the next recompute.  Quantiles use
+ * it to start from the top.  Weighted histograms never have it. */
+static inline void
+hist_total_add(histogram_t *hist, hist_bucket_t hb, uint64_t count) {
+  uint64_t total = hist->total + count;
+  if(!hist->total_valid || hist_bucket_isnan(hb)) return;
+  if(total < hist->total) hist->total_valid = 0; /* doesn't fit */
+  else hist->total = total;
+}
+
+static inline void
+hist_total_sub(histogram_t *hist, hist_bucket_t hb, uint64_t count) {
+  if(!hist->total_valid || hist_bucket_isnan(hb)) return;
+  hist->total -= count;
+}
+
+static void
+hist_total_refresh(histogram_t *hist) {
+  uint64_t total = 0, last;
+  int i;
+  hist->total_valid = 0;
+  if(hist->weighted) return;
+  for(i=0;i<hist->used;i++) {
+    if(hist_bucket_isnan(hist->bvs[i].bucket)) continue;
+    last = total;
+    total += hist->bvs[i].count;
+    if(total < last) return;
+  }
+  hist->total = total;
+  hist->total_valid = 1;
+}
+
+/* Every change other than inserting and removing samples starts here */
+static inline int
+hist_modify(histogram_t *hist, int keep) {
+  hist->total_valid = 0;
+  return hist_unshare(hist, keep);
+}
+
 static ssize_t
 bv_size(const histogram_t *h, int idx) {
   int i;
+  if(h->weighted) return 3+8;
   for(i=0; i<BVL8; i++)
     if(h->bvs[idx].count <= bvl_limits[i]) return 3 + i + 1;
   return 3+8;
@@ -260,6 +553,16 @@ bv_write(const histogram_t *h, int idx, void *buff, ssize_t size) {
   uint8_t *cp;
   ssize_t needed;
   bvdatum_t tgt_type = BVL8;
+  if(h->weighted) {
+    if(3 + 8 > size) return -1;
+    cp = buff;
+    cp[0] = h->bvs[idx].bucket.val;
+    cp[1] = h->bvs[idx].bucket.exp;
+    cp[2] = BVDOUBLE;
+    for(i=7;i>=0;i--)
+      cp[10-i] = ((h->bvs[idx].count >> (i * 8)) & 0xff);
+    return 3 + 8;
+  }
   for(i=0; i<BVL8; i++)
     if(h->bvs[idx].count <= bvl_limits[i]) {
       tgt_type = i;
@@ -275,31 +578,60 @@ bv_write(const histogram_t *h, int idx, void *buff, ssize_t size) {
     cp[i+3] = ((h->bvs[idx].count >> (i * 8)) & 0xff);
   return needed;
 }
+/* On return *weighted tells whether *count holds the bits of a weight */
 static ssize_t
-bv_read(histogram_t *h, int idx, const void *buff, ssize_t len) {
+bv_parse(const void *buff, ssize_t len, hist_bucket_t *hb, uint64_t *count,
+         int *weighted) {
   const uint8_t *cp;
-  uint64_t count = 0;
   bvdatum_t tgt_type;
   int i;
 
-  assert(idx == h->used);
   if(len < 3) return -1;
   cp = buff;
   tgt_type = cp[2];
+  hb->val = cp[0];
+  hb->exp = cp[1];
+  *count = 0;
+  if(tgt_type == BVDOUBLE) {
+    double w;
+    if(len < 3 + 8) return -1;
+    for(i=0;i<8;i++)
+      *count = (*count << 8) | cp[i+3];
+    w = weight_of(*count);
+    if(isnan(w) || w < 0) return -1;
+    *count = weight_bits(w);
+    *weighted = 1;
+    return 3 + 8;
+  }
   if(tgt_type > BVL8) return -1;
   if(len < 3 + tgt_type + 1) return -1;
   for(i=tgt_type;i>=0;i--)
-    count |= ((uint64_t)cp[i+3]) << (i * 8);
+    *count |= ((uint64_t)cp[i+3]) << (i * 8);
+  *weighted = 0;
+  return 3 + tgt_type + 1;
+}
+static ssize_t
+bv_read(histogram_t *h, int idx, const void *buff, ssize_t len) {
+  hist_bucket_t hb;
+  uint64_t count;
+  ssize_t incr_read;
+  int weighted;
+
+  assert(idx == h->used);
+  incr_read = bv_parse(buff, len, &hb, &count, &weighted);
+  if(incr_read < 0) return -1;
+  /* weights only fit into weighted histograms, counts fit into both */
+  if(weighted && !h->weighted) return -1;
+  if(!weighted && h->weighted) count = weight_bits((double)count);
   if(count != 0) {
-    h->bvs[idx].bucket.val = cp[0];
-    h->bvs[idx].bucket.exp = cp[1];
-    if(hist_bucket_is_valid(h->bvs[idx].bucket)) {
+    if(hist_bucket_is_valid(hb)) {
       /* Protect against reading invalid/corrupt buckets */
+      h->bvs[idx].bucket = hb;
       h->bvs[idx].count = count;
       h->used++;
     }
   }
-  return 3 + tgt_type + 1;
+  return incr_read;
 }
 
 ssize_t
@@ -400,21 +732,69 @@ hist_serialize_b64(const histogram_t *h, char *b64_serialized_histo_buff, ssize_
   return serialized_length;
 }
 
+ssize_t
+hist_serialize_b64_batch_layout(const histogram_t * const *h, int cnt, ssize_t *offsets) {
+  int i;
+  ssize_t total = 0;
+  for(i=0;i<cnt;i++) {
+    offsets[i] = total;
+    /* the estimate is exact, so is the encoded length we derive from it */
+    total += ((hist_serialize_estimate(h[i]) + 2) / 3) * 4;
+  }
+  offsets[cnt] = total;
+  return total;
+}
+
+int
+hist_serialize_b64_batch(const histogram_t * const *h, const ssize_t *offsets,
+                         int first, int last, char *arena) {
+  int i;
+  for(i=first;i<last;i++) {
+    char *slot = arena + offsets[i];
+    ssize_t slot_len = offsets[i+1] - offsets[i];
+    ssize_t quads = slot_len / 4;
+    /* The binary form goes into the tail of the slot and is encoded forward
+     * in place.  Encoding group j writes [4j, 4j+4) while the unread input
+     * starts at quads + 3j, so with at most 3 * quads input bytes the writes
+     * never overtake the reads and no scratch buffer is needed. */
+    ssize_t serialized_length = hist_serialize(h[i], slot + quads, 3 * quads);
+    if(serialized_length < 0) return -1;
+    if(((serialized_length + 2) / 3) * 4 != slot_len) return -1;
+    copy_of_mtev_b64_encode((unsigned char *)slot + quads, serialized_length,
+                            slot, slot_len);
+  }
+  return 0;
+}
+
+static void hist_sort_coalesce(histogram_t *hist);
+static void compact_rebuild(histogram_t *hist);
+
 ssize_t
 hist_deserialize(histogram_t *h, const void *buff, ssize_t len) {
   const uint8_t *cp = buff;
   ssize_t bytes_read = 0;
   uint16_t nlen, cnt;
+  /* drop a share first, bad_read releases bvs */
+  hist_modify(h, 0);
   if(len < 2) goto bad_read;
-  if(h->bvs) h->allocator->free(h->bvs);
+  hist_bvs_release(h, h->bvs);
   h->bvs = NULL;
   memcpy(&nlen, cp, sizeof(nlen));
   ADVANCE(bytes_read, 2);
   h->used = 0;
   cnt = ntohs(nlen);
   h->allocd = cnt;
-  if(h->allocd == 0) return bytes_read;
-  h->bvs = h->allocator->calloc(h->allocd, sizeof(*h->bvs));
+  if(h->allocd == 0) {
+    /* the bins are gone, so are their bits */
+    if(h->compact) compact_rebuild(h);
+    hist_total_refresh(h);
+    return bytes_read;
+  }
+  if(h->small && cnt <= HIST_INLINE_BINS) {
+    h->bvs = hist_inline_bvs(h);
+    h->allocd = HIST_INLINE_BINS;
+  }
+  else h->bvs = h->allocator->calloc(h->allocd, sizeof(*h->bvs));
   if(!h->bvs) goto bad_read; /* yeah, yeah... bad label name */
   while(len > 0 && cnt > 0) {
     ssize_t incr_read = 0;
@@ -423,15 +803,51 @@ hist_deserialize(histogram_t *h, const void *buff, ssize_t len) {
     ADVANCE(bytes_read, incr_read);
     cnt--;
   }
+  /* we don't trust the writer to have kept the order */
+  hist_sort_coalesce(h);
   return bytes_read;
 
  bad_read:
-  if(h->bvs) h->allocator->free(h->bvs);
+  hist_bvs_release(h, h->bvs);
   h->bvs = NULL;
   h->used = h->allocd = 0;
+  if(h->compact) compact_rebuild(h);
+  hist_total_refresh(h);
   return -1;
 }
 
+ssize_t
+hist_accumulate_serialized(histogram_t *tgt, const void *buff, ssize_t len) {
+  const uint8_t *cp = buff;
+  ssize_t bytes_read = 0, payload_len = len;
+  uint16_t nlen, cnt;
+  hist_bucket_t hb;
+  uint64_t count;
+  int weighted;
+  if(len < 2) return -1;
+  memcpy(&nlen, cp, sizeof(nlen));
+  ADVANCE(bytes_read, 2);
+  /* Walk the payload once to validate it, so a truncated buffer leaves tgt
+   * untouched, then walk it again to apply it. */
+  for(cnt = ntohs(nlen); cnt > 0; cnt--) {
+    ssize_t incr_read = bv_parse(cp, len, &hb, &count, &weighted);
+    if(incr_read < 0) return -1;
+    if(weighted && !tgt->weighted) return -1;
+    ADVANCE(bytes_read, incr_read);
+  }
+  cp = (const uint8_t *)buff + 2;
+  len = payload_len - 2;
+  for(cnt = ntohs(nlen); cnt > 0; cnt--) {
+    ssize_t incr_read = bv_parse(cp, len, &hb, &count, &weighted);
+    if(count != 0 && hist_bucket_is_valid(hb)) {
+      if(weighted) hist_insert_raw_weighted(tgt, hb, weight_of(count));
+      else hist_insert_raw(tgt, hb, count);
+    }
+    cp += incr_read, len -= incr_read;
+  }
+  return bytes_read;
+}
+
 static int
 copy_of_mtev_b64_decode(const char *src, size_t src_len,
                         unsigned char *dest, size_t dest_len) {
@@ -516,6 +932,168 @@ int hist_bucket_cmp(hist_bucket_t h1, hist_bucket_t h2) {
   return 0;
 }
 
+/* Framed serialization
+ *
+ *   magic "CLHF" | version u8 | reserved u8 | reserved u16 |
+ *   payload length u32 | CRC32C of the payload u32 | hist_serialize payload
+ *
+ * All header integers are big-endian.
+ */
+#define FRAME_MAGIC "CLHF"
+#define FRAME_VERSION 1
+#define FRAME_HEADER_SIZE 16
+
+static const uint32_t crc32c_table[256] = {
+  0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f, 0x35f1141c,
+  0x26a1e7e8, 0xd4ca64eb, 0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b,
+  0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24, 0x105ec76f, 0xe235446c,
+  0xf165b798, 0x030e349b, 0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+  0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54, 0x5d1d08bf, 0xaf768bbc,
+  0xbc267848, 0x4e4dfb4b, 0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a,
+  0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35, 0xaa64d611, 0x580f5512,
+  0x4b5fa6e6, 0xb93425e5, 0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+  0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45, 0xf779deae, 0x05125dad,
+  0x1642ae59, 0xe4292d5a, 0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a,
+  0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595, 0x417b1dbc, 0xb3109ebf,
+  0xa0406d4b, 0x522bee48, 0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+  0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687, 0x0c38d26c, 0xfe53516f,
+  0xed03a29b, 0x1f682198, 0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927,
+  0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38, 0xdbfc821c, 0x2997011f,
+  0x3ac7f2eb, 0xc8ac71e8, 0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+  0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096, 0xa65c047d, 0x5437877e,
+  0x4767748a, 0xb50cf789, 0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859,
+  0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46, 0x7198540d, 0x83f3d70e,
+  0x90a324fa, 0x62c8a7f9, 0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+  0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36, 0x3cdb9bdd, 0xceb018de,
+  0xdde0eb2a, 0x2f8b6829, 0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c,
+  0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93, 0x082f63b7, 0xfa44e0b4,
+  0xe9141340, 0x1b7f9043, 0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+  0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3, 0x55326b08, 0xa759e80b,
+  0xb4091bff, 0x466298fc, 0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c,
+  0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033, 0xa24bb5a6, 0x502036a5,
+  0x4370c551, 0xb11b4652, 0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+  0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d, 0xef087a76, 0x1d63f975,
+  0x0e330a81, 0xfc588982, 0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d,
+  0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622, 0x38cc2a06, 0xcaa7a905,
+  0xd9f75af1, 0x2b9cd9f2, 0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+  0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530, 0x0417b1db, 0xf67c32d8,
+  0xe52cc12c, 0x1747422f, 0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff,
+  0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0, 0xd3d3e1ab, 0x21b862a8,
+  0x32e8915c, 0xc083125f, 0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+  0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90, 0x9e902e7b, 0x6cfbad78,
+  0x7fab5e8c, 0x8dc0dd8f, 0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee,
+  0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1, 0x69e9f0d5, 0x9b8273d6,
+  0x88d28022, 0x7ab90321, 0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+  0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81, 0x34f4f86a, 0xc69f7b69,
+  0xd5cf889d, 0x27a40b9e, 0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e,
+  0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351
+};
+
+static uint32_t
+crc32c_sw(uint32_t crc, const uint8_t *cp, size_t len) {
+  while(len--) crc = crc32c_table[(crc ^ *cp++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#ifdef HAVE_CRC32C_SSE42
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_sse42(uint32_t crc, const uint8_t *cp, size_t len) {
+  uint64_t crc64 = crc;
+  while(len >= 8) {
+    uint64_t v;
+    memcpy(&v, cp, sizeof(v));
+    crc64 = _mm_crc32_u64(crc64, v);
+    cp += 8, len -= 8;
+  }
+  crc = (uint32_t)crc64;
+  while(len--) crc = _mm_crc32_u8(crc, *cp++);
+  return crc;
+}
+#endif
+
+static uint32_t
+crc32c(const void *buff, size_t len) {
+#ifdef HAVE_CRC32C_SSE42
+  if(__builtin_cpu_supports("sse4.2"))
+    return ~crc32c_sse42(~(uint32_t)0, buff, len);
+#endif
+  return ~crc32c_sw(~(uint32_t)0, buff, len);
+}
+
+static inline void
+frame_put_u32(uint8_t *cp, uint32_t v) {
+  cp[0] = v >> 24; cp[1] = v >> 16; cp[2] = v >> 8; cp[3] = v;
+}
+static inline uint32_t
+frame_get_u32(const uint8_t *cp) {
+  return ((uint32_t)cp[0] << 24) | ((uint32_t)cp[1] << 16) |
+         ((uint32_t)cp[2] << 8) | cp[3];
+}
+
+ssize_t
+hist_serialize_framed_estimate(const histogram_t *h) {
+  return FRAME_HEADER_SIZE + hist_serialize_estimate(h);
+}
+
+ssize_t
+hist_serialize_framed(const histogram_t *h, void *buff, ssize_t len) {
+  uint8_t *cp = buff;
+  ssize_t payload_len;
+  if(len < FRAME_HEADER_SIZE) return -1;
+  payload_len = hist_serialize(h, cp + FRAME_HEADER_SIZE, len - FRAME_HEADER_SIZE);
+  if(payload_len < 0) return -1;
+  memcpy(cp, FRAME_MAGIC, 4);
+  cp[4] = FRAME_VERSION;
+  cp[5] = cp[6] = cp[7] = 0;
+  frame_put_u32(cp + 8, payload_len);
+  frame_put_u32(cp + 12, crc32c(cp + FRAME_HEADER_SIZE, payload_len));
+  return FRAME_HEADER_SIZE + payload_len;
+}
+
+ssize_t
+hist_framed_validate(const void *buff, ssize_t len) {
+  const uint8_t *cp = buff;
+  ssize_t payload_len, frame_len;
+  uint16_t nlen, cnt;
+  hist_bucket_t hb, prev = hbnan;
+  uint64_t count;
+  int first = 1, weighted;
+
+  if(len < FRAME_HEADER_SIZE) return -1;
+  if(memcmp(cp, FRAME_MAGIC, 4) || cp[4] != FRAME_VERSION) return -1;
+  payload_len = frame_get_u32(cp + 8);
+  if(payload_len < 2 || payload_len > len - FRAME_HEADER_SIZE) return -1;
+  frame_len = FRAME_HEADER_SIZE + payload_len;
+  if(crc32c(cp + FRAME_HEADER_SIZE, payload_len) != frame_get_u32(cp + 12)) return -1;
+
+  /* Unlike hist_deserialize, nothing is skipped here: every bucket must be
+   * valid and in order, and the payload must end exactly after the last one. */
+  cp += FRAME_HEADER_SIZE;
+  len = payload_len;
+  memcpy(&nlen, cp, sizeof(nlen));
+  cp += 2, len -= 2;
+  for(cnt = ntohs(nlen); cnt > 0; cnt--) {
+    ssize_t incr_read = bv_parse(cp, len, &hb, &count, &weighted);
+    if(incr_read < 0) return -1;
+    if(!hist_bucket_is_valid(hb)) return -1;
+    if(!first && hist_bucket_cmp(prev, hb) != 1) return -1;
+    prev = hb;
+    first = 0;
+    cp += incr_read, len -= incr_read;
+  }
+  if(len != 0) return -1;
+  return frame_len;
+}
+
+ssize_t
+hist_deserialize_framed(histogram_t *h, const void *buff, ssize_t len) {
+  ssize_t frame_len = hist_framed_validate(buff, len);
+  if(frame_len < 0) return -1;
+  if(hist_deserialize(h, (const uint8_t *)buff + FRAME_HEADER_SIZE,
+                      frame_len - FRAME_HEADER_SIZE) < 0) return -1;
+  return frame_len;
+}
+
 double
 hist_bucket_to_double(hist_bucket_t hb) {
   uint8_t *pidx;
@@ -594,7 +1172,7 @@ hist_approx_mean(const histogram_t *hist) {
   for(i=0; i<hist->used; i++) {
     if(hist_bucket_isnan(hist->bvs[i].bucket)) continue;
     double midpoint = hist_bucket_midpoint(hist->bvs[i].bucket);
-    double cardinality = (double)hist->bvs[i].count;
+    double cardinality = bv_weight(hist, i);
     divisor += cardinality;
     sum += midpoint * cardinality;
   }
@@ -611,7 +1189,7 @@ hist_approx_sum(const histogram_t *hist) {
   for(i=0; i<hist->used; i++) {
     if(hist_bucket_isnan(hist->bvs[i].bucket)) continue;
     double value = hist_bucket_midpoint(hist->bvs[i].bucket);
-    double cardinality = (double)hist->bvs[i].count;
+    double cardinality = bv_weight(hist, i);
     sum += value * cardinality;
   }
   return sum;
@@ -628,7 +1206,7 @@ hist_approx_stddev(const histogram_t *hist) {
   for(i=0; i<hist->used; i++) {
     if(hist_bucket_isnan(hist->bvs[i].bucket)) continue;
     double midpoint = hist_bucket_midpoint(hist->bvs[i].bucket);
-    double count = hist->bvs[i].count;
+    double count = bv_weight(hist, i);
     total_count += count;
     s1 += midpoint * count;
     s2 += pow(midpoint, 2.0) * count;
@@ -647,7 +1225,7 @@ hist_approx_moment(const histogram_t *hist, double k) {
   for(i=0; i<hist->used; i++) {
     if(hist_bucket_isnan(hist->bvs[i].bucket)) continue;
     double midpoint = hist_bucket_midpoint(hist->bvs[i].bucket);
-    double count = hist->bvs[i].count;
+    double count = bv_weight(hist, i);
     total_count += count;
     sk += pow(midpoint, k) * count;
   }
@@ -660,6 +1238,7 @@ hist_clamp(histogram_t *hist, double lower, double upper) {
   int needs_cull = 0;
   if(!hist) return;
   ASSERT_GOOD_HIST(hist);
+  if(hist_modify(hist, 1) < 0) return;
   for(int i=0; i<hist->used; i++) {
     if(hist_bucket_isnan(hist->bvs[i].bucket)) {
       needs_cull = 1;
@@ -680,6 +1259,7 @@ hist_clamp(histogram_t *hist, double lower, double upper) {
     }
   }
   if(needs_cull) hist_remove_zeroes(hist);
+  hist_total_refresh(hist);
 }
 
 uint64_t hist_approx_count_below(const histogram_t *hist, double threshold) {
@@ -689,11 +1269,40 @@ uint64_t hist_approx_count_above(const histogram_t *hist, double threshold) {
   return hist_approx_count_above_inclusive(hist, threshold);
 }
 
+/* The weighted counterpart of the count_below functions below */
+static double
+hist_weight_below(const histogram_t *hist, double threshold, int inclusive) {
+  int i;
+  double running_weight = 0;
+  if(!hist) return 0;
+  ASSERT_GOOD_HIST(hist);
+  hist_bucket_t tgt = double_to_hist_bucket(threshold);
+  for(i=0; i<hist->used; i++) {
+    if(hist_bucket_isnan(hist->bvs[i].bucket)) continue;
+    if(hist_bucket_cmp(tgt, hist->bvs[i].bucket) < inclusive) {
+      running_weight += bv_weight(hist, i);
+    }
+    else break;
+  }
+  return running_weight;
+}
+
+double
+hist_approx_weight_below(const histogram_t *hist, double threshold) {
+  return hist_weight_below(hist, threshold, 1);
+}
+
+double
+hist_approx_weight_above(const histogram_t *hist, double threshold) {
+  return hist_sample_weight(hist) - hist_weight_below(hist, threshold, 0);
+}
+
 uint64_t
 hist_approx_count_below_inclusive(const histogram_t *hist, double threshold) {
   int i;
   uint64_t running_count = 0;
   if(!hist) return 0;
+  if(hist->weighted) return weight_to_count(hist_weight_below(hist, threshold, 1));
   ASSERT_GOOD_HIST(hist);
   hist_bucket_t tgt = double_to_hist_bucket(threshold);
   for(i=0; i<hist->used; i++) {
@@ -711,6 +1320,7 @@ hist_approx_count_below_exclusive(const histogram_t *hist, double threshold) {
   int i;
   uint64_t running_count = 0;
   if(!hist) return 0;
+  if(hist->weighted) return weight_to_count(hist_weight_below(hist, threshold, 0));
   ASSERT_GOOD_HIST(hist);
   hist_bucket_t tgt = double_to_hist_bucket(threshold);
   for(i=0; i<hist->used; i++) {
@@ -727,6 +1337,8 @@ uint64_t
 hist_approx_count_above_exclusive(const histogram_t *hist, double threshold) {
   int i;
   if(!hist) return 0;
+  if(hist->weighted)
+    return weight_to_count(hist_sample_weight(hist) - hist_weight_below(hist, threshold, 1));
   ASSERT_GOOD_HIST(hist);
   hist_bucket_t tgt = double_to_hist_bucket(threshold);
   uint64_t running_count = hist_sample_count(hist);
@@ -744,6 +1356,8 @@ uint64_t
 hist_approx_count_above_inclusive(const histogram_t *hist, double threshold) {
   int i;
   if(!hist) return 0;
+  if(hist->weighted)
+    return weight_to_count(hist_sample_weight(hist) - hist_weight_below(hist, threshold, 0));
   ASSERT_GOOD_HIST(hist);
   hist_bucket_t tgt = double_to_hist_bucket(threshold);
   uint64_t running_count = hist_sample_count(hist);
@@ -770,17 +1384,17 @@ hist_approx_count_nearby(const histogram_t *hist, double value) {
       bucket_lower = bucket_bound - hist_bucket_to_double_bin_width(hist->bvs[i].bucket);
       bucket_upper = bucket_bound;
       if(bucket_lower < value && value <= bucket_upper)
-        return hist->bvs[i].count;
+        return bv_count(hist, i);
     }
     else if(bucket_bound == 0.0) {
       if(HIST_NEGATIVE_MAX_I < value && value < HIST_POSITIVE_MIN_I)
-        return hist->bvs[i].count;
+        return bv_count(hist, i);
     }
     else {
       bucket_lower = bucket_bound;
       bucket_upper = bucket_bound + hist_bucket_to_double_bin_width(hist->bvs[i].bucket);
       if(bucket_lower <= value && value < bucket_upper)
-        return hist->bvs[i].count;
+        return bv_count(hist, i);
     }
   }
   return 0;
@@ -791,18 +1405,102 @@ typedef enum {
   QTYPE7 = 7
 } qtype_t;
 
-/* 0 success,
- * -1 (empty histogram),
- * -2 (out of order quantile request)
- * -3 (out of bound quantile)
- */
+/* Where, within bucket hb holding n samples after lower_cnt smaller ones,
+ * the sample of (count-normalized) rank qn lies */
+static inline double
+hist_quantile_in_bucket(hist_bucket_t hb, double qn, double lower_cnt, double n, qtype_t qtype) {
+  double bucket_width = hist_bucket_to_double_bin_width(hb),
+         bucket_left = hist_bucket_left(hb);
+  double k;
+
+  if(bucket_width == 0) {
+    // 0 bucket case
+    return bucket_left;
+  }
+  /* Approximate quantile position within a non-zero bucket
+   *
+   * We use the following model:
+   * We represent the bucket by n independent random variables, that are
+   * uniformly distributed across the bucket. Let X_1 < X_2 < ... < X_n
+   * be a sorted version of these. X_k will be Beta(k,n+1-k) distributed.
+   * The expected location of X_k is:
+   *
+   *    x_k  =  bucket_left + k/(n+1) * bucket_width
+   *
+   * [ Variant: The ML estimator for the bucket position is
+   *            at (k-1)/(n-1) for n>1 and 1/2 if n=1 ]
+   */
+  switch (qtype) {
+  case QTYPE1:
+    /*
+     * For Type 1 Quantiles:
+     * A q-quantile for the bucket, will be represented by the sample number:
+     *
+     *  (q = 0)  k = 1
+     *  (q > 0)  k = ceil(q*n)
+     *
+     * so that q=0 => k=1 and q=1 => k=n. This corresponds to Type=1 quantiles
+     * in the Hyndman-Fan list (Statistical Computing, 1996).
+     */
+    assert(qn >= lower_cnt);
+    assert(qn <= lower_cnt + n);
+    k = ceil(qn - lower_cnt);
+    if (k == 0) { // case q == 0 above
+      return bucket_left + 1.0/(n+1) * bucket_width;
+    }
+    // case q > 0 above
+    return bucket_left + k/(n+1) * bucket_width;
+  case QTYPE7:
+    /*
+     * For Type 7 Quantiles, we consider samples at indices:
+     *
+     *  k = floor( q*(n-1) + 1 )
+     *
+     * This corresponds to discretized Type=7 quantiles in
+     * the Hyndman-Fan list (Statistical Computing,
+     * 1996).
+     */
+    k = qn - lower_cnt;
+    return bucket_left + k/(n+1) * bucket_width;
+  }
+  return private_nan;
+}
+
+/* Next lower bin holding samples, -1 if there is none */
 static inline int
-hist_approx_quantile_dispatch(const histogram_t *hist, const double *q_in, int nq, double *q_out, qtype_t qtype) {
-  int i_q, i_b;
-  double total_cnt = 0.0, bucket_width = 0.0,
-         bucket_left = 0.0, lower_cnt = 0.0, upper_cnt = 0.0;
+hist_prev_bin(const histogram_t *hist, int i_b) {
+  while(--i_b >= 0) {
+    if(hist_bucket_isnan(hist->bvs[i_b].bucket)) return -1; /* NaNs sort first */
+    if(hist->bvs[i_b].count) break;
+  }
+  return i_b;
+}
 
-  if(nq < 1) return 0; /* nothing requested, easy to satisfy successfully */
+/* The same walk from the top bin down, for quantiles in the upper half.
+ * q_out holds the count-normalized quantiles; counts are integers here, so
+ * subtracting from the cached total gives exactly the forward sums. */
+static int
+hist_approx_quantile_eval_top(const histogram_t *hist, double total_cnt, int nq, double *q_out, qtype_t qtype) {
+  int i_q, i_b = hist_prev_bin(hist, hist->used), i_lower;
+  double lower_cnt = total_cnt - bv_weight(hist, i_b);
+
+  for(i_q=nq-1;i_q>=0;i_q--) {
+    /* step down while the bin below still reaches the rank */
+    while(lower_cnt >= q_out[i_q] && (i_lower = hist_prev_bin(hist, i_b)) >= 0) {
+      i_b = i_lower;
+      lower_cnt -= bv_weight(hist, i_b);
+    }
+    q_out[i_q] = hist_quantile_in_bucket(hist->bvs[i_b].bucket, q_out[i_q],
+                                         lower_cnt, bv_weight(hist, i_b), qtype);
+  }
+  return 0;
+}
+
+/* q_in must be in order; 0 success, -3 (out of bound quantile) */
+static inline int
+hist_approx_quantile_eval(const histogram_t *hist, const double *q_in, int nq, double *q_out, qtype_t qtype) {
+  int i_q, i_b;
+  double total_cnt = 0.0, lower_cnt = 0.0, upper_cnt = 0.0;
 
   if(!hist) {
     for(i_q=0;i_q<nq;i_q++) q_out[i_q] = private_nan;
@@ -811,17 +1509,17 @@ hist_approx_quantile_dispatch(const histogram_t *hist, const double *q_in, int n
 
   ASSERT_GOOD_HIST(hist);
 
-  /* Sum up all samples from all the bins */
-  for (i_b=0;i_b<hist->used;i_b++) {
-    /* ignore NaN */
-    if(hist_bucket_isnan(hist->bvs[i_b].bucket))
-      continue;
-    total_cnt += (double)hist->bvs[i_b].count;
+  if(hist->total_valid) total_cnt = (double)hist->total;
+  else {
+    /* Sum up all samples from all the bins */
+    for (i_b=0;i_b<hist->used;i_b++) {
+      /* ignore NaN */
+      if(hist_bucket_isnan(hist->bvs[i_b].bucket))
+        continue;
+      total_cnt += bv_weight(hist, i_b);
+    }
   }
 
-  /* Run through the quantiles and make sure they are in order */
-  for (i_q=1;i_q<nq;i_q++) if(q_in[i_q-1] > q_in[i_q]) return -2;
-
   if(total_cnt == 0) {
     for(i_q=0;i_q<nq;i_q++) q_out[i_q] = private_nan;
     return 0;
@@ -841,11 +1539,12 @@ hist_approx_quantile_dispatch(const histogram_t *hist, const double *q_in, int n
   }
 
 
+  if(hist->total_valid && q_in[0] > 0.5)
+    return hist_approx_quantile_eval_top(hist, total_cnt, nq, q_out, qtype);
+
 #define TRACK_VARS(idx) do { \
-  bucket_width = hist_bucket_to_double_bin_width(hist->bvs[idx].bucket); \
-  bucket_left = hist_bucket_left(hist->bvs[idx].bucket); \
   lower_cnt = upper_cnt; \
-  upper_cnt = lower_cnt + hist->bvs[idx].count; \
+  upper_cnt = lower_cnt + bv_weight(hist, idx); \
 } while(0)
 
   /* Find the least bin (first) */
@@ -866,114 +1565,191 @@ hist_approx_quantile_dispatch(const histogram_t *hist, const double *q_in, int n
       i_b++;
       TRACK_VARS(i_b);
     }
-    if(bucket_width == 0) {
-      // 0 bucket case
-      q_out[i_q] = bucket_left;
-    }
-    else {
-      /* Approximate quantile position within a non-zero bucket
-       *
-       * We use the following model:
-       * We represent the bucket by n independent random variables, that are
-       * uniformly distributed across the bucket. Let X_1 < X_2 < ... < X_n
-       * be a sorted version of these. X_k will be Beta(k,n+1-k) distributed.
-       * The expected location of X_k is:
-       *
-       *    x_k  =  bucket_left + k/(n+1) * bucket_width
-       *
-       * [ Variant: The ML estimator for the bucket position is
-       *            at (k-1)/(n-1) for n>1 and 1/2 if n=1 ]
-       */
-      uint64_t n = hist->bvs[i_b].count;
-      double k;
-      switch (qtype) {
-      case QTYPE1:
-        /*
-         * For Type 1 Quantiles:
-         * A q-quantile for the bucket, will be represented by the sample number:
-         *
-         *  (q = 0)  k = 1
-         *  (q > 0)  k = ceil(q*n)
-         *
-         * so that q=0 => k=1 and q=1 => k=n. This corresponds to Type=1 quantiles
-         * in the Hyndman-Fan list (Statistical Computing, 1996).
-         */
-        ;
-        double qn = q_out[i_q];
-        assert(qn >= lower_cnt);
-        assert(qn <= upper_cnt);
-        k = ceil(qn - lower_cnt);
-        if (k == 0) { // case q == 0 above
-          q_out[i_q] = bucket_left + 1.0/(n+1) * bucket_width;
-        }
-        else { // case q > 0 above
-          q_out[i_q] = bucket_left + k/(n+1) * bucket_width;
-        }
-        break;
-      case QTYPE7:
-        /*
-         * For Type 7 Quantiles, we consider samples at indices:
-         *
-         *  k = floor( q*(n-1) + 1 )
-         *
-         * This corresponds to discretized Type=7 quantiles in
-         * the Hyndman-Fan list (Statistical Computing,
-         * 1996).
-         */
-        ;
-        k = q_out[i_q] - lower_cnt;
-        q_out[i_q] = bucket_left + k/(n+1) * bucket_width;
-        break;
-      }
-    }
+    q_out[i_q] = hist_quantile_in_bucket(hist->bvs[i_b].bucket, q_out[i_q],
+                                         lower_cnt, bv_weight(hist, i_b), qtype);
   }
   return 0;
 }
 
-int
-hist_approx_quantile(const histogram_t *hist, const double *q_in, int nq, double *q_out) {
-  return hist_approx_quantile_dispatch(hist, q_in, nq, q_out, QTYPE1);
-}
 
+/* 0 success,
+ * -1 (empty histogram),
+ * -2 (out of order quantile request)
+ * -3 (out of bound quantile)
+ */
+static inline int
+hist_approx_quantile_dispatch(const histogram_t *hist, const double *q_in, int nq, double *q_out, qtype_t qtype) {
+  int i_q;
+
+  if(nq < 1) return 0; /* nothing requested, easy to satisfy successfully */
 
-int
-hist_approx_quantile7(const histogram_t *hist, const double *q_in, int nq, double *q_out) {
-  return hist_approx_quantile_dispatch(hist, q_in, nq, q_out, QTYPE7);
+  /* Run through the quantiles and make sure they are in order */
+  if(hist) for (i_q=1;i_q<nq;i_q++) if(q_in[i_q-1] > q_in[i_q]) return -2;
+
+  return hist_approx_quantile_eval(hist, q_in, nq, q_out, qtype);
 }
 
-hist_bucket_t
-int_scale_to_hist_bucket(int64_t value, int scale) {
-  hist_bucket_t hb = { 0, 0 };
-  int sign = 1;
-  if(unlikely(value == 0)) return hb;
-  scale++;
-  if(unlikely(value < 0)) {
-    if(unlikely(value == INT64_MIN)) value = INT64_MAX;
-    else value = 0 - value;
-    sign = -1;
-  }
-  if(unlikely(value < 10)) {
-    value *= 10;
-    scale -= 1;
-  }
-  while(unlikely(value >= 100)) {
-    value /= 10;
-    scale++;
-  }
-  if(unlikely(scale < -128)) return hb;
-  if(unlikely(scale > 127)) return hbnan;
-  hb.val = sign * value;
-  hb.exp = scale;
-  ASSERT_GOOD_BUCKET(hb);
-  return hb;
+/* Checks q_in once for the whole batch, every row is then evaluated
+ * without it. */
+static int
+hist_approx_quantile_batch_dispatch(const histogram_t * const *h, int first, int last,
+                                    const double *q_in, int nq, double *q_out, qtype_t qtype) {
+  int i, i_q;
+  if(nq < 1) return 0;
+  for (i_q=0;i_q<nq;i_q++) {
+    if(i_q > 0 && q_in[i_q-1] > q_in[i_q]) return -2;
+    if(q_in[i_q] < 0.0 || q_in[i_q] > 1.0) return -3;
+  }
+  for(i=first;i<last;i++)
+    hist_approx_quantile_eval(h[i], q_in, nq, q_out + (size_t)i * nq, qtype);
+  return 0;
 }
 
-hist_bucket_t
-double_to_hist_bucket(double d) {
-  hist_bucket_t hb = { (int8_t)0xff, 0 }; // NaN
-  assert(private_nan != 0);
-  if(unlikely(isnan(d))) return hb;
-  if(unlikely(isinf(d))) return hb;
+/* Quantiles of the merge of cnt histograms without building it: a min-heap
+ * of per-histogram cursors yields the buckets of the merge in order, and
+ * the walk stops as soon as the last quantile is placed. */
+struct merge_cursor {
+  const histogram_t *h;
+  int idx;
+};
+
+static inline hist_bucket_t
+merge_cursor_bucket(const struct merge_cursor *c) {
+  return c->h->bvs[c->idx].bucket;
+}
+
+/* move to the next bin that holds samples, 0 when there is none */
+static inline int
+merge_cursor_next(struct merge_cursor *c) {
+  for(c->idx++; c->idx < c->h->used; c->idx++) {
+    if(hist_bucket_isnan(c->h->bvs[c->idx].bucket)) continue;
+    if(c->h->bvs[c->idx].count == 0) continue;
+    return 1;
+  }
+  return 0;
+}
+
+static inline void
+merge_heap_down(struct merge_cursor *heap, int nheap, int i) {
+  struct merge_cursor tmp = heap[i];
+  for(;;) {
+    int child = 2 * i + 1;
+    if(child >= nheap) break;
+    if(child + 1 < nheap &&
+       hist_bucket_cmp(merge_cursor_bucket(&heap[child + 1]), merge_cursor_bucket(&heap[child])) > 0)
+      child++;
+    if(hist_bucket_cmp(merge_cursor_bucket(&heap[child]), merge_cursor_bucket(&tmp)) <= 0) break;
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = tmp;
+}
+
+static int
+hist_approx_quantile_merged_dispatch(const histogram_t * const *src, int cnt,
+                                     const double *q_in, int nq, double *q_out, qtype_t qtype) {
+  struct merge_cursor heap_static[1024];
+  struct merge_cursor *heap = heap_static;
+  double total_cnt = 0.0, lower_cnt = 0.0, upper_cnt = 0.0, n = 0.0;
+  hist_bucket_t hb = hbnan;
+  int i, i_q, nheap = 0, have = 0;
+
+  if(nq < 1) return 0;
+  for (i_q=0;i_q<nq;i_q++) {
+    if(i_q > 0 && q_in[i_q-1] > q_in[i_q]) return -2;
+    if(q_in[i_q] < 0.0 || q_in[i_q] > 1.0) return -3;
+  }
+  if(cnt > 1024) {
+    heap = malloc(cnt * sizeof(*heap));
+    if(!heap) return -1;
+  }
+  for(i=0;i<cnt;i++) {
+    if(!src[i]) continue;
+    ASSERT_GOOD_HIST(src[i]);
+    heap[nheap].h = src[i];
+    heap[nheap].idx = -1;
+    if(!merge_cursor_next(&heap[nheap])) continue;
+    for(int j=heap[nheap].idx;j<src[i]->used;j++)
+      if(!hist_bucket_isnan(src[i]->bvs[j].bucket)) total_cnt += bv_weight(src[i], j);
+    nheap++;
+  }
+  if(total_cnt == 0) {
+    for(i_q=0;i_q<nq;i_q++) q_out[i_q] = private_nan;
+    goto out;
+  }
+  for(i=nheap/2-1;i>=0;i--) merge_heap_down(heap, nheap, i);
+
+  for(i_q=0;i_q<nq;i_q++) {
+    double qn = (qtype == QTYPE1) ? total_cnt * q_in[i_q]
+                                  : floor( (total_cnt - 1) * q_in[i_q]  + 1 );
+    /* take the next bucket of the merge while the rank lies beyond it */
+    while(nheap > 0 && (!have || upper_cnt < qn)) {
+      hb = merge_cursor_bucket(&heap[0]);
+      n = 0.0;
+      do {
+        n += bv_weight(heap[0].h, heap[0].idx);
+        if(!merge_cursor_next(&heap[0])) heap[0] = heap[--nheap];
+        if(nheap > 0) merge_heap_down(heap, nheap, 0);
+      } while(nheap > 0 && hist_bucket_cmp(merge_cursor_bucket(&heap[0]), hb) == 0);
+      lower_cnt = upper_cnt;
+      upper_cnt = lower_cnt + n;
+      have = 1;
+    }
+    q_out[i_q] = hist_quantile_in_bucket(hb, qn, lower_cnt, n, qtype);
+  }
+ out:
+  if(heap != heap_static) free(heap);
+  return 0;
+}
+
+int
+hist_approx_quantile(const histogram_t *hist, const double *q_in, int nq, double *q_out) {
+  return hist_approx_quantile_dispatch(hist, q_in, nq, q_out, QTYPE1);
+}
+
+
+int
+hist_approx_quantile7(const histogram_t *hist, const double *q_in, int nq, double *q_out) {
+  return hist_approx_quantile_dispatch(hist, q_in, nq, q_out, QTYPE7);
+}
+
+int
+hist_approx_quantile_batch(const histogram_t * const *h, int first, int last,
+                           const double *q_in, int nq, double *q_out) {
+  return hist_approx_quantile_batch_dispatch(h, first, last, q_in, nq, q_out, QTYPE1);
+}
+
+int
+hist_approx_quantile_merged(const histogram_t * const *src, int cnt,
+                            const double *q_in, int nq, double *q_out) {
+  return hist_approx_quantile_merged_dispatch(src, cnt, q_in, nq, q_out, QTYPE1);
+}
+
+int
+hist_approx_quantile7_merged(const histogram_t * const *src, int cnt,
+                             const double *q_in, int nq, double *q_out) {
+  return hist_approx_quantile_merged_dispatch(src, cnt, q_in, nq, q_out, QTYPE7);
+}
+
+int
+hist_approx_quantile7_batch(const histogram_t * const *h, int first, int last,
+                            const double *q_in, int nq, double *q_out) {
+  return hist_approx_quantile_batch_dispatch(h, first, last, q_in, nq, q_out, QTYPE7);
+}
+
+hist_bucket_t
+int_scale_to_hist_bucket(int64_t value, int scale) {
+  hist_bucket_t hb = hist_int_scale_bucket_inline(value, scale);
+  ASSERT_GOOD_BUCKET(hb);
+  return hb;
+}
+
+hist_bucket_t
+double_to_hist_bucket(double d) {
+  hist_bucket_t hb = { (int8_t)0xff, 0 }; // NaN
+  assert(private_nan != 0);
+  if(unlikely(isnan(d))) return hb;
+  if(unlikely(isinf(d))) return hb;
   else if(unlikely(d==0)) hb.val = 0;
   else {
     int big_exp;
@@ -1016,8 +1792,83 @@ double_to_hist_bucket(double d) {
   return hb;
 }
 
+static inline int
+bucket_eq(hist_bucket_t a, hist_bucket_t b) {
+  return *(uint16_t *)&a == *(uint16_t *)&b;
+}
+
+/* NaN, then negatives from -inf up, zero, then positives */
+#define COMPACT_ZERO (1 + 90 * 256)
+static inline int
+compact_ordinal(hist_bucket_t hb) {
+  if(hb.val == 0) return COMPACT_ZERO;
+  if(hist_bucket_isnan(hb)) return 0;
+  if(hb.val < 0) return 1 + (127 - hb.exp) * 90 + (hb.val + 99);
+  return COMPACT_ZERO + 1 + (hb.exp + 128) * 90 + (hb.val - 10);
+}
+
+/* Compact histograms keep a single representation of zero and NaN */
+static inline hist_bucket_t
+compact_canonical(hist_bucket_t hb) {
+  if(hb.val == 0) hb.exp = 0;
+  else if(hist_bucket_isnan(hb)) hb = hbnan;
+  return hb;
+}
+
+static inline int
+popcount64(uint64_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_popcountll(v);
+#else
+  v = v - ((v >> 1) & 0x5555555555555555ULL);
+  v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+  v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+  return (int)((v * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+static inline int
+compact_rank(const struct histogram_compact *hc, int ord) {
+  int w = ord / 64, i;
+  int r = hc->rank[w / COMPACT_BLOCK_WORDS];
+  for(i = w - w % COMPACT_BLOCK_WORDS; i < w; i++) r += popcount64(hc->bits[i]);
+  return r + popcount64(hc->bits[w] & ((1ULL << (ord % 64)) - 1));
+}
+
+static inline int
+compact_find(const histogram_t *hist, hist_bucket_t hb, int *idx) {
+  const struct histogram_compact *hc = (const struct histogram_compact *)hist;
+  int ord = compact_ordinal(hb);
+  *idx = compact_rank(hc, ord);
+  return (hc->bits[ord / 64] >> (ord % 64)) & 1;
+}
+
+static void
+compact_add(histogram_t *hist, hist_bucket_t hb) {
+  struct histogram_compact *hc = (struct histogram_compact *)hist;
+  int ord = compact_ordinal(hb), b;
+  hc->bits[ord / 64] |= 1ULL << (ord % 64);
+  for(b = ord / 64 / COMPACT_BLOCK_WORDS + 1; b < COMPACT_BLOCKS; b++) hc->rank[b]++;
+}
+
+static void
+compact_rebuild(histogram_t *hist) {
+  struct histogram_compact *hc = (struct histogram_compact *)hist;
+  int i, b, r = 0;
+  memset(hc->bits, 0, sizeof(hc->bits));
+  for(i=0;i<hist->used;i++) {
+    int ord = compact_ordinal(hist->bvs[i].bucket);
+    hc->bits[ord / 64] |= 1ULL << (ord % 64);
+  }
+  for(b=0;b<COMPACT_BLOCKS;b++) {
+    hc->rank[b] = r;
+    for(i=b*COMPACT_BLOCK_WORDS;i<(b+1)*COMPACT_BLOCK_WORDS && i<COMPACT_WORDS;i++)
+      r += popcount64(hc->bits[i]);
+  }
+}
+
 static int
-hist_internal_find(histogram_t *hist, hist_bucket_t hb, int *idx) {
+hist_internal_search(const histogram_t *hist, hist_bucket_t hb, int *idx) {
   /* This is a simple binary search returning the idx in which
    * the specified bucket belongs... returning 1 if it is there
    * or 0 if the value would need to be inserted here (moving the
@@ -1025,19 +1876,7 @@ hist_internal_find(histogram_t *hist, hist_bucket_t hb, int *idx) {
    */
   int rv = -1, l = 0, r = hist->used - 1;
   *idx = 0;
-  ASSERT_GOOD_HIST(hist);
   if(unlikely(hist->used == 0)) return 0;
-  if(hist->fast) {
-    struct histogram_fast *hfast = (struct histogram_fast *)hist;
-    struct hist_flevel *faster = (struct hist_flevel *)&hb;
-    if(hfast->faster[faster->l1]) {
-      *idx = hfast->faster[faster->l1][faster->l2];
-      if(*idx) {
-        (*idx)--;
-        return 1;
-      }
-    }
-  }
   while(l < r) {
     int check = (r+l)/2;
     rv = hist_bucket_cmp(hist->bvs[check].bucket, hb);
@@ -1057,53 +1896,194 @@ hist_internal_find(histogram_t *hist, hist_bucket_t hb, int *idx) {
   return 0;
 }
 
+static int
+hist_internal_find(histogram_t *hist, hist_bucket_t hb, int *idx) {
+  int found;
+  uint16_t *hint = NULL;
+  ASSERT_GOOD_HIST(hist);
+  if(hist->compact) return compact_find(hist, hb, idx);
+  if(hist->fast) {
+    /* The fast index holds hints (position + 1), not the truth: inserts only
+     * index the new bucket and removals index nothing, so entries go stale.
+     * A hint is trusted once the bucket it points at checks out.  The slot
+     * after it is the usual spot after an insert below, so try that too
+     * before searching, and repair the hint either way. */
+    struct histogram_fast *hfast = (struct histogram_fast *)hist;
+    struct hist_flevel *faster = (struct hist_flevel *)&hb;
+    if(hfast->faster[faster->l1]) {
+      int p;
+      hint = &hfast->faster[faster->l1][faster->l2];
+      p = *hint;
+      if(p && p <= hist->used && bucket_eq(hist->bvs[p-1].bucket, hb)) {
+        *idx = p - 1;
+        return 1;
+      }
+      if(p && p < hist->used && bucket_eq(hist->bvs[p].bucket, hb)) {
+        *hint = p + 1;
+        *idx = p;
+        return 1;
+      }
+    }
+  }
+  found = hist_internal_search(hist, hb, idx);
+  if(found && hint) *hint = *idx + 1;
+  return found;
+}
+
+static inline void
+hist_fast_index(histogram_t *hist, int idx) {
+  struct histogram_fast *hfast = (struct histogram_fast *)hist;
+  struct hist_flevel *faster = (struct hist_flevel *)&hist->bvs[idx].bucket;
+  if(hfast->faster[faster->l1] == NULL) {
+    hfast->faster[faster->l1] = hist->allocator->calloc(256, sizeof(uint16_t));
+    /* no page, no hint: lookups fall back to the binary search */
+    if(hfast->faster[faster->l1] == NULL) return;
+  }
+  hfast->faster[faster->l1][faster->l2] = idx+1;
+}
+
+/* After bulk changes; stale entries of buckets that are gone can stay */
 static void
-hist_fast_rebuild(histogram_t *hist, int idx, int zero_first) {
+hist_fast_rebuild(histogram_t *hist) {
   int i;
-  struct histogram_fast *hfast = (struct histogram_fast *)hist;
-  if(zero_first) {
-    for(i=0; i<256; i++) {
-      if(hfast->faster[i]) memset(hfast->faster[i], 0, 256 * sizeof(uint16_t));
+  for(i=0;i<hist->used;i++) hist_fast_index(hist, i);
+}
+
+static int
+bv_qsort_cmp(const void *a, const void *b) {
+  return -hist_bucket_cmp(((const struct hist_bv_pair *)a)->bucket,
+                          ((const struct hist_bv_pair *)b)->bucket);
+}
+
+/* Restore the invariants after bvs[0 .. used) was filled in bulk with
+ * valid buckets: check the order in one pass, and only if that fails sort
+ * and merge duplicates.  Then index everything at once. */
+static void
+hist_sort_coalesce(histogram_t *hist) {
+  int i, j;
+  if(hist->compact)
+    for(i=0;i<hist->used;i++) hist->bvs[i].bucket = compact_canonical(hist->bvs[i].bucket);
+  for(i=1;i<hist->used;i++)
+    if(hist_bucket_cmp(hist->bvs[i-1].bucket, hist->bvs[i].bucket) <= 0) break;
+  if(i < hist->used) {
+    qsort(hist->bvs, hist->used, sizeof(*hist->bvs), bv_qsort_cmp);
+    for(i=1,j=0;i<hist->used;i++) {
+      if(hist_bucket_cmp(hist->bvs[j].bucket, hist->bvs[i].bucket) == 0) {
+        uint64_t newval;
+        if(hist->weighted) {
+          hist->bvs[j].count = weight_bits(weight_of(hist->bvs[j].count) +
+                                           weight_of(hist->bvs[i].count));
+          continue;
+        }
+        newval = hist->bvs[j].count + hist->bvs[i].count;
+        if(newval < hist->bvs[j].count) newval = ~(uint64_t)0;
+        hist->bvs[j].count = newval;
+      }
+      else hist->bvs[++j] = hist->bvs[i];
     }
+    hist->used = j + 1;
+  }
+  if(hist->fast) hist_fast_rebuild(hist);
+  if(hist->compact) compact_rebuild(hist);
+  hist_total_refresh(hist);
+  ASSERT_GOOD_HIST(hist);
+}
+
+int
+hist_set_sorted(histogram_t *hist, const hist_bucket_t *buckets,
+                const uint64_t *counts, int n) {
+  int i;
+  if(n < 0) return -1;
+  if(hist_modify(hist, 0) < 0) return -1;
+  if(n > MAX_HIST_BINS) {
+    /* only possible with duplicates, take the slow road */
+    hist_clear(hist);
+    for(i=0;i<n;i++)
+      if(hist_bucket_is_valid(buckets[i])) hist_insert_raw(hist, buckets[i], counts[i]);
+    return hist->used;
+  }
+  if(n > hist->allocd) {
+    struct hist_bv_pair *newbvs = hist->allocator->calloc(n, sizeof(*newbvs));
+    if(!newbvs) return -1;
+    hist_bvs_release(hist, hist->bvs);
+    hist->bvs = newbvs;
+    hist->allocd = n;
   }
-  for(i=idx;i<hist->used;i++) {
-    struct hist_flevel *faster = (struct hist_flevel *)&hist->bvs[i].bucket;
-    if(hfast->faster[faster->l1] == NULL)
-      hfast->faster[faster->l1] = hist->allocator->calloc(256, sizeof(uint16_t));
-    hfast->faster[faster->l1][faster->l2] = i+1;
+  hist->used = 0;
+  for(i=0;i<n;i++) {
+    if(!hist_bucket_is_valid(buckets[i])) continue;
+    hist->bvs[hist->used].bucket = buckets[i];
+    hist->bvs[hist->used].count = hist->weighted ? weight_bits((double)counts[i]) : counts[i];
+    hist->used++;
+  }
+  hist_sort_coalesce(hist);
+  return hist->used;
+}
+
+histogram_t *
+hist_from_sorted(const hist_bucket_t *buckets, const uint64_t *counts, int n) {
+  return hist_from_sorted_with_allocator(buckets, counts, n, &default_allocator);
+}
+
+histogram_t *
+hist_from_sorted_with_allocator(const hist_bucket_t *buckets, const uint64_t *counts,
+                                int n, const hist_allocator_t *allocator) {
+  histogram_t *hist = hist_alloc_nbins_with_allocator(n, allocator);
+  if(hist && hist_set_sorted(hist, buckets, counts, n) < 0) {
+    hist_free(hist);
+    return NULL;
   }
+  return hist;
 }
 
 uint64_t
 hist_insert_raw_end(histogram_t *hist, hist_bucket_t hb, uint64_t count) {
+  if(hist_unshare(hist, 1) < 0) return 0;
+  /* not past the last bin (cmp > 0 means last < hb) or no room: slow path */
   if(unlikely(hist->used == hist->allocd ||
-              (hist->used > 0 && hist_bucket_cmp(hist->bvs[hist->used-1].bucket, hb) >= 0))) {
-    assert(0);
+              (hist->used > 0 && hist_bucket_cmp(hist->bvs[hist->used-1].bucket, hb) <= 0))) {
     return hist_insert_raw(hist, hb, count);
   }
+  if(hist->compact) {
+    hb = compact_canonical(hb);
+    compact_add(hist, hb);
+  }
   hist->bvs[hist->used].bucket = hb;
-  hist->bvs[hist->used].count = count;
+  hist->bvs[hist->used].count = hist->weighted ? weight_bits((double)count) : count;
   hist->used++;
   if(hist->fast) {
-    hist_fast_rebuild(hist, hist->used-1, 0);
+    hist_fast_index(hist, hist->used-1);
   }
+  hist_total_add(hist, hb, count);
   return count;
 }
-uint64_t
-hist_insert_raw(histogram_t *hist, hist_bucket_t hb, uint64_t count) {
+/* For weighted histograms count holds the bits of the weight to add */
+static uint64_t
+hist_insert_raw_internal(histogram_t *hist, hist_bucket_t hb, uint64_t count) {
   int found, idx;
   ASSERT_GOOD_HIST(hist);
+  if(hist_unshare(hist, 1) < 0) return 0;
   if(unlikely(hist->bvs == NULL)) {
-    hist->bvs = hist->allocator->malloc(DEFAULT_HIST_SIZE * sizeof(*hist->bvs));
-    hist->allocd = DEFAULT_HIST_SIZE;
+    if(hist->small) {
+      hist->bvs = hist_inline_bvs(hist);
+      hist->allocd = HIST_INLINE_BINS;
+    }
+    else {
+      struct hist_bv_pair *bvs = hist->allocator->malloc(DEFAULT_HIST_SIZE * sizeof(*hist->bvs));
+      if(unlikely(bvs == NULL)) return 0;
+      hist->bvs = bvs;
+      hist->allocd = DEFAULT_HIST_SIZE;
+    }
   }
   found = hist_internal_find(hist, hb, &idx);
   if(unlikely(!found)) {
+    if(hist->compact) hb = compact_canonical(hb);
     if(unlikely(hist->used == hist->allocd)) {
       /* A resize is required */
       histogram_t dummy;
       dummy.bvs = hist->allocator->malloc((hist->allocd + DEFAULT_HIST_SIZE) *
                          sizeof(*hist->bvs));
+      if(unlikely(dummy.bvs == NULL)) return 0;
       if(idx > 0)
         memcpy(dummy.bvs, hist->bvs, idx * sizeof(*hist->bvs));
       dummy.bvs[idx].bucket = hb;
@@ -1111,7 +2091,7 @@ hist_insert_raw(histogram_t *hist, hist_bucket_t hb, uint64_t count) {
       if(idx < hist->used)
         memcpy(dummy.bvs + idx + 1, hist->bvs + idx,
                (hist->used - idx)*sizeof(*hist->bvs));
-      hist->allocator->free(hist->bvs);
+      hist_bvs_release(hist, hist->bvs);
       hist->bvs = dummy.bvs;
       hist->allocd += DEFAULT_HIST_SIZE;
     }
@@ -1122,11 +2102,17 @@ hist_insert_raw(histogram_t *hist, hist_bucket_t hb, uint64_t count) {
       hist->bvs[idx].bucket = hb;
       hist->bvs[idx].count = count;
     }
+    /* only now that the bin has a home, so a failed resize leaves it alone */
+    if(hist->compact) compact_add(hist, hb);
     hist->used++;
     if(hist->fast) {
-      hist_fast_rebuild(hist, idx, 0);
+      /* buckets above moved up one, their hints are now off by one */
+      hist_fast_index(hist, idx);
     }
   }
+  else if(hist->weighted) {
+    hist->bvs[idx].count = weight_bits(weight_of(hist->bvs[idx].count) + weight_of(count));
+  }
   else { // found
     /* Just need to update the counters */
     uint64_t newval = hist->bvs[idx].count + count;
@@ -1135,10 +2121,39 @@ hist_insert_raw(histogram_t *hist, hist_bucket_t hb, uint64_t count) {
     count = newval - hist->bvs[idx].count;
     hist->bvs[idx].count = newval;
   }
+  hist_total_add(hist, hb, count);
   ASSERT_GOOD_HIST(hist);
   return count;
 }
 
+uint64_t
+hist_insert_raw(histogram_t *hist, hist_bucket_t hb, uint64_t count) {
+  if(unlikely(hist->weighted)) {
+    hist_insert_raw_internal(hist, hb, weight_bits((double)count));
+    return count;
+  }
+  return hist_insert_raw_internal(hist, hb, count);
+}
+
+double
+hist_insert_raw_weighted(histogram_t *hist, hist_bucket_t hb, double weight) {
+  if(!(weight > 0)) return 0;
+  /* plain histograms take the weight rounded to a count */
+  if(!hist->weighted) return (double)hist_insert_raw(hist, hb, weight_to_count(weight));
+  hist_insert_raw_internal(hist, hb, weight_bits(weight));
+  return weight;
+}
+
+double
+hist_insert_weighted(histogram_t *hist, double val, double weight) {
+  return hist_insert_raw_weighted(hist, double_to_hist_bucket(val), weight);
+}
+
+double
+hist_insert_intscale_weighted(histogram_t *hist, int64_t val, int scale, double weight) {
+  return hist_insert_raw_weighted(hist, int_scale_to_hist_bucket(val, scale), weight);
+}
+
 uint64_t
 hist_insert(histogram_t *hist, double val, uint64_t count) {
   return hist_insert_raw(hist, double_to_hist_bucket(val), count);
@@ -1151,30 +2166,31 @@ hist_insert_intscale(histogram_t *hist, int64_t val, int scale, uint64_t count)
 
 uint64_t
 hist_remove(histogram_t *hist, double val, uint64_t count) {
-  hist_bucket_t hb;
-  int idx;
-  ASSERT_GOOD_HIST(hist);
-  hb = double_to_hist_bucket(val);
-  if(hist_internal_find(hist, hb, &idx)) {
-    uint64_t newval = hist->bvs[idx].count - count;
-    if(newval > hist->bvs[idx].count) newval = 0; /* we rolled */
-    count = hist->bvs[idx].count - newval;
-    hist->bvs[idx].count = newval;
-    ASSERT_GOOD_HIST(hist);
-    return count;
-  }
-  return 0;
+  return hist_remove_raw(hist, double_to_hist_bucket(val), count);
 }
 
 uint64_t
 hist_remove_raw(histogram_t *hist, hist_bucket_t hb, uint64_t count) {
   int idx;
   ASSERT_GOOD_HIST(hist);
+  if(hist_unshare(hist, 1) < 0) return 0;
   if(hist_internal_find(hist, hb, &idx)) {
-    uint64_t newval = hist->bvs[idx].count - count;
+    uint64_t newval;
+    if(hist->weighted) {
+      double w = weight_of(hist->bvs[idx].count);
+      if((double)count >= w) {
+        /* take all of it, even a residue too small to round to a count */
+        hist->bvs[idx].count = weight_bits(0);
+        return weight_to_count(w);
+      }
+      hist->bvs[idx].count = weight_bits(w - (double)count);
+      return count;
+    }
+    newval = hist->bvs[idx].count - count;
     if(newval > hist->bvs[idx].count) newval = 0; /* we rolled */
     count = hist->bvs[idx].count - newval;
     hist->bvs[idx].count = newval;
+    hist_total_sub(hist, hb, count);
     ASSERT_GOOD_HIST(hist);
     return count;
   }
@@ -1184,33 +2200,196 @@ hist_remove_raw(histogram_t *hist, hist_bucket_t hb, uint64_t count) {
 void
 hist_remove_zeroes(histogram_t *hist) {
   int i=0,j=0;
-  if(hist == NULL) return;
+  if(hist == NULL || hist_unshare(hist, 1) < 0) return;
   for(;i<hist->used;i++,j++) {
     if(hist->bvs[i].count > 0) {
-      if(i != j) hist->bvs[j] = hist->bvs[i];
+      if(i != j) {
+        hist->bvs[j] = hist->bvs[i];
+        if(hist->fast) hist_fast_index(hist, j);
+      }
     } else {
       j--;
     }
   }
   hist->used = j;
-  if(hist->fast) {
-    hist_fast_rebuild(hist, 0, 1);
-  }
+  if(hist->compact && i != j) compact_rebuild(hist);
+}
+
+/* Weights need no sampling, they scale exactly */
+static void
+hist_scale_weights(histogram_t *hist, double factor) {
+  if(hist_modify(hist, 1) < 0) return;
+  for(int i=0;i<hist->used;i++)
+    hist->bvs[i].count = weight_bits(weight_of(hist->bvs[i].count) * factor);
+  hist_remove_zeroes(hist);
 }
 
 void
 hist_downsample(histogram_t *hist, double factor) {
+  hist_downsample_with_uniform(hist, factor, drand48_uniform, NULL);
+}
+
+void
+hist_downsample_r(histogram_t *hist, double factor, hist_rng_t *rng) {
+  hist_downsample_with_uniform(hist, factor, rng_uniform, rng);
+}
+
+void
+hist_downsample_with_uniform(histogram_t *hist, double factor,
+                             double (*uniform)(void *closure), void *closure) {
   int zeroes = 0;
   if(factor < 0) factor = 0;
   if(factor > 1) factor = 1;
-  if(!hist) return;
+  if(!hist || hist_modify(hist, 1) < 0) return;
+  if(hist->weighted) {
+    hist_scale_weights(hist, factor);
+    return;
+  }
   for(int i=0;i<hist->used;i++) {
     if(hist->bvs[i].count > 0) {
-      hist->bvs[i].count = binomial_reduce(hist->bvs[i].count, factor);
+      hist->bvs[i].count = binomial_reduce_random(hist->bvs[i].count, factor,
+                                                  uniform, closure);
     }
     if(hist->bvs[i].count == 0) zeroes++;
   }
   if(zeroes) hist_remove_zeroes(hist);
+  hist_total_refresh(hist);
+}
+
+/* Exact 128 bit arithmetic for hist_downsample_deterministic.  factor is
+ * m / 2^k with an integer m < 2^53, so count * factor splits into an integer
+ * share and a remainder without any rounding, on every platform. */
+struct downsample_u128 {
+  uint64_t hi, lo;
+};
+
+static struct downsample_u128
+downsample_mul(uint64_t a, uint64_t b) {
+  struct downsample_u128 r;
+  uint64_t a_lo = a & 0xffffffff, a_hi = a >> 32;
+  uint64_t b_lo = b & 0xffffffff, b_hi = b >> 32;
+  uint64_t ll = a_lo * b_lo, lh = a_lo * b_hi, hl = a_hi * b_lo, hh = a_hi * b_hi;
+  uint64_t mid = (ll >> 32) + (lh & 0xffffffff) + (hl & 0xffffffff);
+  r.lo = (mid << 32) | (ll & 0xffffffff);
+  r.hi = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+  return r;
+}
+
+/* v >> k, v < 2^117 */
+static uint64_t
+downsample_shift(struct downsample_u128 v, int k) {
+  if(k >= 128) return 0;
+  if(k >= 64) return v.hi >> (k - 64);
+  return (v.lo >> k) | (v.hi << (64 - k));
+}
+
+/* v mod 2^k */
+static struct downsample_u128
+downsample_mask(struct downsample_u128 v, int k) {
+  if(k < 64) {
+    v.hi = 0;
+    v.lo &= ((uint64_t)1 << k) - 1;
+  }
+  else if(k < 128) v.hi &= ((uint64_t)1 << (k - 64)) - 1;
+  return v;
+}
+
+/* a += b, returns the carry */
+static int
+downsample_add(struct downsample_u128 *a, struct downsample_u128 b) {
+  uint64_t lo = a->lo + b.lo;
+  uint64_t hi = a->hi + b.hi;
+  int carry = hi < a->hi;
+  if(lo < a->lo) {
+    hi++;
+    if(hi == 0) carry = 1;
+  }
+  a->lo = lo;
+  a->hi = hi;
+  return carry;
+}
+
+static int
+downsample_ge(struct downsample_u128 a, struct downsample_u128 b) {
+  return a.hi != b.hi ? a.hi > b.hi : a.lo >= b.lo;
+}
+
+struct downsample_remainder {
+  struct downsample_u128 remainder;
+  int idx;
+};
+
+static int
+downsample_remainder_cmp(const void *av, const void *bv) {
+  const struct downsample_remainder *a = av, *b = bv;
+  if(a->remainder.hi != b->remainder.hi) return (a->remainder.hi > b->remainder.hi) ? -1 : 1;
+  if(a->remainder.lo != b->remainder.lo) return (a->remainder.lo > b->remainder.lo) ? -1 : 1;
+  return a->idx - b->idx;
+}
+
+int
+hist_downsample_deterministic(histogram_t *hist, double factor) {
+  struct downsample_remainder rems_static[1024];
+  struct downsample_remainder *rems = rems_static;
+  struct downsample_u128 acc = { 0, 0 }, one = { 0, 0 };
+  uint64_t m, units = 0, carries = 0;
+  int i, e, k, nrems = 0;
+  if(factor < 0) factor = 0;
+  if(factor > 1) factor = 1;
+  if(!hist || factor == 1) return 0;
+  if(hist_modify(hist, 1) < 0) return -1;
+  if(hist->weighted) {
+    hist_scale_weights(hist, factor);
+    return 0;
+  }
+  if(hist->used > 1024) {
+    rems = malloc(hist->used * sizeof(*rems));
+    if(!rems) return -1;
+  }
+  /* factor = m / 2^k exactly; frexp and ldexp don't round */
+  m = (uint64_t)ldexp(frexp(factor, &e), 53);
+  k = 53 - e;
+  if(k < 64) one.lo = (uint64_t)1 << k;
+  else if(k < 128) one.hi = (uint64_t)1 << (k - 64);
+  /* every bin keeps the floor of its share... */
+  for(i=0;i<hist->used;i++) {
+    struct downsample_u128 share = downsample_mul(hist->bvs[i].count, m);
+    struct downsample_u128 rem = downsample_mask(share, k);
+    hist->bvs[i].count = downsample_shift(share, k);
+    if(rem.hi || rem.lo) {
+      rems[nrems].remainder = rem;
+      rems[nrems].idx = i;
+      nrems++;
+      /* the remainders add up to the units the floors lost */
+      carries += downsample_add(&acc, rem);
+      if(k < 128 && downsample_ge(acc, one)) {
+        acc.hi -= one.hi + (acc.lo < one.lo);
+        acc.lo -= one.lo;
+        units++;
+      }
+    }
+  }
+  /* below 2^k each remainder is < 2^117, so only a few carries are possible */
+  if(k >= 128 && k - 128 < 64) units = carries >> (k - 128);
+  /* ...and those units go to the largest remainders, ties to the lower bin,
+   * so the total is exactly floor(total * factor) */
+  qsort(rems, nrems, sizeof(*rems), downsample_remainder_cmp);
+  for(i=0;i<nrems && (uint64_t)i < units;i++)
+    hist->bvs[rems[i].idx].count++;
+  if(rems != rems_static) free(rems);
+  hist_remove_zeroes(hist);
+  hist_total_refresh(hist);
+  return 0;
+}
+
+double
+hist_sample_weight(const histogram_t *hist) {
+  int i;
+  double total = 0;
+  if(!hist) return 0;
+  ASSERT_GOOD_HIST(hist);
+  for(i=0;i<hist->used;i++) total += bv_weight(hist, i);
+  return total;
 }
 
 uint64_t
@@ -1218,7 +2397,11 @@ hist_sample_count(const histogram_t *hist) {
   int i;
   uint64_t total = 0, last = 0;
   if(!hist) return 0;
+  if(hist->weighted) return weight_to_count(hist_sample_weight(hist));
   ASSERT_GOOD_HIST(hist);
+  /* NaNs sort first, the cached total leaves them out */
+  if(hist->total_valid && (hist->used == 0 || !hist_bucket_isnan(hist->bvs[0].bucket)))
+    return hist->total;
   for(i=0;i<hist->used;i++) {
     last = total;
     total += hist->bvs[i].count;
@@ -1239,7 +2422,17 @@ hist_bucket_idx(const histogram_t *hist, int idx,
   ASSERT_GOOD_HIST(hist);
   if(idx < 0 || idx >= hist->used) return 0;
   *bucket = hist_bucket_to_double(hist->bvs[idx].bucket);
-  *count = hist->bvs[idx].count;
+  *count = bv_count(hist, idx);
+  return 1;
+}
+
+int
+hist_bucket_idx_weight(const histogram_t *hist, int idx,
+                       hist_bucket_t *bucket, double *weight) {
+  ASSERT_GOOD_HIST(hist);
+  if(idx < 0 || idx >= hist->used) return 0;
+  *bucket = hist->bvs[idx].bucket;
+  *weight = bv_weight(hist, idx);
   return 1;
 }
 
@@ -1249,7 +2442,7 @@ hist_bucket_idx_bucket(const histogram_t *hist, int idx,
   ASSERT_GOOD_HIST(hist);
   if(idx < 0 || idx >= hist->used) return 0;
   *bucket = hist->bvs[idx].bucket;
-  *count = hist->bvs[idx].count;
+  *count = bv_count(hist, idx);
   return 1;
 }
 
@@ -1307,6 +2500,11 @@ internal_bucket_accum(histogram_t *tgt, int tgtidx,
   }
   assert(hist_bucket_cmp(tgt->bvs[tgtidx].bucket,
                          src->bvs[srcidx].bucket) == 0);
+  if(tgt->weighted) {
+    tgt->bvs[tgtidx].count = weight_bits(weight_of(tgt->bvs[tgtidx].count) +
+                                         bv_weight(src, srcidx));
+    return;
+  }
   newval = tgt->bvs[tgtidx].count + src->bvs[srcidx].count;
   if(newval < tgt->bvs[tgtidx].count) newval = ~(uint64_t)0;
   tgt->bvs[tgtidx].count = newval;
@@ -1317,6 +2515,7 @@ hist_subtract(histogram_t *tgt, const histogram_t * const *hist, int cnt) {
   int i, tgt_idx, src_idx;
   int rv = 0;
   ASSERT_GOOD_HIST(tgt);
+  if(hist_modify(tgt, 1) < 0) return -1;
   for(i=0;i<cnt;i++) {
     tgt_idx = src_idx = 0;
     if(!hist[i]) continue;
@@ -1325,7 +2524,13 @@ hist_subtract(histogram_t *tgt, const histogram_t * const *hist, int cnt) {
       int cmp = hist_bucket_cmp(tgt->bvs[tgt_idx].bucket, hist[i]->bvs[src_idx].bucket);
       /* if the match, attempt to subtract, and move tgt && src fwd. */
       if(cmp == 0) {
-        if(tgt->bvs[tgt_idx].count < hist[i]->bvs[src_idx].count) {
+        if(tgt->weighted) {
+          double tw = weight_of(tgt->bvs[tgt_idx].count), sw = bv_weight(hist[i], src_idx);
+          if(tw < sw) rv = -1;
+          tgt->bvs[tgt_idx].count = weight_bits(tw - sw);
+        } else if(hist[i]->weighted) {
+          rv = -1;
+        } else if(tgt->bvs[tgt_idx].count < hist[i]->bvs[src_idx].count) {
           tgt->bvs[tgt_idx].count = 0;
           rv = -1;
         } else {
@@ -1348,6 +2553,7 @@ hist_subtract(histogram_t *tgt, const histogram_t * const *hist, int cnt) {
       src_idx++;
     }
   }
+  hist_total_refresh(tgt);
   ASSERT_GOOD_HIST(tgt);
   return rv;
 }
@@ -1357,10 +2563,12 @@ hist_subtract_as_int64(histogram_t *tgt, const histogram_t *src) {
   int tgt_idx, src_idx;
   int rv = 0;
   ASSERT_GOOD_HIST(tgt);
+  if(hist_modify(tgt, 1) < 0) return -1;
 
   tgt_idx = src_idx = 0;
   if(!src) return 0;
   ASSERT_GOOD_HIST(src);
+  if(tgt->weighted || src->weighted) return -1;
 
   while(tgt_idx <= tgt->used && src_idx < src->used) {
     int cmp = unlikely(tgt_idx == tgt->used) ? -1 :
@@ -1393,7 +2601,7 @@ hist_subtract_as_int64(histogram_t *tgt, const histogram_t *src) {
                                              sizeof(*tgt->bvs));
         memcpy(dummy.bvs, tgt->bvs, idx * sizeof(*tgt->bvs));
         memcpy(dummy.bvs + idx + 1, tgt->bvs + idx, (tgt->used - idx)*sizeof(*tgt->bvs));
-        tgt->allocator->free(tgt->bvs);
+        hist_bvs_release(tgt, tgt->bvs);
         tgt->bvs = dummy.bvs;
         tgt->allocd += DEFAULT_HIST_SIZE;
       } else {
@@ -1407,6 +2615,7 @@ hist_subtract_as_int64(histogram_t *tgt, const histogram_t *src) {
   assert(src_idx == src->used);
 
   if(rv == 0) hist_remove_zeroes(tgt);
+  hist_total_refresh(tgt);
 
   ASSERT_GOOD_HIST(tgt);
   return rv;
@@ -1417,10 +2626,12 @@ hist_add_as_int64(histogram_t *tgt, const histogram_t *src) {
   int tgt_idx, src_idx;
   int rv = 0;
   ASSERT_GOOD_HIST(tgt);
+  if(hist_modify(tgt, 1) < 0) return -1;
 
   tgt_idx = src_idx = 0;
   if(!src) return 0;
   ASSERT_GOOD_HIST(src);
+  if(tgt->weighted || src->weighted) return -1;
 
   while(tgt_idx <= tgt->used && src_idx < src->used) {
     int cmp = unlikely(tgt_idx == tgt->used) ? -1 :
@@ -1456,7 +2667,7 @@ hist_add_as_int64(histogram_t *tgt, const histogram_t *src) {
                                              sizeof(*tgt->bvs));
         memcpy(dummy.bvs, tgt->bvs, idx * sizeof(*tgt->bvs));
         memcpy(dummy.bvs + idx + 1, tgt->bvs + idx, (tgt->used - idx)*sizeof(*tgt->bvs));
-        tgt->allocator->free(tgt->bvs);
+        hist_bvs_release(tgt, tgt->bvs);
         tgt->bvs = dummy.bvs;
         tgt->allocd += DEFAULT_HIST_SIZE;
       } else {
@@ -1470,6 +2681,7 @@ hist_add_as_int64(histogram_t *tgt, const histogram_t *src) {
   assert(src_idx == src->used);
 
   if(rv == 0) hist_remove_zeroes(tgt);
+  hist_total_refresh(tgt);
 
   ASSERT_GOOD_HIST(tgt);
   return rv;
@@ -1484,10 +2696,15 @@ int
 hist_accumulate(histogram_t *tgt, const histogram_t* const *src, int cnt) {
   int tgtneeds;
   ASSERT_GOOD_HIST(tgt);
-  void *oldtgtbuff = tgt->bvs;
+  if(hist_modify(tgt, 1) < 0) return -1;
+  struct hist_bv_pair *oldtgtbuff = tgt->bvs;
   histogram_t tgt_copy;
   histogram_t *inclusive_src_static[1025];
   histogram_t **inclusive_src = inclusive_src_static;
+  if(!tgt->weighted) {
+    /* weights don't fit into counts */
+    for(int i=0;i<cnt;i++) if(src[i] && src[i]->weighted) return -1;
+  }
   if(cnt+1 > 1025) {
     inclusive_src = malloc(sizeof(histogram_t *) * (cnt+1));
     if(!inclusive_src) return -1;
@@ -1505,13 +2722,65 @@ hist_accumulate(histogram_t *tgt, const histogram_t* const *src, int cnt) {
   tgt->used = 0;
   if (! tgt->allocd) tgt->allocd = 1;
   tgt->bvs = tgt->allocator->calloc(tgt->allocd, sizeof(*tgt->bvs));
+  if(tgt->bvs == NULL) {
+    memcpy(tgt, &tgt_copy, sizeof(*tgt));
+    if(inclusive_src != inclusive_src_static) free(inclusive_src);
+    return -1;
+  }
   hist_needed_merge_size_fc(inclusive_src, cnt+1, internal_bucket_accum, tgt);
-  if(oldtgtbuff) tgt->allocator->free(oldtgtbuff);
+  /* bins moved, the fast index must follow them.  Sources may carry other
+   * spellings of zero and NaN, which compact histograms fold into one bin. */
+  if(tgt->compact) hist_sort_coalesce(tgt);
+  else if(tgt->fast) hist_fast_rebuild(tgt);
+  hist_bvs_release(tgt, oldtgtbuff);
+  if(tgt->small && tgt->used <= HIST_INLINE_BINS) {
+    /* still fits, move back in */
+    memcpy(hist_inline_bvs(tgt), tgt->bvs, tgt->used * sizeof(*tgt->bvs));
+    tgt->allocator->free(tgt->bvs);
+    tgt->bvs = hist_inline_bvs(tgt);
+    tgt->allocd = HIST_INLINE_BINS;
+  }
   if(inclusive_src != inclusive_src_static) free(inclusive_src);
+  hist_total_refresh(tgt);
   ASSERT_GOOD_HIST(tgt);
   return tgt->used;
 }
 
+static int
+hist_bucket_qsort_cmp(const void *a, const void *b) {
+  return -hist_bucket_cmp(*(const hist_bucket_t *)a, *(const hist_bucket_t *)b);
+}
+
+uint64_t
+hist_insert_raw_batch(histogram_t *hist, hist_bucket_t *hb, int n) {
+  struct hist_bv_pair runs_static[1024];
+  histogram_t batch;
+  const histogram_t *batchp = &batch;
+  int i, rv;
+  if(n <= 0) return 0;
+  qsort(hb, n, sizeof(*hb), hist_bucket_qsort_cmp);
+  /* coalesce equal buckets into a sorted histogram and merge it in one pass */
+  memset(&batch, 0, sizeof(batch));
+  batch.bvs = runs_static;
+  if(n > 1024) {
+    batch.bvs = malloc(n * sizeof(*batch.bvs));
+    if(!batch.bvs) return 0;
+  }
+  for(i=0;i<n;i++) {
+    if(batch.used && hist_bucket_cmp(batch.bvs[batch.used-1].bucket, hb[i]) == 0)
+      batch.bvs[batch.used-1].count++;
+    else {
+      batch.bvs[batch.used].bucket = hb[i];
+      batch.bvs[batch.used].count = 1;
+      batch.used++;
+    }
+  }
+  batch.allocd = batch.used;
+  rv = hist_accumulate(hist, &batchp, 1);
+  if(batch.bvs != runs_static) free(batch.bvs);
+  return rv < 0 ? 0 : (uint64_t)n;
+}
+
 int
 hist_num_buckets(const histogram_t *hist) {
   return hist->used;
@@ -1521,6 +2790,7 @@ void
 hist_clear(histogram_t *hist) {
   int i;
   ASSERT_GOOD_HIST(hist);
+  hist_modify(hist, 0);
   // just to be sure, clear the counts
   for(i=0;i<hist->used;i++)
     hist->bvs[i].count = 0;
@@ -1533,6 +2803,12 @@ hist_clear(histogram_t *hist) {
       }
     }
   }
+  if(hist->compact) {
+    struct histogram_compact *hc = (struct histogram_compact *)hist;
+    memset(hc->rank, 0, sizeof(hc->rank));
+    memset(hc->bits, 0, sizeof(hc->bits));
+  }
+  hist_total_refresh(hist);
 }
 
 histogram_t *
@@ -1553,12 +2829,25 @@ hist_alloc_nbins(int nbins) {
 histogram_t *
 hist_alloc_nbins_with_allocator(int nbins, const hist_allocator_t *allocator) {
   histogram_t *tgt;
-  if(nbins < 1) nbins = DEFAULT_HIST_SIZE;
+  if(nbins < 1) nbins = HIST_INLINE_BINS;
   if(nbins > MAX_HIST_BINS) nbins = MAX_HIST_BINS;
+  if(nbins <= HIST_INLINE_BINS) {
+    /* one allocation for small histograms */
+    tgt = allocator->calloc(1, sizeof(histogram_t) +
+                               HIST_INLINE_BINS * sizeof(struct hist_bv_pair));
+    if(!tgt) return NULL;
+    tgt->small = 1;
+    tgt->allocd = HIST_INLINE_BINS;
+    tgt->bvs = hist_inline_bvs(tgt);
+    tgt->allocator = allocator;
+    tgt->total_valid = 1;
+    return tgt;
+  }
   tgt = allocator->calloc(1, sizeof(histogram_t));
   tgt->allocd = nbins;
   tgt->bvs = allocator->calloc(tgt->allocd, sizeof(*tgt->bvs));
   tgt->allocator = allocator;
+  tgt->total_valid = 1;
   return tgt;
 }
 
@@ -1587,9 +2876,97 @@ hist_fast_alloc_nbins_with_allocator(int nbins, const hist_allocator_t *allocato
   tgt->internal.bvs = allocator->calloc(tgt->internal.allocd, sizeof(*tgt->internal.bvs));
   tgt->internal.fast = 1;
   tgt->internal.allocator = allocator;
+  tgt->internal.total_valid = 1;
+  return &tgt->internal;
+}
+
+histogram_t *
+hist_compact_alloc(void) {
+  return hist_compact_alloc_nbins(0);
+}
+
+histogram_t *
+hist_compact_alloc_with_allocator(const hist_allocator_t *allocator) {
+  return hist_compact_alloc_nbins_with_allocator(0, allocator);
+}
+
+histogram_t *
+hist_compact_alloc_nbins(int nbins) {
+  return hist_compact_alloc_nbins_with_allocator(nbins, &default_allocator);
+}
+
+histogram_t *
+hist_compact_alloc_nbins_with_allocator(int nbins, const hist_allocator_t *allocator) {
+  struct histogram_compact *tgt;
+  if(nbins < 1) nbins = DEFAULT_HIST_SIZE;
+  if(nbins > MAX_HIST_BINS) nbins = MAX_HIST_BINS;
+  tgt = allocator->calloc(1, sizeof(struct histogram_compact));
+  tgt->internal.allocd = nbins;
+  tgt->internal.bvs = allocator->calloc(tgt->internal.allocd, sizeof(*tgt->internal.bvs));
+  tgt->internal.compact = 1;
+  tgt->internal.allocator = allocator;
+  tgt->internal.total_valid = 1;
   return &tgt->internal;
 }
 
+histogram_t *
+hist_alloc_weighted(void) {
+  return hist_alloc_weighted_with_allocator(&default_allocator);
+}
+
+histogram_t *
+hist_alloc_weighted_with_allocator(const hist_allocator_t *allocator) {
+  histogram_t *tgt = hist_alloc_nbins_with_allocator(0, allocator);
+  if(tgt) {
+    tgt->weighted = 1;
+    tgt->total_valid = 0;
+  }
+  return tgt;
+}
+
+histogram_t *
+hist_fast_alloc_weighted(void) {
+  histogram_t *tgt = hist_fast_alloc_nbins(0);
+  if(tgt) {
+    tgt->weighted = 1;
+    tgt->total_valid = 0;
+  }
+  return tgt;
+}
+
+int
+hist_is_weighted(const histogram_t *hist) {
+  return hist ? hist->weighted : 0;
+}
+
+/* O(1) copy sharing other's storage, see hist_unshare */
+static histogram_t *
+hist_clone_shared(const histogram_t *other) {
+  histogram_t *src = (histogram_t *)other, *tgt;
+  const hist_allocator_t *a = other->allocator;
+  size_t size = other->fast ? sizeof(struct histogram_fast) :
+                other->compact ? sizeof(struct histogram_compact) : sizeof(histogram_t);
+  uint32_t *shared = __atomic_load_n(&src->shared, __ATOMIC_ACQUIRE);
+  if(!shared) {
+    /* first clone: other becomes a holder too */
+    uint32_t *fresh = a->malloc(sizeof(*fresh));
+    if(!fresh) return NULL;
+    *fresh = 1;
+    if(__atomic_compare_exchange_n(&src->shared, &shared, fresh, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      shared = fresh;
+    else
+      a->free(fresh); /* another reader beat us to it */
+  }
+  tgt = a->malloc(size);
+  if(!tgt) return NULL;
+  memcpy(tgt, other, size);
+  tgt->small = 0;
+  tgt->shared = shared;
+  __atomic_add_fetch(shared, 1, __ATOMIC_ACQ_REL);
+  return tgt;
+}
+
 histogram_t *
 hist_clone(const histogram_t *other) {
   return hist_clone_with_allocator(other, &default_allocator);
@@ -1600,6 +2977,10 @@ hist_clone_with_allocator(const histogram_t *other, const hist_allocator_t *allo
 {
   histogram_t *tgt = NULL;
   int i = 0;
+  if (other->allocator == allocator && !(other->small && other->bvs == hist_inline_bvs((histogram_t *)other))) {
+    tgt = hist_clone_shared(other);
+    if(tgt) return tgt;
+  }
   if (other->fast) {
     tgt = hist_fast_alloc_nbins_with_allocator(other->allocd, allocator);
     struct histogram_fast *f = (struct histogram_fast *)tgt;
@@ -1611,11 +2992,21 @@ hist_clone_with_allocator(const histogram_t *other, const hist_allocator_t *allo
       }
     }
   }
+  else if (other->compact) {
+    tgt = hist_compact_alloc_nbins_with_allocator(other->allocd, allocator);
+    struct histogram_compact *c = (struct histogram_compact *)tgt;
+    const struct histogram_compact *oc = (const struct histogram_compact *)other;
+    memcpy(c->rank, oc->rank, sizeof(c->rank));
+    memcpy(c->bits, oc->bits, sizeof(c->bits));
+  }
   else {
     tgt = hist_alloc_nbins_with_allocator(other->allocd, allocator);
   }
   memcpy(tgt->bvs, other->bvs, other->used * sizeof(struct hist_bv_pair));
   tgt->used = other->used;
+  tgt->weighted = other->weighted;
+  tgt->total = other->total;
+  tgt->total_valid = other->total_valid;
   return tgt;
 }
 
@@ -1623,7 +3014,13 @@ void
 hist_free(histogram_t *hist) {
   if(hist == NULL) return;
   const hist_allocator_t *a = hist->allocator;
-  if(hist->bvs != NULL) a->free(hist->bvs);
+  if(hist->shared) {
+    if(__atomic_sub_fetch(hist->shared, 1, __ATOMIC_ACQ_REL) == 0)
+      hist_shared_free(hist);
+    a->free(hist);
+    return;
+  }
+  hist_bvs_release(hist, hist->bvs);
   if(hist->fast) {
     int i;
     struct histogram_fast *hfast = (struct histogram_fast *)hist;
@@ -1635,7 +3032,14 @@ hist_free(histogram_t *hist) {
 
 histogram_t *
 hist_compress_mbe(const histogram_t *hist, int8_t mbe) {
-  histogram_t *hist_compressed = hist_alloc();
+  return hist_compress_mbe_with_allocator(hist, mbe, hist ? hist->allocator : &default_allocator);
+}
+
+histogram_t *
+hist_compress_mbe_with_allocator(const histogram_t *hist, int8_t mbe, const hist_allocator_t *allocator) {
+  histogram_t *hist_compressed = (hist && hist->weighted) ?
+    hist_alloc_weighted_with_allocator(allocator) : hist_alloc_with_allocator(allocator);
+  if(!hist_compressed) return NULL;
   if(!hist) return hist_compressed;
   int total = hist_bucket_count(hist);
   for(int idx=0; idx<total; idx++) {
@@ -1644,23 +3048,287 @@ hist_compress_mbe(const histogram_t *hist, int8_t mbe) {
     // so it suffices to check the exponent
     if (bv.bucket.exp < mbe) {
       // merge into zero bucket
-      hist_insert_raw(hist_compressed, (hist_bucket_t) {.exp = 0, .val = 0}, bv.count);
+      bv.bucket = (hist_bucket_t) {.exp = 0, .val = 0};
     }
     else if (bv.bucket.exp == mbe) {
       // re-bucket to val = 10, 20, ... 90
-      hist_insert_raw(hist_compressed, (hist_bucket_t) {
-        .exp = bv.bucket.exp,
-        .val = (bv.bucket.val/10) * 10
-      }, bv.count);
-    }
-    else {
-      // copy over
-      hist_insert_raw(hist_compressed, bv.bucket, bv.count);
+      bv.bucket.val = (bv.bucket.val/10) * 10;
     }
+    // else copy over
+    if(hist->weighted) hist_insert_raw_weighted(hist_compressed, bv.bucket, bv_weight(hist, idx));
+    else hist_insert_raw(hist_compressed, bv.bucket, bv.count);
   }
   return hist_compressed;
 }
 
+/* Columnar time-series blocks
+ *
+ *   'H' | version | varint steps | u16 nbuckets | nbuckets * (val, exp)
+ *   timestamp column | nbuckets count columns
+ *
+ * Each column holds one zigzag varint per step: the first value, the first
+ * delta and then delta-of-deltas, all computed modulo 2^64.
+ */
+#define BLOCK_MAGIC 'H'
+#define BLOCK_VERSION 1
+#define VARINT_MAX 10
+
+static inline ssize_t
+varint_write(uint8_t *cp, uint64_t v) {
+  ssize_t n = 0;
+  while(v >= 0x80) {
+    cp[n++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  cp[n++] = v;
+  return n;
+}
+
+static inline ssize_t
+varint_read(const uint8_t *cp, ssize_t len, uint64_t *v) {
+  ssize_t n = 0;
+  int shift = 0;
+  *v = 0;
+  while(n < len && n < VARINT_MAX) {
+    *v |= (uint64_t)(cp[n] & 0x7f) << shift;
+    if(!(cp[n++] & 0x80)) return n;
+    shift += 7;
+  }
+  return -1;
+}
+
+static inline uint64_t
+zigzag(uint64_t v) {
+  return (v << 1) ^ (uint64_t)((int64_t)v >> 63);
+}
+static inline uint64_t
+unzigzag(uint64_t v) {
+  return (v >> 1) ^ (0 - (v & 1));
+}
+
+struct dod_state {
+  uint64_t prev;
+  uint64_t delta;
+  int step;
+};
+
+static inline uint64_t
+dod_encode(struct dod_state *s, uint64_t v) {
+  uint64_t out;
+  if(s->step == 0) out = v;
+  else if(s->step == 1) out = s->delta = v - s->prev;
+  else {
+    out = (v - s->prev) - s->delta;
+    s->delta = v - s->prev;
+  }
+  s->prev = v;
+  s->step++;
+  return zigzag(out);
+}
+
+static inline uint64_t
+dod_decode(struct dod_state *s, uint64_t in) {
+  uint64_t v;
+  in = unzigzag(in);
+  if(s->step == 0) v = in;
+  else if(s->step == 1) v = s->prev + (s->delta = in);
+  else v = s->prev + (s->delta += in);
+  s->prev = v;
+  s->step++;
+  return v;
+}
+
+ssize_t
+hist_block_encode_estimate(const histogram_t * const *h, int n) {
+  int union_size;
+  if(n < 0) return -1;
+  if(n == 0) return 2 + VARINT_MAX + 2;
+  union_size = hist_needed_merge_size((histogram_t **)h, n);
+  if(union_size < 0) return -1;
+  return 2 + VARINT_MAX + 2 + 2 * union_size +
+         (ssize_t)VARINT_MAX * n * (1 + union_size);
+}
+
+ssize_t
+hist_block_encode(const histogram_t * const *h, const int64_t *timestamps, int n,
+                  void *buff, ssize_t len) {
+  int i, j;
+  ssize_t written = 0, incr, rv = -1;
+  uint8_t *cp = buff;
+  uint16_t nbuckets = 0, nlen;
+  struct dod_state state;
+  int cursor_static[1024];
+  int *cursor = cursor_static;
+  histogram_t *keys;
+
+  if(n < 0) return -1;
+  /* count columns are integers */
+  for(i=0;i<n;i++) if(h[i] && h[i]->weighted) return -1;
+  /* The union of all bucket keys, in order.  We don't need the counts. */
+  keys = hist_alloc();
+  if(!keys) return -1;
+  if(hist_accumulate(keys, h, n) < 0) goto out;
+  for(j=0;j<keys->used;j++)
+    if(keys->bvs[j].count) keys->bvs[nbuckets++] = keys->bvs[j];
+
+  if(n > 1024) {
+    cursor = malloc(n * sizeof(*cursor));
+    if(!cursor) goto out;
+  }
+  memset(cursor, 0, n * sizeof(*cursor));
+
+  if(len < 2 + VARINT_MAX + 2 + 2 * nbuckets) goto out;
+  cp[0] = BLOCK_MAGIC;
+  cp[1] = BLOCK_VERSION;
+  ADVANCE(written, 2);
+  incr = varint_write(cp, n);
+  ADVANCE(written, incr);
+  nlen = htons(nbuckets);
+  memcpy(cp, &nlen, sizeof(nlen));
+  ADVANCE(written, 2);
+  for(j=0;j<nbuckets;j++) {
+    cp[0] = keys->bvs[j].bucket.val;
+    cp[1] = keys->bvs[j].bucket.exp;
+    ADVANCE(written, 2);
+  }
+
+  memset(&state, 0, sizeof(state));
+  for(i=0;i<n;i++) {
+    if(len < VARINT_MAX) goto out;
+    incr = varint_write(cp, dod_encode(&state, timestamps ? timestamps[i] : 0));
+    ADVANCE(written, incr);
+  }
+  for(j=0;j<nbuckets;j++) {
+    hist_bucket_t key = keys->bvs[j].bucket;
+    memset(&state, 0, sizeof(state));
+    for(i=0;i<n;i++) {
+      uint64_t count = 0;
+      const histogram_t *src = h[i];
+      /* keys arrive in order, so each source's cursor only moves forward */
+      while(src && cursor[i] < src->used &&
+            hist_bucket_cmp(src->bvs[cursor[i]].bucket, key) > 0) cursor[i]++;
+      if(src && cursor[i] < src->used &&
+         hist_bucket_cmp(src->bvs[cursor[i]].bucket, key) == 0)
+        count = src->bvs[cursor[i]].count;
+      if(len < VARINT_MAX) goto out;
+      incr = varint_write(cp, dod_encode(&state, count));
+      ADVANCE(written, incr);
+    }
+  }
+  rv = written;
+
+ out:
+  if(cursor != cursor_static) free(cursor);
+  hist_free(keys);
+  return rv;
+}
+
+/* Parses the block header, returns the offset of the timestamp column */
+static ssize_t
+hist_block_header(const uint8_t *cp, ssize_t len, int *steps, int *nbuckets) {
+  uint64_t v;
+  uint16_t nlen;
+  ssize_t incr_read, offset = 2;
+  if(len < 2 || cp[0] != BLOCK_MAGIC || cp[1] != BLOCK_VERSION) return -1;
+  incr_read = varint_read(cp + offset, len - offset, &v);
+  if(incr_read < 0 || v > INT32_MAX) return -1;
+  offset += incr_read;
+  *steps = v;
+  if(len - offset < 2) return -1;
+  memcpy(&nlen, cp + offset, sizeof(nlen));
+  offset += 2;
+  *nbuckets = ntohs(nlen);
+  if(len - offset < 2 * *nbuckets) return -1;
+  return offset;
+}
+
+int
+hist_block_steps(const void *buff, ssize_t len) {
+  int steps, nbuckets;
+  if(hist_block_header(buff, len, &steps, &nbuckets) < 0) return -1;
+  return steps;
+}
+
+int
+hist_block_timestamps(const void *buff, ssize_t len, int64_t *timestamps) {
+  const uint8_t *cp = buff;
+  int i, steps, nbuckets;
+  uint64_t v;
+  struct dod_state state;
+  ssize_t offset = hist_block_header(cp, len, &steps, &nbuckets);
+  if(offset < 0) return -1;
+  offset += 2 * nbuckets;
+  memset(&state, 0, sizeof(state));
+  for(i=0;i<steps;i++) {
+    ssize_t incr_read = varint_read(cp + offset, len - offset, &v);
+    if(incr_read < 0) return -1;
+    offset += incr_read;
+    timestamps[i] = dod_decode(&state, v);
+  }
+  return steps;
+}
+
+int
+hist_block_merge_range(const void *buff, ssize_t len, int first, int last,
+                       histogram_t *tgt) {
+  const uint8_t *cp = buff, *keys;
+  int i, j, steps, nbuckets, rv = -1;
+  uint64_t v;
+  uint64_t sums_static[1024];
+  uint64_t *sums = sums_static;
+  struct dod_state state;
+  ssize_t offset = hist_block_header(cp, len, &steps, &nbuckets);
+  if(offset < 0) return -1;
+  keys = cp + offset;
+  offset += 2 * nbuckets;
+  if(first < 0) first = 0;
+  if(last > steps) last = steps;
+  if(nbuckets > 1024) {
+    sums = malloc(nbuckets * sizeof(*sums));
+    if(!sums) return -1;
+  }
+  /* skip the timestamps */
+  for(i=0;i<steps;i++) {
+    ssize_t incr_read = varint_read(cp + offset, len - offset, &v);
+    if(incr_read < 0) goto out;
+    offset += incr_read;
+  }
+  /* Sum each column over [first, last) before touching tgt, so a malformed
+   * block leaves tgt alone. */
+  for(j=0;j<nbuckets;j++) {
+    uint64_t sum = 0;
+    memset(&state, 0, sizeof(state));
+    for(i=0;i<steps;i++) {
+      ssize_t incr_read = varint_read(cp + offset, len - offset, &v);
+      if(incr_read < 0) goto out;
+      offset += incr_read;
+      v = dod_decode(&state, v);
+      if(i >= first && i < last) {
+        sum += v;
+        if(sum < v) sum = ~(uint64_t)0;
+      }
+      else if(i >= last) {
+        /* the rest of the column is only needed to find the next one */
+        for(i++;i<steps;i++) {
+          incr_read = varint_read(cp + offset, len - offset, &v);
+          if(incr_read < 0) goto out;
+          offset += incr_read;
+        }
+      }
+    }
+    sums[j] = sum;
+  }
+  for(j=0;j<nbuckets;j++) {
+    hist_bucket_t hb = { .val = keys[2*j], .exp = keys[2*j+1] };
+    if(sums[j] && hist_bucket_is_valid(hb)) hist_insert_raw(tgt, hb, sums[j]);
+  }
+  rv = last > first ? last - first : 0;
+
+ out:
+  if(sums != sums_static) free(sums);
+  return rv;
+}
+
 extern int
 hist_bucket_to_string(hist_bucket_t hb, char *buf) {
   if(hist_bucket_isnan(hb)) { strcpy(buf, "NaN"); return 3; }
@@ -1684,6 +3352,62 @@ hist_bucket_to_string(hist_bucket_t hb, char *buf) {
 /* 0 success
  * -2 (out of order quantile request)
  */
+/* Range of values a bucket covers, returns its width (0 for the zero bucket) */
+static inline double
+hist_bucket_bounds(hist_bucket_t bucket, double *lower, double *upper) {
+  double bucket_size = hist_bucket_to_double_bin_width(bucket);
+  double bucket_bound = hist_bucket_to_double(bucket);
+  if(bucket_bound < 0.0) {
+    *lower = bucket_bound - bucket_size;
+    *upper = bucket_bound;
+  }
+  else if(bucket_bound == 0.0) {
+    *lower = HIST_NEGATIVE_MAX_I;
+    *upper = HIST_POSITIVE_MIN_I;
+  }
+  else {
+    *lower = bucket_bound;
+    *upper = bucket_bound + bucket_size;
+  }
+  return bucket_size;
+}
+
+/* The inverse quantile walk from the top bin down, for thresholds high up
+ * in the histogram: what lies below a bin is the cached total minus what
+ * lies in and above it. */
+static int
+hist_approx_inverse_quantile_top(const histogram_t *hist, double total_cnt,
+                                 const double *in, int in_size, double *out) {
+  int in_idx, b_idx = hist->used;
+  double count_above = 0, lower, upper;
+  for(in_idx=in_size-1;in_idx>=0;in_idx--) {
+    double threshold = in[in_idx];
+    /* find the lowest bin ending above the threshold */
+    while(b_idx > 0 && !hist_bucket_isnan(hist->bvs[b_idx-1].bucket)) {
+      hist_bucket_bounds(hist->bvs[b_idx-1].bucket, &lower, &upper);
+      if(!(threshold < upper)) break;
+      b_idx--;
+      count_above += bv_weight(hist, b_idx);
+    }
+    if(b_idx == hist->used) {
+      out[in_idx] = 1; /* past all bins */
+      continue;
+    }
+    hist_bucket_t bucket = hist->bvs[b_idx].bucket;
+    double count = bv_weight(hist, b_idx);
+    double count_below = total_cnt - count_above;
+    double bucket_size = hist_bucket_bounds(bucket, &lower, &upper);
+    if(threshold < lower || bucket_size == 0.0) {
+      out[in_idx] = (double) count_below / total_cnt;
+    }
+    else {
+      double position_ratio = (threshold - lower) / (upper - lower);
+      out[in_idx] = (double) (count_below + position_ratio * count) / total_cnt;
+    }
+  }
+  return 0;
+}
+
 int
 hist_approx_inverse_quantile(const histogram_t *hist, const double *in, int in_size, double *out) {
   if(in_size < 1) { /* nothing requested, easy to satisfy successfully */
@@ -1701,15 +3425,24 @@ hist_approx_inverse_quantile(const histogram_t *hist, const double *in, int in_s
     return 0;
   }
   ASSERT_GOOD_HIST(hist);
-  /* Sum up all samples from all the bins */
-  uint64_t total_cnt = 0;
-  for (int i=0;i<hist->used;i++) {
-    if(hist_bucket_isnan(hist->bvs[i].bucket)) continue;
-    total_cnt += hist->bvs[i].count;
+  double total_cnt = 0;
+  if(hist->total_valid) total_cnt = (double)hist->total;
+  else {
+    /* Sum up all samples from all the bins */
+    for (int i=0;i<hist->used;i++) {
+      if(hist_bucket_isnan(hist->bvs[i].bucket)) continue;
+      total_cnt += bv_weight(hist, i);
+    }
   }
   if(total_cnt == 0) return 0; // all ratios will be NAN
+  if(hist->total_valid && !hist_bucket_isnan(hist->bvs[hist->used/2].bucket)) {
+    /* if even the lowest threshold is past the middle bin, come from the top */
+    double lower, upper;
+    hist_bucket_bounds(hist->bvs[hist->used/2].bucket, &lower, &upper);
+    if(in[0] >= lower) return hist_approx_inverse_quantile_top(hist, total_cnt, in, in_size, out);
+  }
   // Compute inverse percentiles
-  uint64_t count_below = 0;
+  double count_below = 0;
   int in_idx=0;
   double threshold = in[in_idx];
 #define NEXT_THRESHOLD do {                           \
@@ -1719,23 +3452,10 @@ hist_approx_inverse_quantile(const histogram_t *hist, const double *in, int in_s
 } while(0)
   for(int b_idx=0;b_idx<hist->used;b_idx++) {
     hist_bucket_t bucket = hist->bvs[b_idx].bucket;
-    uint64_t count = hist->bvs[b_idx].count;
+    double count = bv_weight(hist, b_idx);
     if(!hist_bucket_isnan(bucket)){
-      double bucket_size = hist_bucket_to_double_bin_width(bucket);
       double bucket_lower, bucket_upper;
-      double bucket_bound = hist_bucket_to_double(bucket);
-      if(bucket_bound < 0.0) {
-        bucket_lower = bucket_bound - bucket_size;
-        bucket_upper = bucket_bound;
-      }
-      else if(bucket_bound == 0.0) {
-        bucket_lower = HIST_NEGATIVE_MAX_I;
-        bucket_upper = HIST_POSITIVE_MIN_I;
-      }
-      else {
-        bucket_lower = bucket_bound;
-        bucket_upper = bucket_bound + bucket_size;
-      }
+      double bucket_size = hist_bucket_bounds(bucket, &bucket_lower, &bucket_upper);
       while(threshold < bucket_lower) {
         out[in_idx] = (double) count_below / total_cnt;
         NEXT_THRESHOLD;
@@ -1761,6 +3481,86 @@ hist_approx_inverse_quantile(const histogram_t *hist, const double *in, int in_s
   return 0;
 }
 
+hist_threshold_t
+hist_threshold_compile(double value) {
+  hist_threshold_t t;
+  double lower, upper;
+  memset(&t, 0, sizeof(t));
+  t.value = value;
+  t.bucket = double_to_hist_bucket(value);
+  if(hist_bucket_isnan(t.bucket)) {
+    /* out of range (or NaN, which no bucket is below) */
+    t.position = (value < 0) ? -1 : 1;
+    return t;
+  }
+  if(hist_bucket_bounds(t.bucket, &lower, &upper) == 0.0) t.fraction = 0;
+  else if(value >= upper) t.fraction = 1;
+  else if(value < lower) t.fraction = 0;
+  else t.fraction = (value - lower) / (upper - lower);
+  return t;
+}
+
+/* Counts in the non-NaN bins below hb and in hb itself: search for the
+ * bucket, then sum whichever side of it is shorter */
+static void
+hist_threshold_split(const histogram_t *hist, hist_bucket_t hb, uint64_t *below, uint64_t *at) {
+  int i, idx, first = 0;
+  int found = hist_internal_search(hist, hb, &idx);
+  uint64_t sum = 0;
+  while(first < hist->used && hist_bucket_isnan(hist->bvs[first].bucket)) first++;
+  *at = found ? hist->bvs[idx].count : 0;
+  if(hist->total_valid && hist->used - idx < idx - first) {
+    for(i=idx;i<hist->used;i++) sum += hist->bvs[i].count;
+    *below = hist->total - sum;
+  }
+  else {
+    for(i=first;i<idx;i++) sum += hist->bvs[i].count;
+    *below = sum;
+  }
+}
+
+uint64_t
+hist_threshold_count_below(const histogram_t *hist, const hist_threshold_t *t, int inclusive) {
+  uint64_t below, at;
+  if(!hist) return 0;
+  if(hist->weighted)
+    return inclusive ? hist_approx_count_below_inclusive(hist, t->value)
+                     : hist_approx_count_below_exclusive(hist, t->value);
+  ASSERT_GOOD_HIST(hist);
+  if(hist_bucket_isnan(t->bucket)) return 0;
+  hist_threshold_split(hist, t->bucket, &below, &at);
+  return inclusive ? below + at : below;
+}
+
+uint64_t
+hist_threshold_count_above(const histogram_t *hist, const hist_threshold_t *t, int inclusive) {
+  uint64_t below, at;
+  if(!hist) return 0;
+  if(hist->weighted)
+    return inclusive ? hist_approx_count_above_inclusive(hist, t->value)
+                     : hist_approx_count_above_exclusive(hist, t->value);
+  ASSERT_GOOD_HIST(hist);
+  if(hist_bucket_isnan(t->bucket)) return hist_sample_count(hist);
+  hist_threshold_split(hist, t->bucket, &below, &at);
+  return hist_sample_count(hist) - (inclusive ? below : below + at);
+}
+
+double
+hist_threshold_inverse_quantile(const histogram_t *hist, const hist_threshold_t *t) {
+  uint64_t below, at;
+  double out = private_nan;
+  if(!hist) return out;
+  if(!hist->total_valid) {
+    hist_approx_inverse_quantile(hist, &t->value, 1, &out);
+    return out;
+  }
+  ASSERT_GOOD_HIST(hist);
+  if(hist->total == 0) return out;
+  if(t->position) return t->position < 0 ? 0 : 1;
+  hist_threshold_split(hist, t->bucket, &below, &at);
+  return ((double)below + t->fraction * (double)at) / (double)hist->total;
+}
+
 histogram_t *
 hist_create_approximation_from_adhoc(histogram_approx_mode_t mode,
                                      const histogram_adhoc_bin_t *bins,
@@ -1778,13 +3578,21 @@ hist_create_approximation_from_adhoc(histogram_approx_mode_t mode,
    * not guarantee consistent (in)->(out) consistency.
    */
   (void)sum;
-  histogram_t *h = hist_alloc_nbins(nbins);
+  histogram_t *h;
+  hist_bucket_t *buckets = malloc(nbins * sizeof(*buckets) + 1);
+  uint64_t *counts = malloc(nbins * sizeof(*counts) + 1);
   double last_spread = 0;
+  if(!buckets || !counts) {
+    free(buckets);
+    free(counts);
+    return NULL;
+  }
   for(size_t i=0; i<nbins; i++) {
     double a = bins[i].lower;
     double b = bins[i].upper;
     if(a == b && b == 0) {
-      hist_insert(h, 0, bins[i].count);
+      buckets[i] = double_to_hist_bucket(0);
+      counts[i] = bins[i].count;
       last_spread = 0;
       continue;
     }
@@ -1846,8 +3654,13 @@ hist_create_approximation_from_adhoc(histogram_approx_mode_t mode,
       double offset1 = abs(b), offset2 = abs(bins[1].upper - bins[1].lower);
       m = a - (offset1 > offset2 ? offset2 : offset1);
     }
-    hist_insert(h, m, bins[i].count);
+    buckets[i] = double_to_hist_bucket(m);
+    counts[i] = bins[i].count;
     last_spread = b - a;
   }
+  /* adhoc bins are usually ordered, which makes this a single pass */
+  h = hist_from_sorted(buckets, counts, (int)nbins);
+  free(buckets);
+  free(counts);
   return h;
 }
@@ -53,6 +53,14 @@ typedef struct hist_bucket {
   int8_t exp; //!< exponent -128 .. 127
 } hist_bucket_t;
 
+//! State of the random number generator used by hist_downsample_r (xoshiro256**)
+//!
+//! Each thread should use its own state; seeding it the same way reproduces
+//! the same sequence of downsampling decisions.
+typedef struct hist_rng {
+  uint64_t s[4];
+} hist_rng_t;
+
 typedef struct hist_allocator {
   void *(*malloc)(size_t);
   void *(*calloc)(size_t, size_t);
@@ -72,6 +80,58 @@ API_EXPORT(double) hist_bucket_to_double_bin_width(hist_bucket_t hb);
 API_EXPORT(hist_bucket_t) double_to_hist_bucket(double d);
 //! Create the bucket that value * 10^(scale) belongs to
 API_EXPORT(hist_bucket_t) int_scale_to_hist_bucket(int64_t value, int scale);
+//! Inline version of int_scale_to_hist_bucket for hot loops
+//!
+//! The digit count comes from the bit length and one table lookup, followed
+//! by a single division, instead of dividing by 10 until the value fits.
+//! With a constant scale (see int_ns_to_hist_bucket and friends) the exponent
+//! arithmetic folds away in the caller.
+/* FFI_SKIP_BEGIN */
+static inline hist_bucket_t
+hist_int_scale_bucket_inline(int64_t value, int scale) {
+  static const uint64_t hist_pow10[20] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+    100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL
+  };
+  hist_bucket_t hb = { 0, 0 };
+  uint64_t v;
+  int sign = 1, digits;
+  if(value == 0) return hb;
+  if(value < 0) {
+    v = value == INT64_MIN ? (uint64_t)INT64_MAX : (uint64_t)0 - (uint64_t)value;
+    sign = -1;
+  }
+  else v = (uint64_t)value;
+  /* digits = floor(log10(v)); 1233/4096 is just below log10(2), so the
+   * estimate is never too low and at most one too high */
+#if defined(__GNUC__) || defined(__clang__)
+  digits = ((64 - __builtin_clzll(v)) * 1233) >> 12;
+  digits -= v < hist_pow10[digits];
+#else
+  for(digits = 0; digits < 19 && v >= hist_pow10[digits + 1]; digits++);
+#endif
+  if(digits == 0) v *= 10;
+  else v /= hist_pow10[digits - 1];
+  scale += digits;
+  if(scale < -128) return hb;
+  if(scale > 127) {
+    hb.val = (int8_t)0xff; /* NaN */
+    return hb;
+  }
+  hb.val = (int8_t)(sign * (int)v);
+  hb.exp = (int8_t)scale;
+  return hb;
+}
+/* FFI_SKIP_END */
+//! Bucket of a count of nanoseconds, in seconds
+#define int_ns_to_hist_bucket(value) hist_int_scale_bucket_inline((value), -9)
+//! Bucket of a count of microseconds, in seconds
+#define int_us_to_hist_bucket(value) hist_int_scale_bucket_inline((value), -6)
+//! Bucket of a count of milliseconds, in seconds
+#define int_ms_to_hist_bucket(value) hist_int_scale_bucket_inline((value), -3)
 //! Writes a standardized string representation to buf
 //! Buf must be of size HIST_BUCKET_MAX_STRING_SIZE or larger.
 //! \return of characters of bytes written into the buffer excluding terminator
@@ -97,6 +157,8 @@ API_EXPORT(int) hist_bucket_to_string(hist_bucket_t hb, char *buf);
 //! Create a new histogram, uses default allocator
 API_EXPORT(histogram_t *) hist_alloc(void);
 //! Create a new histogram with preallocated bins, uses default allocator
+/*! Up to 16 bins are kept inline with the histogram itself, so small
+ *  histograms cost a single allocation until they outgrow that. */
 API_EXPORT(histogram_t *) hist_alloc_nbins(int nbins);
 //! Create a fast-histogram
 /*! Fast allocations consume 2kb + N * 512b more memory
@@ -105,8 +167,24 @@ API_EXPORT(histogram_t *) hist_alloc_nbins(int nbins);
 API_EXPORT(histogram_t *) hist_fast_alloc(void);
 //! Create a fast-histogram with preallocated bins, uses default allocator
 API_EXPORT(histogram_t *) hist_fast_alloc_nbins(int nbins);
+//! Create a compact fast-histogram
+/*! Compact allocations consume a fixed 6.5kb more memory: a bitmap over all
+ *  possible buckets with rank counts.  Finding a bucket or its insert position
+ *  is O(1) without any pointer chasing, uses default allocator */
+API_EXPORT(histogram_t *) hist_compact_alloc(void);
+//! Create a compact fast-histogram with preallocated bins, uses default allocator
+API_EXPORT(histogram_t *) hist_compact_alloc_nbins(int nbins);
 //! Create an exact copy of other, uses default allocator
+/*! If other uses the same allocator, the copy shares other's bins and is
+ *  made in O(1); whichever of the two is modified first takes a private
+ *  copy then.  Several threads may clone the same histogram concurrently. */
 API_EXPORT(histogram_t *) hist_clone(const histogram_t *other);
+//! Create a histogram from n bucket/count pairs, uses default allocator
+//!
+//! Input in ascending bucket order without duplicates is built in O(n) with a
+//! single allocation; anything else is sorted and merged.  Invalid buckets are
+//! skipped.  Returns NULL if out of memory.
+API_EXPORT(histogram_t *) hist_from_sorted(const hist_bucket_t *buckets, const uint64_t *counts, int n);
 
 //! Create a new histogram, uses custom allocator
 API_EXPORT(histogram_t *) hist_alloc_with_allocator(const hist_allocator_t *alloc);
@@ -119,12 +197,86 @@ API_EXPORT(histogram_t *) hist_alloc_nbins_with_allocator(int nbins, const hist_
 API_EXPORT(histogram_t *) hist_fast_alloc_with_allocator(const hist_allocator_t *alloc);
 //! Create a fast-histogram with preallocated bins, uses custom allocator
 API_EXPORT(histogram_t *) hist_fast_alloc_nbins_with_allocator(int nbins, const hist_allocator_t *alloc);
-//! Create an exact copy of other, uses custom allocator
+//! Create a compact fast-histogram, uses custom allocator
+API_EXPORT(histogram_t *) hist_compact_alloc_with_allocator(const hist_allocator_t *alloc);
+//! Create a compact fast-histogram with preallocated bins, uses custom allocator
+API_EXPORT(histogram_t *) hist_compact_alloc_nbins_with_allocator(int nbins, const hist_allocator_t *alloc);
+//! Create an exact copy of other, uses custom allocator (copy-on-write like hist_clone)
 API_EXPORT(histogram_t *) hist_clone_with_allocator(const histogram_t *other, const hist_allocator_t *alloc);
+//! Create a histogram from n bucket/count pairs like hist_from_sorted, uses custom allocator
+API_EXPORT(histogram_t *) hist_from_sorted_with_allocator(const hist_bucket_t *buckets, const uint64_t *counts, int n, const hist_allocator_t *alloc);
 
 //! Free a (fast-) histogram, frees with allocator chosen during the alloc/clone
 API_EXPORT(void) hist_free(histogram_t *hist);
 
+////////////////////////////////////////////////////////////////////////////////
+// Allocators
+//
+// Drop-in hist_allocator_t implementations for code that creates and frees
+// histograms at a high rate.
+
+//! Allocator recycling freed blocks through per-thread, per-size-class free lists
+//!
+//! Size classes follow the growth of bucket arrays (DEFAULT_HIST_SIZE pairs at
+//! a time).  Each thread caches up to 1MB per class, which is released when
+//! the thread exits; blocks may be freed on any thread.
+API_EXPORT(const hist_allocator_t *) hist_pool_allocator(void);
+//! Return the calling thread's cached pool blocks to the system now rather than at thread exit
+API_EXPORT(void) hist_pool_flush(void);
+
+typedef struct hist_arena hist_arena_t;
+
+//! Create an arena that takes memory from the system chunk_size bytes at a time (0 for 64kb)
+API_EXPORT(hist_arena_t *) hist_arena_alloc(size_t chunk_size);
+//! Free an arena and everything allocated from it
+API_EXPORT(void) hist_arena_free(hist_arena_t *a);
+//! Release everything allocated from the arena at once, keeping its memory for reuse
+//!
+//! Histograms allocated from the arena must not be used afterwards;
+//! hist_free on them is a no-op and may be skipped.
+API_EXPORT(void) hist_arena_reset(hist_arena_t *a);
+//! Make a the arena the calling thread allocates from, returns the previous one
+API_EXPORT(hist_arena_t *) hist_arena_enter(hist_arena_t *a);
+//! Allocator drawing from the calling thread's current arena (allocations fail if there is none)
+API_EXPORT(const hist_allocator_t *) hist_arena_allocator(void);
+
+////////////////////////////////////////////////////////////////////////////////
+// Query contexts
+//
+// A query context owns an arena for the intermediate histograms of one query
+// (clone, compress, merge, ...).  Nothing needs freeing one by one; ending
+// the query releases it all at once.
+
+typedef struct hist_query hist_query_t;
+
+//! Create a query context whose arena grows chunk_size bytes at a time (0 for 64kb)
+API_EXPORT(hist_query_t *) hist_query_alloc(size_t chunk_size);
+//! Free a query context and everything allocated from it
+API_EXPORT(void) hist_query_free(hist_query_t *q);
+//! Start a query on the calling thread
+//!
+//! Until hist_query_end, hist_query_allocator() (and so every _with_allocator
+//! call given it) allocates from q.  Histograms from q may only grow while
+//! the query is running, and only on this thread; elsewhere inserts that need
+//! room fail and return 0.
+API_EXPORT(void) hist_query_begin(hist_query_t *q);
+//! End the query: release every histogram allocated from q and restore the
+//! thread's previous arena
+API_EXPORT(void) hist_query_end(hist_query_t *q);
+//! Allocator drawing from the query running on the calling thread
+API_EXPORT(const hist_allocator_t *) hist_query_allocator(void);
+//! Create a histogram in q
+//!
+//! This and the helpers below need q running on the calling thread
+//! (hist_query_begin) and return NULL otherwise.
+API_EXPORT(histogram_t *) hist_query_hist(hist_query_t *q);
+//! Copy other into q
+API_EXPORT(histogram_t *) hist_query_clone(hist_query_t *q, const histogram_t *other);
+//! Compress h into q, see hist_compress_mbe
+API_EXPORT(histogram_t *) hist_query_compress_mbe(hist_query_t *q, const histogram_t *h, int8_t mbe);
+//! Merge cnt histograms into a new histogram in q, see hist_accumulate
+API_EXPORT(histogram_t *) hist_query_merge(hist_query_t *q, const histogram_t * const *src, int cnt);
+
 ////////////////////////////////////////////////////////////////////////////////
 // Getting data in and out of histograms
 
@@ -143,6 +295,16 @@ API_EXPORT(uint64_t) hist_remove_raw(histogram_t *hist, hist_bucket_t hb, uint64
 //! Updates counts if the bucket exists
 //! Handles re-allocation of new buckets if needed
 API_EXPORT(uint64_t) hist_insert_raw(histogram_t *hist, hist_bucket_t hb, uint64_t count);
+//! Insert each of n buckets once, returns n (or 0 if out of memory)
+//!
+//! Cheaper than n hist_insert_raw calls: equal buckets are coalesced and
+//! merged in a single pass.  hb is sorted in place.
+API_EXPORT(uint64_t) hist_insert_raw_batch(histogram_t *hist, hist_bucket_t *hb, int n);
+//! Replace the contents of hist with n bucket/count pairs, as hist_from_sorted does
+//!
+//! Works on any kind of histogram; the fast index is built once at the end.
+//! \return the number of buckets in hist, or -1 if out of memory (hist is unchanged)
+API_EXPORT(int) hist_set_sorted(histogram_t *hist, const hist_bucket_t *buckets, const uint64_t *counts, int n);
 //! Like hist_insert_raw, but optimizes for the case that this bin does not exist, there is room, and is
 //! larger than any existing bin.
 API_EXPORT(uint64_t) hist_insert_raw_end(histogram_t *hist, hist_bucket_t hb, uint64_t count);
@@ -165,11 +327,73 @@ API_EXPORT(int) hist_subtract_as_int64(histogram_t *tgt, const histogram_t *src)
 //! Add bins in src from tgt treating src counts as signed, return -1 on overflow error
 API_EXPORT(int) hist_add_as_int64(histogram_t *tgt, const histogram_t *src);
 //! Downsample a histogram to a certain factor.
+//!
+//! Each bin keeps a binomial(count, factor) sample of its count, drawn with drand48().
 API_EXPORT(void) hist_downsample(histogram_t *tgt, double factor);
+//! Downsample like hist_downsample, drawing uniform variates in [0,1) from uniform(closure)
+API_EXPORT(void) hist_downsample_with_uniform(histogram_t *tgt, double factor, double (*uniform)(void *closure), void *closure);
+//! Downsample without randomness, identical input always gives identical output
+//!
+//! Bins keep the floor of count * factor; the units lost to rounding go to the
+//! bins with the largest remainders (lower bins first on ties), so the new
+//! total is exactly floor(total * factor).
+//! \return 0 on success, -1 if scratch memory could not be allocated
+API_EXPORT(int) hist_downsample_deterministic(histogram_t *tgt, double factor);
+//! Downsample like hist_downsample, using and advancing the caller's rng state
+API_EXPORT(void) hist_downsample_r(histogram_t *tgt, double factor, hist_rng_t *rng);
+//! Initialize rng state from a 64 bit seed
+API_EXPORT(void) hist_rng_seed(hist_rng_t *rng, uint64_t seed);
+//! Next 64 random bits from rng
+API_EXPORT(uint64_t) hist_rng_next(hist_rng_t *rng);
 //! Clear data fast. Keeps buckets allocated.
 API_EXPORT(void) hist_clear(histogram_t *hist);
 //! Insert a value into a histogram value = val * 10^(scale)
 API_EXPORT(uint64_t) hist_insert_intscale(histogram_t *hist, int64_t val, int scale, uint64_t count);
+//! Insert a count of nanoseconds, in seconds (hist_insert_intscale with scale -9)
+#define hist_insert_ns(hist, val, count) hist_insert_raw((hist), int_ns_to_hist_bucket(val), (count))
+//! Insert a count of microseconds, in seconds (hist_insert_intscale with scale -6)
+#define hist_insert_us(hist, val, count) hist_insert_raw((hist), int_us_to_hist_bucket(val), (count))
+//! Insert a count of milliseconds, in seconds (hist_insert_intscale with scale -3)
+#define hist_insert_ms(hist, val, count) hist_insert_raw((hist), int_ms_to_hist_bucket(val), (count))
+
+////////////////////////////////////////////////////////////////////////////////
+// Weighted histograms
+//
+// A weighted histogram keeps a non-negative double weight per bucket instead
+// of an integer count, for sampled or pre-aggregated data.  All analytics
+// work on weights.  Integer inserts and integer histograms merge into a
+// weighted one; the reverse is refused, since weights don't fit into counts.
+// Serialized weighted histograms use a bucket encoding that plain histograms
+// (and older readers) reject.  Block encoding and the as_int64 operations
+// are integer only.
+
+//! Create a new weighted histogram, uses default allocator
+API_EXPORT(histogram_t *) hist_alloc_weighted(void);
+//! Create a new weighted histogram, uses custom allocator
+API_EXPORT(histogram_t *) hist_alloc_weighted_with_allocator(const hist_allocator_t *alloc);
+//! Create a weighted fast-histogram, uses default allocator
+API_EXPORT(histogram_t *) hist_fast_alloc_weighted(void);
+//! Returns 1 if hist stores weights rather than counts
+API_EXPORT(int) hist_is_weighted(const histogram_t *hist);
+//! Add weight to a bucket, returns the weight added
+//!
+//! Weights that are not positive are ignored.  A plain histogram takes the
+//! weight rounded to the nearest count.
+API_EXPORT(double) hist_insert_raw_weighted(histogram_t *hist, hist_bucket_t hb, double weight);
+//! Add weight to the bucket of val
+API_EXPORT(double) hist_insert_weighted(histogram_t *hist, double val, double weight);
+//! Add weight to the bucket of val * 10^(scale)
+API_EXPORT(double) hist_insert_intscale_weighted(histogram_t *hist, int64_t val, int scale, double weight);
+//! Get the total weight stored in the histogram (the sample count if it isn't weighted)
+//!
+//! hist_sample_count of a weighted histogram is this rounded to an integer.
+API_EXPORT(double) hist_sample_weight(const histogram_t *hist);
+//! Get bucket+weight for bucket at position idx. Valid positions are 0 .. hist_bucket_count()
+API_EXPORT(int) hist_bucket_idx_weight(const histogram_t *hist, int idx, hist_bucket_t *b, double *w);
+//! Weighted counterpart of hist_approx_count_below
+API_EXPORT(double) hist_approx_weight_below(const histogram_t *hist, double threshold);
+//! Weighted counterpart of hist_approx_count_above
+API_EXPORT(double) hist_approx_weight_above(const histogram_t *hist, double threshold);
 
 ////////////////////////////////////////////////////////////////////////////////
 // Serialization
@@ -178,10 +402,37 @@ API_EXPORT(uint64_t) hist_insert_intscale(histogram_t *hist, int64_t val, int sc
 API_EXPORT(ssize_t) hist_serialize(const histogram_t *h, void *buff, ssize_t len);
 API_EXPORT(ssize_t) hist_deserialize(histogram_t *h, const void *buff, ssize_t len);
 API_EXPORT(ssize_t) hist_serialize_estimate(const histogram_t *h);
+//! Merge a serialized histogram into tgt without materializing it first
+//! \return number of bytes consumed, or -1 on malformed input (tgt is left untouched)
+API_EXPORT(ssize_t) hist_accumulate_serialized(histogram_t *tgt, const void *buff, ssize_t len);
 //! Return histogram serialization as base64 encoded string
 API_EXPORT(ssize_t) hist_serialize_b64(const histogram_t *h, char *b64_serialized_histo_buff, ssize_t buff_len);
 API_EXPORT(ssize_t) hist_deserialize_b64(histogram_t *h, const void *b64_string, ssize_t b64_string_len);
 API_EXPORT(ssize_t) hist_serialize_b64_estimate(const histogram_t *h);
+//! Compute the arena layout for base64 serializing cnt histograms back to back
+//!
+//! The encoded string of h[i] will occupy arena[offsets[i]] .. arena[offsets[i+1]-1].
+//! Strings are neither separated nor NUL terminated.
+//! \param h array of cnt histograms, NULL entries encode as empty histograms
+//! \param offsets pre-allocated array of cnt+1 entries
+//! \return the number of bytes the arena must hold
+API_EXPORT(ssize_t) hist_serialize_b64_batch_layout(const histogram_t * const *h, int cnt, ssize_t *offsets);
+//! Base64 serialize h[first] .. h[last-1] into an arena laid out by hist_serialize_b64_batch_layout
+//!
+//! No memory is allocated. Calls on disjoint ranges touch disjoint parts of the
+//! arena and may run concurrently on different threads.
+//! \return 0 on success, -1 if a histogram no longer matches the layout
+API_EXPORT(int) hist_serialize_b64_batch(const histogram_t * const *h, const ssize_t *offsets, int first, int last, char *arena);
+
+//! Upper bound of the framed serialization size (hist_serialize_estimate + 16 byte header)
+API_EXPORT(ssize_t) hist_serialize_framed_estimate(const histogram_t *h);
+//! Serialize histogram as a frame: magic, version, payload length and CRC32C, then the hist_serialize payload
+API_EXPORT(ssize_t) hist_serialize_framed(const histogram_t *h, void *buff, ssize_t len);
+//! Check a frame without allocating: header, checksum, and that every bucket is valid and in order
+//! \return the length of the frame, or -1 if it is truncated or corrupt
+API_EXPORT(ssize_t) hist_framed_validate(const void *buff, ssize_t len);
+//! Validate and deserialize a frame, returns the length of the frame or -1 (h is untouched if the frame is rejected)
+API_EXPORT(ssize_t) hist_deserialize_framed(histogram_t *h, const void *buff, ssize_t len);
 
 API_EXPORT(void) hist_remove_zeroes(histogram_t *h);
 //! Compress histogram by squshing together adjacent buckets
@@ -190,8 +441,222 @@ API_EXPORT(void) hist_remove_zeroes(histogram_t *h);
 //! Intended use cases is visualization.
 //! \param hist
 //! \param mbe the Minimum Bucket Exponent
-//! \return the compressed histogram as new value
+//! \return the compressed histogram as new value, allocated like h
 API_EXPORT(histogram_t *) hist_compress_mbe(const histogram_t *h, int8_t mbe);
+//! Like hist_compress_mbe, uses custom allocator for the result
+API_EXPORT(histogram_t *) hist_compress_mbe_with_allocator(const histogram_t *h, int8_t mbe, const hist_allocator_t *alloc);
+
+////////////////////////////////////////////////////////////////////////////////
+// Archives
+//
+// An archive file holds hist_serialize records keyed by (series, timestamp)
+// behind a sorted index.  Readers map the file and hand out views into it.
+
+typedef struct hist_archive_writer hist_archive_writer_t;
+typedef struct hist_archive hist_archive_t;
+
+//! Create (truncate) an archive file for writing
+API_EXPORT(hist_archive_writer_t *) hist_archive_writer_open(const char *path);
+//! Append a histogram under (series, timestamp), records may be added in any order
+//!
+//! After a failed write the writer refuses further records and
+//! hist_archive_writer_close fails without finishing the file.
+API_EXPORT(int) hist_archive_writer_add(hist_archive_writer_t *w, uint64_t series, int64_t timestamp, const histogram_t *h);
+//! Write the sorted index, finish the file and free the writer, returns -1 on I/O error
+API_EXPORT(int) hist_archive_writer_close(hist_archive_writer_t *w);
+
+//! Map an archive file for reading, returns NULL if it is missing or malformed
+API_EXPORT(hist_archive_t *) hist_archive_open(const char *path);
+//! Unmap an archive, invalidates all views handed out by it
+API_EXPORT(void) hist_archive_close(hist_archive_t *a);
+//! Number of records in the archive
+API_EXPORT(uint64_t) hist_archive_count(const hist_archive_t *a);
+//! Index of the first record with key >= (series, timestamp), or hist_archive_count() if none
+API_EXPORT(uint64_t) hist_archive_lower_bound(const hist_archive_t *a, uint64_t series, int64_t timestamp);
+//! Zero-copy view of record idx. data points into the mapping, pass it to
+//! hist_deserialize or hist_accumulate_serialized. Any output may be NULL.
+//! \return 0 on success, -1 if idx is out of range or the record is corrupt
+API_EXPORT(int) hist_archive_entry(const hist_archive_t *a, uint64_t idx, uint64_t *series, int64_t *timestamp, const void **data, ssize_t *len);
+//! Deserialize the record stored under (series, timestamp) into out, returns -1 if not found
+API_EXPORT(int) hist_archive_lookup(const hist_archive_t *a, uint64_t series, int64_t timestamp, histogram_t *out);
+//! Merge all records of series with start <= timestamp < end into tgt
+//! \return the number of records merged, or -1 on a corrupt record (tgt is left untouched)
+API_EXPORT(int64_t) hist_archive_merge_range(const hist_archive_t *a, uint64_t series, int64_t start, int64_t end, histogram_t *tgt);
+
+////////////////////////////////////////////////////////////////////////////////
+// Time-series blocks
+//
+// A block stores consecutive histograms of one series column-wise: the union
+// of their bucket keys once, then per bucket the counts of every step as
+// delta-of-delta varints.  Neighbouring steps sharing buckets cost ~1 byte/bin.
+
+//! Upper bound of the size of a block holding the n histograms in h
+API_EXPORT(ssize_t) hist_block_encode_estimate(const histogram_t * const *h, int n);
+//! Encode n histograms (NULL entries are empty steps) as a block
+//! \param timestamps n timestamps stored alongside the steps, may be NULL
+//! \return bytes written, or -1 if len is too small
+API_EXPORT(ssize_t) hist_block_encode(const histogram_t * const *h, const int64_t *timestamps, int n, void *buff, ssize_t len);
+//! Number of steps in a block, -1 if malformed
+API_EXPORT(int) hist_block_steps(const void *buff, ssize_t len);
+//! Decode the timestamps of all steps into a pre-allocated array, returns the number of steps or -1
+API_EXPORT(int) hist_block_timestamps(const void *buff, ssize_t len, int64_t *timestamps);
+//! Merge steps first .. last-1 of a block into tgt by summing the count columns
+//! \return the number of steps merged, or -1 on a malformed block (tgt is left untouched)
+API_EXPORT(int) hist_block_merge_range(const void *buff, ssize_t len, int first, int last, histogram_t *tgt);
+
+////////////////////////////////////////////////////////////////////////////////
+// Rolling windows
+//
+// A window is a ring of nslices histograms, one per slice_width time units,
+// plus an aggregate of all of them.  Time is an arbitrary unsigned counter
+// (seconds, milliseconds, ...) chosen by the caller.  Expiring a slice
+// subtracts it from the aggregate, so querying the last nslices * slice_width
+// never merges slices.
+
+typedef struct hist_window hist_window_t;
+
+//! Create a window of nslices slices, each covering slice_width time units
+API_EXPORT(hist_window_t *) hist_window_alloc(int nslices, uint64_t slice_width);
+API_EXPORT(void) hist_window_free(hist_window_t *w);
+//! Move the window forward so it ends with the slice holding now
+//! \return the number of non-empty slices that expired
+API_EXPORT(int) hist_window_advance(hist_window_t *w, uint64_t now);
+//! Insert a value at time t, advancing the window if t lies past its end
+//!
+//! Late data lands in its own slice as long as that slice is still live.
+//! \return the count inserted, 0 if the slice for t has already expired
+API_EXPORT(uint64_t) hist_window_insert(hist_window_t *w, uint64_t t, double val, uint64_t count);
+API_EXPORT(uint64_t) hist_window_insert_intscale(hist_window_t *w, uint64_t t, int64_t val, int scale, uint64_t count);
+//! Merge a histogram into the slice holding t, returns -1 if that slice has expired
+API_EXPORT(int) hist_window_accumulate(hist_window_t *w, uint64_t t, const histogram_t *h);
+//! The sum of all live slices, owned by the window and valid until it is modified
+API_EXPORT(const histogram_t *) hist_window_aggregate(const hist_window_t *w);
+
+////////////////////////////////////////////////////////////////////////////////
+// Rollups
+//
+// A rollup keeps one series at several resolutions, e.g. 1s, 1m, 1h and 1d,
+// each as a ring of its most recent periods.  Data enters at the finest level;
+// when a period closes it is folded into the enclosing period one level up.
+// Range queries use the coarsest complete periods that fit the range and
+// fall back to finer levels only at the edges.
+
+//! One resolution of a rollup
+typedef struct hist_rollup_level {
+  uint64_t period; //!< period length in time units, a multiple of the finer level's
+  uint32_t retain; //!< number of periods kept
+} hist_rollup_level_t;
+//! Rollup levels, finest first
+struct hist_rollup_config {
+  int nlevels;
+  hist_rollup_level_t levels[8];
+};
+typedef struct hist_rollup hist_rollup_t;
+
+//! Create a rollup for one series, NULL if the config is invalid
+API_EXPORT(hist_rollup_t *) hist_rollup_alloc(const hist_rollup_config_t *config);
+API_EXPORT(void) hist_rollup_free(hist_rollup_t *r);
+//! Close all periods ending at or before now and fold them into coarser levels
+//! \return the number of levels that closed a period
+API_EXPORT(int) hist_rollup_advance(hist_rollup_t *r, uint64_t now);
+//! Insert at time t, advancing the rollup if t lies past the open period
+//!
+//! Late data is added to every level that still retains its period.
+//! \return the number of levels updated, 0 if t is too old for all of them
+API_EXPORT(int) hist_rollup_insert(hist_rollup_t *r, uint64_t t, double val, uint64_t count);
+API_EXPORT(int) hist_rollup_insert_intscale(hist_rollup_t *r, uint64_t t, int64_t val, int scale, uint64_t count);
+API_EXPORT(int) hist_rollup_insert_raw(hist_rollup_t *r, uint64_t t, hist_bucket_t hb, uint64_t count);
+//! Merge a histogram at time t, same rules as hist_rollup_insert
+API_EXPORT(int) hist_rollup_accumulate(hist_rollup_t *r, uint64_t t, const histogram_t *h);
+//! Accumulate everything retained in [start, end) onto out
+//!
+//! Finest level periods count if they start within the range.
+//! \return the number of stored histograms merged, -1 on allocation failure
+API_EXPORT(int) hist_rollup_query(const hist_rollup_t *r, uint64_t start, uint64_t end, histogram_t *out);
+
+////////////////////////////////////////////////////////////////////////////////
+// Decaying histograms
+//
+// Counts in a decaying histogram halve every halflife time units.  Decay is
+// applied lazily through a shared epoch: inserts are O(1) and never rescale
+// other bins, except for an occasional renormalization every few half-lives.
+
+typedef struct hist_decay hist_decay_t;
+
+//! Create a decaying histogram, halflife is in the caller's time units
+API_EXPORT(hist_decay_t *) hist_decay_alloc(uint64_t halflife);
+API_EXPORT(void) hist_decay_free(hist_decay_t *d);
+//! Insert count samples observed at time t, returns count or 0 if its weight underflows
+API_EXPORT(uint64_t) hist_decay_insert(hist_decay_t *d, uint64_t t, double val, uint64_t count);
+API_EXPORT(uint64_t) hist_decay_insert_intscale(hist_decay_t *d, uint64_t t, int64_t val, int scale, uint64_t count);
+API_EXPORT(uint64_t) hist_decay_insert_raw(hist_decay_t *d, uint64_t t, hist_bucket_t hb, uint64_t count);
+//! The decayed number of samples as of now
+API_EXPORT(double) hist_decay_sample_count(const hist_decay_t *d, uint64_t now);
+//! Accumulate the decayed counts as of now, times multiplier and rounded, onto out
+//!
+//! The result is an ordinary histogram for use with the analytics functions.
+//! A multiplier above 1 keeps resolution for fractional counts.
+//! \return the number of buckets with a non-zero rounded count
+API_EXPORT(int) hist_decay_snapshot(const hist_decay_t *d, uint64_t now, uint64_t multiplier, histogram_t *out);
+
+////////////////////////////////////////////////////////////////////////////////
+// Ingest rings
+//
+// A ring queues raw samples so that recording costs a couple of stores and
+// the bucketing happens later on a draining thread.  Recording never blocks:
+// when the ring is full the sample is dropped and counted.  One thread (or
+// several, if the ring was created multi_producer) records, exactly one
+// thread drains.
+
+typedef struct hist_ring hist_ring_t;
+
+//! Create a ring holding at least capacity samples (rounded up to a power of 2, at most 2^30)
+API_EXPORT(hist_ring_t *) hist_ring_alloc(uint32_t capacity, int multi_producer);
+API_EXPORT(void) hist_ring_free(hist_ring_t *r);
+//! Queue a sample, returns 1, or 0 if the ring was full and the sample dropped
+API_EXPORT(int) hist_ring_record(hist_ring_t *r, double val);
+//! Queue the sample val * 10^(scale), returns 1, or 0 if the ring was full and the sample dropped
+API_EXPORT(int) hist_ring_record_intscale(hist_ring_t *r, int64_t val, int scale);
+//! Move up to max queued samples (0 for all) into h, in batches
+//!
+//! A batch h has no memory for is dropped and counted in hist_ring_dropped,
+//! and draining stops there.
+//! \return the number of samples moved
+API_EXPORT(uint64_t) hist_ring_drain(hist_ring_t *r, histogram_t *h, uint64_t max);
+//! Approximate number of queued samples, for backpressure
+API_EXPORT(uint64_t) hist_ring_pending(const hist_ring_t *r);
+API_EXPORT(uint64_t) hist_ring_capacity(const hist_ring_t *r);
+//! Number of samples dropped because the ring was full (or h out of memory while draining)
+API_EXPORT(uint64_t) hist_ring_dropped(const hist_ring_t *r);
+
+////////////////////////////////////////////////////////////////////////////////
+// Snapshots
+//
+// A publisher lets one writer keep updating its own histogram while reader
+// threads look at the last published version, without locks.  Publishing
+// freezes a copy of the histogram (O(1), see hist_clone) and swaps it in;
+// replaced copies are freed once no reader can still be using them.
+
+typedef struct hist_publisher hist_publisher_t;
+
+//! Create a publisher for up to max_readers reader threads, an empty histogram is published
+API_EXPORT(hist_publisher_t *) hist_publisher_alloc(int max_readers);
+//! Free a publisher and every published copy, no reader may be active
+API_EXPORT(void) hist_publisher_free(hist_publisher_t *p);
+//! Claim a reader slot for the calling thread, returns -1 if all are taken
+API_EXPORT(int) hist_publisher_register(hist_publisher_t *p);
+//! Give a slot back (dropping any snapshot it holds) so another thread can claim it
+API_EXPORT(void) hist_publisher_unregister(hist_publisher_t *p, int slot);
+//! Publish a frozen copy of h (writer only), returns 0 or -1 if out of memory
+API_EXPORT(int) hist_publish(hist_publisher_t *p, const histogram_t *h);
+//! Pin and return the current version, valid until hist_snapshot_release on the same slot
+//!
+//! Pins don't nest: each slot holds at most one snapshot at a time.
+API_EXPORT(const histogram_t *) hist_snapshot_acquire(hist_publisher_t *p, int slot);
+//! Unpin the snapshot held by slot
+API_EXPORT(void) hist_snapshot_release(hist_publisher_t *p, int slot);
+//! Number of replaced versions still waiting for readers to move on (writer only)
+API_EXPORT(int) hist_publisher_retired(const hist_publisher_t *p);
 
 ////////////////////////////////////////////////////////////////////////////////
 // Analytics
@@ -258,12 +723,55 @@ API_EXPORT(int) hist_approx_quantile(const histogram_t *, const double *q_in, in
 //! \param nq length of quantile array
 //! \param *q_out pre-allocated array where results shall be written to
 API_EXPORT(int) hist_approx_quantile7(const histogram_t *, const double *q_in, int nq, double *q_out);
+//! Type-1 quantiles of h[first] .. h[last-1], all for the same q_in
+//!
+//! q_in is checked once for the whole batch.  Row i of the cnt x nq result
+//! matrix, q_out[i*nq] .. q_out[i*nq+nq-1], belongs to h[i], so calls on
+//! disjoint ranges write disjoint rows and may run concurrently on different
+//! threads.  Empty histograms (and NULL) give NaN rows.
+//! \return 0 on success, -2 if q_in is out of order, -3 if a quantile is out of [0,1]
+API_EXPORT(int) hist_approx_quantile_batch(const histogram_t * const *h, int first, int last, const double *q_in, int nq, double *q_out);
+//! Type-7 quantiles of h[first] .. h[last-1], see hist_approx_quantile_batch
+API_EXPORT(int) hist_approx_quantile7_batch(const histogram_t * const *h, int first, int last, const double *q_in, int nq, double *q_out);
+//! Type-1 quantiles of the merge of cnt histograms, without building the merge
+//!
+//! Gives the same results as hist_accumulate into a new histogram followed by
+//! hist_approx_quantile, but only walks the merged buckets up to the highest
+//! quantile requested and allocates nothing for up to 1024 histograms.
+//! \return 0 on success, -1 if out of memory, -2 if q_in is out of order, -3 if a quantile is out of [0,1]
+API_EXPORT(int) hist_approx_quantile_merged(const histogram_t * const *src, int cnt, const double *q_in, int nq, double *q_out);
+//! Type-7 quantiles of the merge of cnt histograms, see hist_approx_quantile_merged
+API_EXPORT(int) hist_approx_quantile7_merged(const histogram_t * const *src, int cnt, const double *q_in, int nq, double *q_out);
 //! Approiximate n inverse quantiles (ratio below threshold) of all values stored in the histogram
 //! \param *iq_in array of inverse quantiles to compute
 //! \param niq length of inverse quantile array
 //! \param *iq_out pre-allocated array where results shall be written to
 API_EXPORT(int) hist_approx_inverse_quantile(const histogram_t *, const double *iq_in, int niq, double *iq_out);
 
+//! A threshold prepared once for evaluation against many histograms
+//!
+//! Fill with hist_threshold_compile; the fields are private.  Evaluating a
+//! compiled threshold is a binary search for its bucket plus a sum over the
+//! shorter side of it.
+typedef struct {
+  double value;
+  hist_bucket_t bucket;  //!< bucket holding value
+  int8_t position;       //!< -1/1 when value lies below/above every bucket
+  double fraction;       //!< share of the bucket below value
+} hist_threshold_t;
+
+//! Prepare a threshold for the hist_threshold_* functions
+API_EXPORT(hist_threshold_t) hist_threshold_compile(double value);
+//! hist_approx_count_below_inclusive (inclusive != 0) or hist_approx_count_below_exclusive for a compiled threshold
+API_EXPORT(uint64_t) hist_threshold_count_below(const histogram_t *hist, const hist_threshold_t *t, int inclusive);
+//! hist_approx_count_above_inclusive (inclusive != 0) or hist_approx_count_above_exclusive for a compiled threshold
+API_EXPORT(uint64_t) hist_threshold_count_above(const histogram_t *hist, const hist_threshold_t *t, int inclusive);
+//! The inverse quantile (ratio of samples below) of a compiled threshold, NaN for empty histograms
+//!
+//! Same as hist_approx_inverse_quantile, except for values within rounding
+//! distance of a bucket edge, which count as lying on it.
+API_EXPORT(double) hist_threshold_inverse_quantile(const histogram_t *hist, const hist_threshold_t *t);
+
 typedef struct {
   uint64_t count;
   double lower;
@@ -0,0 +1,402 @@
+/*
+ * Copyright (c) 2016-2021, Circonus, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#if defined(WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include "circllhist.h"
+
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+/* Pool allocator
+ *
+ * Every block carries a small header with its size class.  Freed blocks go
+ * onto a per-thread free list for their class and are handed out again by
+ * the next allocation of that class on the same thread, so steady churn of
+ * histograms never reaches malloc.  Blocks freed on another thread simply
+ * join that thread's lists.
+ *
+ * Histogram headers, fast index pages and the like land in the small power
+ * of two classes; bucket arrays grow in steps of DEFAULT_HIST_SIZE pairs and
+ * get one class per step.
+ *
+ * The first block a thread caches registers a thread-exit hook that flushes
+ * the cache, so threads that never call hist_pool_flush don't leak it.
+ */
+#define POOL_HEADER 16                  /* keeps blocks 16 byte aligned */
+#define POOL_SMALL_CLASSES 4            /* 64, 128, 256, 512 */
+#define POOL_STEP (DEFAULT_HIST_SIZE * 10) /* a packed bucket/count pair is 10 bytes */
+#define POOL_STEP_CLASSES 32
+#define POOL_CLASSES (POOL_SMALL_CLASSES + POOL_STEP_CLASSES)
+#define POOL_LARGE POOL_CLASSES         /* bigger than any class, not pooled */
+#define POOL_CACHE_BYTES (1 << 20)      /* per thread and class */
+
+struct pool_block {
+  struct pool_block *next;
+};
+
+struct pool_cache {
+  struct pool_block *head[POOL_CLASSES];
+  uint32_t count[POOL_CLASSES];
+  int registered;
+};
+
+static THREAD_LOCAL struct pool_cache pool_cache;
+
+static void
+pool_cache_flush(struct pool_cache *pc) {
+  int c;
+  for(c=0; c<POOL_CLASSES; c++) {
+    while(pc->head[c]) {
+      struct pool_block *b = pc->head[c];
+      pc->head[c] = b->next;
+      free((uint8_t *)b - POOL_HEADER);
+    }
+    pc->count[c] = 0;
+  }
+}
+
+/* Runs at thread exit with the exiting thread's cache.  Clearing registered
+ * lets a later destructor that frees into the pool register again. */
+static void
+pool_thread_exit(void *pc) {
+  pool_cache_flush(pc);
+  ((struct pool_cache *)pc)->registered = 0;
+}
+
+#if defined(WIN32)
+static DWORD pool_key = FLS_OUT_OF_INDEXES;
+static INIT_ONCE pool_key_once = INIT_ONCE_STATIC_INIT;
+
+static VOID WINAPI
+pool_fls_exit(PVOID pc) {
+  if(pc) pool_thread_exit(pc);
+}
+
+static BOOL CALLBACK
+pool_key_create(PINIT_ONCE once, PVOID param, PVOID *ctx) {
+  (void)once; (void)param; (void)ctx;
+  pool_key = FlsAlloc(pool_fls_exit);
+  return TRUE;
+}
+
+static void
+pool_register(void) {
+  InitOnceExecuteOnce(&pool_key_once, pool_key_create, NULL, NULL);
+  if(pool_key != FLS_OUT_OF_INDEXES) FlsSetValue(pool_key, &pool_cache);
+  pool_cache.registered = 1;
+}
+#else
+static pthread_key_t pool_key;
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+static int pool_key_ok;
+
+static void
+pool_key_create(void) {
+  pool_key_ok = pthread_key_create(&pool_key, pool_thread_exit) == 0;
+}
+
+static void
+pool_register(void) {
+  pthread_once(&pool_key_once, pool_key_create);
+  if(pool_key_ok) pthread_setspecific(pool_key, &pool_cache);
+  pool_cache.registered = 1;
+}
+#endif
+
+static inline int
+pool_class(size_t size) {
+  int c;
+  if(size <= 512) {
+    for(c=0; (size_t)(64 << c) < size; c++);
+    return c;
+  }
+  c = POOL_SMALL_CLASSES + (int)((size + POOL_STEP - 1) / POOL_STEP) - 1;
+  return c < POOL_CLASSES ? c : POOL_LARGE;
+}
+
+static inline size_t
+pool_class_size(int c) {
+  if(c < POOL_SMALL_CLASSES) return (size_t)64 << c;
+  return (size_t)(c - POOL_SMALL_CLASSES + 1) * POOL_STEP;
+}
+
+static void *
+pool_malloc(size_t size) {
+  int c = pool_class(size);
+  uint8_t *block;
+  if(c != POOL_LARGE && pool_cache.head[c]) {
+    block = (uint8_t *)pool_cache.head[c];
+    pool_cache.head[c] = pool_cache.head[c]->next;
+    pool_cache.count[c]--;
+    return block;
+  }
+  block = malloc(POOL_HEADER + (c == POOL_LARGE ? size : pool_class_size(c)));
+  if(!block) return NULL;
+  *(int *)block = c;
+  return block + POOL_HEADER;
+}
+
+static void *
+pool_calloc(size_t nmemb, size_t size) {
+  void *block;
+  if(size && nmemb > ~(size_t)0 / size) return NULL;
+  block = pool_malloc(nmemb * size);
+  if(block) memset(block, 0, nmemb * size);
+  return block;
+}
+
+static void
+pool_free(void *ptr) {
+  uint8_t *block = ptr;
+  int c;
+  if(!ptr) return;
+  c = *(int *)(block - POOL_HEADER);
+  if(c == POOL_LARGE || pool_cache.count[c] >= POOL_CACHE_BYTES / pool_class_size(c)) {
+    free(block - POOL_HEADER);
+    return;
+  }
+  if(!pool_cache.registered) pool_register();
+  ((struct pool_block *)ptr)->next = pool_cache.head[c];
+  pool_cache.head[c] = ptr;
+  pool_cache.count[c]++;
+}
+
+static const hist_allocator_t pool_allocator = {
+  .malloc = pool_malloc,
+  .calloc = pool_calloc,
+  .free = pool_free
+};
+
+const hist_allocator_t *
+hist_pool_allocator(void) {
+  return &pool_allocator;
+}
+
+void
+hist_pool_flush(void) {
+  pool_cache_flush(&pool_cache);
+}
+
+/* Arena allocator
+ *
+ * Allocations are carved out of a list of chunks and never freed one by
+ * one.  A reset rewinds to the first chunk and keeps every chunk for reuse,
+ * so dropping any number of scratch histograms costs O(1).  hist_allocator_t
+ * has no room for a context, so the allocator works on whichever arena the
+ * calling thread entered last.
+ */
+#define ARENA_ALIGN 16
+#define ARENA_DEFAULT_CHUNK (64 * 1024)
+
+struct arena_chunk {
+  struct arena_chunk *next;
+  size_t size;
+  uint8_t data[];   /* 16 bytes in, as aligned as malloc made the chunk */
+};
+
+struct hist_arena {
+  size_t chunk_size;
+  struct arena_chunk *chunks;
+  struct arena_chunk *current;
+  size_t offset;     //!< used bytes in current
+};
+
+static THREAD_LOCAL hist_arena_t *current_arena;
+
+hist_arena_t *
+hist_arena_alloc(size_t chunk_size) {
+  hist_arena_t *a = calloc(1, sizeof(*a));
+  if(!a) return NULL;
+  a->chunk_size = chunk_size ? chunk_size : ARENA_DEFAULT_CHUNK;
+  return a;
+}
+
+void
+hist_arena_free(hist_arena_t *a) {
+  struct arena_chunk *c, *next;
+  if(!a) return;
+  if(current_arena == a) current_arena = NULL;
+  for(c=a->chunks; c; c=next) {
+    next = c->next;
+    free(c);
+  }
+  free(a);
+}
+
+void
+hist_arena_reset(hist_arena_t *a) {
+  a->current = a->chunks;
+  a->offset = 0;
+}
+
+hist_arena_t *
+hist_arena_enter(hist_arena_t *a) {
+  hist_arena_t *prev = current_arena;
+  current_arena = a;
+  return prev;
+}
+
+static void *
+arena_malloc(size_t size) {
+  hist_arena_t *a = current_arena;
+  struct arena_chunk *c;
+  void *ptr;
+  if(!a) return NULL;
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  c = a->current;
+  while(c && a->offset + size > c->size) {
+    /* move on to a chunk kept from before the last reset */
+    c = a->current = c->next;
+    a->offset = 0;
+  }
+  if(!c) {
+    size_t csize = size > a->chunk_size ? size : a->chunk_size;
+    struct arena_chunk **tail = &a->chunks;
+    c = malloc(sizeof(*c) + csize);
+    if(!c) return NULL;
+    c->next = NULL;
+    c->size = csize;
+    while(*tail) tail = &(*tail)->next;
+    *tail = c;
+    a->current = c;
+    a->offset = 0;
+  }
+  ptr = c->data + a->offset;
+  a->offset += size;
+  return ptr;
+}
+
+static void *
+arena_calloc(size_t nmemb, size_t size) {
+  void *ptr;
+  if(size && nmemb > ~(size_t)0 / size) return NULL;
+  ptr = arena_malloc(nmemb * size);
+  if(ptr) memset(ptr, 0, nmemb * size);
+  return ptr;
+}
+
+static void
+arena_free(void *ptr) {
+  (void)ptr; /* reclaimed by hist_arena_reset */
+}
+
+static const hist_allocator_t arena_allocator = {
+  .malloc = arena_malloc,
+  .calloc = arena_calloc,
+  .free = arena_free
+};
+
+const hist_allocator_t *
+hist_arena_allocator(void) {
+  return &arena_allocator;
+}
+
+/* Query contexts
+ *
+ * An arena plus the arena the thread was using before the query began, so
+ * queries can run inside other arena users.
+ */
+struct hist_query {
+  hist_arena_t *arena;
+  hist_arena_t *prev;
+};
+
+hist_query_t *
+hist_query_alloc(size_t chunk_size) {
+  hist_query_t *q = calloc(1, sizeof(*q));
+  if(!q) return NULL;
+  q->arena = hist_arena_alloc(chunk_size);
+  if(!q->arena) {
+    free(q);
+    return NULL;
+  }
+  return q;
+}
+
+void
+hist_query_free(hist_query_t *q) {
+  if(!q) return;
+  if(current_arena == q->arena) current_arena = q->prev;
+  hist_arena_free(q->arena);
+  free(q);
+}
+
+void
+hist_query_begin(hist_query_t *q) {
+  q->prev = hist_arena_enter(q->arena);
+}
+
+void
+hist_query_end(hist_query_t *q) {
+  hist_arena_reset(q->arena);
+  if(current_arena == q->arena) current_arena = q->prev;
+  q->prev = NULL;
+}
+
+const hist_allocator_t *
+hist_query_allocator(void) {
+  return &arena_allocator;
+}
+
+/* The helpers only run between hist_query_begin and hist_query_end on the
+ * calling thread: the histograms they return keep allocating from whichever
+ * arena that thread has entered, so outside the query they could not grow. */
+static inline int
+query_active(const hist_query_t *q) {
+  return q && current_arena == q->arena;
+}
+
+histogram_t *
+hist_query_hist(hist_query_t *q) {
+  if(!query_active(q)) return NULL;
+  return hist_alloc_with_allocator(&arena_allocator);
+}
+
+histogram_t *
+hist_query_clone(hist_query_t *q, const histogram_t *other) {
+  if(!query_active(q)) return NULL;
+  return hist_clone_with_allocator(other, &arena_allocator);
+}
+
+histogram_t *
+hist_query_compress_mbe(hist_query_t *q, const histogram_t *hist, int8_t mbe) {
+  if(!query_active(q)) return NULL;
+  return hist_compress_mbe_with_allocator(hist, mbe, &arena_allocator);
+}
+
+histogram_t *
+hist_query_merge(hist_query_t *q, const histogram_t * const *src, int cnt) {
+  histogram_t *h;
+  int i, weighted = 0;
+  if(!query_active(q)) return NULL;
+  for(i=0;i<cnt;i++) if(src[i] && hist_is_weighted(src[i])) weighted = 1;
+  h = weighted ? hist_alloc_weighted_with_allocator(&arena_allocator)
+               : hist_alloc_with_allocator(&arena_allocator);
+  if(h && hist_accumulate(h, src, cnt) < 0) h = NULL;
+  return h;
+}
@@ -0,0 +1,347 @@
+/*
+ * Copyright (c) 2016-2021, Circonus, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#if !defined(WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "circllhist.h"
+
+/* Archive layout, all integers big-endian:
+ *
+ *   header   magic "CLHA" | version u16 | reserved u16 | count u64 |
+ *            index offset u64 | reserved u64
+ *   data     hist_serialize records, back to back
+ *   index    count entries of series u64 | timestamp i64 | offset u64 | length u32
+ *            sorted by (series, timestamp)
+ */
+#define ARCHIVE_MAGIC "CLHA"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_HEADER_SIZE 32
+#define ARCHIVE_ENTRY_SIZE 28
+
+struct archive_entry {
+  uint64_t series;
+  int64_t timestamp;
+  uint64_t offset;
+  uint32_t length;
+};
+
+struct hist_archive_writer {
+  FILE *fp;
+  uint64_t offset;
+  struct archive_entry *entries;
+  uint64_t used, allocd;
+  uint8_t *buff;
+  ssize_t buff_len;
+  int failed;       /* a write went wrong, offsets no longer match the file */
+};
+
+struct hist_archive {
+  const uint8_t *base;
+  uint64_t size;
+  uint64_t count;
+  const uint8_t *index;
+#if defined(WIN32)
+  uint8_t *copy;
+#endif
+};
+
+static inline void
+put_u64(uint8_t *cp, uint64_t v) {
+  int i;
+  for(i=7;i>=0;i--) { cp[i] = v & 0xff; v >>= 8; }
+}
+static inline void
+put_u32(uint8_t *cp, uint32_t v) {
+  int i;
+  for(i=3;i>=0;i--) { cp[i] = v & 0xff; v >>= 8; }
+}
+static inline uint64_t
+get_u64(const uint8_t *cp) {
+  uint64_t v = 0;
+  int i;
+  for(i=0;i<8;i++) v = (v << 8) | cp[i];
+  return v;
+}
+static inline uint32_t
+get_u32(const uint8_t *cp) {
+  uint32_t v = 0;
+  int i;
+  for(i=0;i<4;i++) v = (v << 8) | cp[i];
+  return v;
+}
+
+static void
+write_header(uint8_t *cp, uint64_t count, uint64_t index_offset) {
+  memset(cp, 0, ARCHIVE_HEADER_SIZE);
+  memcpy(cp, ARCHIVE_MAGIC, 4);
+  cp[4] = ARCHIVE_VERSION >> 8;
+  cp[5] = ARCHIVE_VERSION & 0xff;
+  put_u64(cp + 8, count);
+  put_u64(cp + 16, index_offset);
+}
+
+hist_archive_writer_t *
+hist_archive_writer_open(const char *path) {
+  uint8_t header[ARCHIVE_HEADER_SIZE];
+  hist_archive_writer_t *w = calloc(1, sizeof(*w));
+  if(!w) return NULL;
+  w->fp = fopen(path, "wb");
+  if(!w->fp) goto bail;
+  /* placeholder, rewritten on close once the index location is known */
+  write_header(header, 0, 0);
+  if(fwrite(header, sizeof(header), 1, w->fp) != 1) goto bail;
+  w->offset = ARCHIVE_HEADER_SIZE;
+  return w;
+
+ bail:
+  if(w->fp) fclose(w->fp);
+  free(w);
+  return NULL;
+}
+
+int
+hist_archive_writer_add(hist_archive_writer_t *w, uint64_t series, int64_t timestamp,
+                        const histogram_t *h) {
+  ssize_t len;
+  if(w->failed) return -1;
+  len = hist_serialize_estimate(h);
+  if(len > w->buff_len) {
+    uint8_t *newbuff = realloc(w->buff, len);
+    if(!newbuff) return -1;
+    w->buff = newbuff;
+    w->buff_len = len;
+  }
+  len = hist_serialize(h, w->buff, w->buff_len);
+  if(len < 0) return -1;
+  if(w->used == w->allocd) {
+    uint64_t newallocd = w->allocd ? w->allocd * 2 : 1024;
+    struct archive_entry *newentries = realloc(w->entries, newallocd * sizeof(*newentries));
+    if(!newentries) return -1;
+    w->entries = newentries;
+    w->allocd = newallocd;
+  }
+  if(fwrite(w->buff, len, 1, w->fp) != 1) {
+    /* part of the record may be in the file already */
+    w->failed = 1;
+    return -1;
+  }
+  w->entries[w->used].series = series;
+  w->entries[w->used].timestamp = timestamp;
+  w->entries[w->used].offset = w->offset;
+  w->entries[w->used].length = len;
+  w->used++;
+  w->offset += len;
+  return 0;
+}
+
+static int
+archive_entry_cmp(const void *av, const void *bv) {
+  const struct archive_entry *a = av, *b = bv;
+  if(a->series != b->series) return (a->series < b->series) ? -1 : 1;
+  if(a->timestamp != b->timestamp) return (a->timestamp < b->timestamp) ? -1 : 1;
+  /* keep duplicates in insertion order */
+  if(a->offset != b->offset) return (a->offset < b->offset) ? -1 : 1;
+  return 0;
+}
+
+int
+hist_archive_writer_close(hist_archive_writer_t *w) {
+  uint8_t header[ARCHIVE_HEADER_SIZE], entry[ARCHIVE_ENTRY_SIZE];
+  uint64_t i;
+  int rv = 0;
+  if(!w) return -1;
+  /* never put a valid header on a file with a broken record */
+  if(w->failed) rv = -1;
+  else qsort(w->entries, w->used, sizeof(*w->entries), archive_entry_cmp);
+  for(i=0;rv == 0 && i<w->used;i++) {
+    put_u64(entry, w->entries[i].series);
+    put_u64(entry + 8, (uint64_t)w->entries[i].timestamp);
+    put_u64(entry + 16, w->entries[i].offset);
+    put_u32(entry + 24, w->entries[i].length);
+    if(fwrite(entry, sizeof(entry), 1, w->fp) != 1) { rv = -1; break; }
+  }
+  if(rv == 0) {
+    write_header(header, w->used, w->offset);
+    if(fseek(w->fp, 0, SEEK_SET) != 0 ||
+       fwrite(header, sizeof(header), 1, w->fp) != 1) rv = -1;
+  }
+  if(fclose(w->fp) != 0) rv = -1;
+  free(w->entries);
+  free(w->buff);
+  free(w);
+  return rv;
+}
+
+static int
+archive_map(hist_archive_t *a, const char *path) {
+#if defined(WIN32)
+  FILE *fp = fopen(path, "rb");
+  long size;
+  if(!fp) return -1;
+  if(fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 0 ||
+     fseek(fp, 0, SEEK_SET) != 0) { fclose(fp); return -1; }
+  a->copy = malloc(size ? size : 1);
+  if(!a->copy || (size && fread(a->copy, size, 1, fp) != 1)) { fclose(fp); return -1; }
+  fclose(fp);
+  a->base = a->copy;
+  a->size = size;
+  return 0;
+#else
+  struct stat sb;
+  void *base;
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) return -1;
+  if(fstat(fd, &sb) != 0 || sb.st_size < ARCHIVE_HEADER_SIZE) { close(fd); return -1; }
+  base = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(base == MAP_FAILED) return -1;
+  a->base = base;
+  a->size = sb.st_size;
+  return 0;
+#endif
+}
+
+void
+hist_archive_close(hist_archive_t *a) {
+  if(!a) return;
+#if defined(WIN32)
+  free(a->copy);
+#else
+  if(a->base) munmap((void *)a->base, a->size);
+#endif
+  free(a);
+}
+
+hist_archive_t *
+hist_archive_open(const char *path) {
+  uint64_t index_offset;
+  hist_archive_t *a = calloc(1, sizeof(*a));
+  if(!a) return NULL;
+  if(archive_map(a, path) != 0) goto bail;
+  if(a->size < ARCHIVE_HEADER_SIZE) goto bail;
+  if(memcmp(a->base, ARCHIVE_MAGIC, 4)) goto bail;
+  if(((a->base[4] << 8) | a->base[5]) != ARCHIVE_VERSION) goto bail;
+  a->count = get_u64(a->base + 8);
+  index_offset = get_u64(a->base + 16);
+  if(index_offset < ARCHIVE_HEADER_SIZE || index_offset > a->size) goto bail;
+  if(a->count > (a->size - index_offset) / ARCHIVE_ENTRY_SIZE) goto bail;
+  a->index = a->base + index_offset;
+  return a;
+
+ bail:
+  hist_archive_close(a);
+  return NULL;
+}
+
+uint64_t
+hist_archive_count(const hist_archive_t *a) {
+  return a->count;
+}
+
+static inline int
+archive_key_cmp(const uint8_t *entry, uint64_t series, int64_t timestamp) {
+  uint64_t eseries = get_u64(entry);
+  int64_t etimestamp = (int64_t)get_u64(entry + 8);
+  if(eseries != series) return (eseries < series) ? -1 : 1;
+  if(etimestamp != timestamp) return (etimestamp < timestamp) ? -1 : 1;
+  return 0;
+}
+
+uint64_t
+hist_archive_lower_bound(const hist_archive_t *a, uint64_t series, int64_t timestamp) {
+  uint64_t l = 0, r = a->count;
+  while(l < r) {
+    uint64_t check = l + (r - l) / 2;
+    if(archive_key_cmp(a->index + check * ARCHIVE_ENTRY_SIZE, series, timestamp) < 0)
+      l = check + 1;
+    else
+      r = check;
+  }
+  return l;
+}
+
+int
+hist_archive_entry(const hist_archive_t *a, uint64_t idx,
+                   uint64_t *series, int64_t *timestamp,
+                   const void **data, ssize_t *len) {
+  const uint8_t *entry;
+  uint64_t offset;
+  uint32_t length;
+  if(idx >= a->count) return -1;
+  entry = a->index + idx * ARCHIVE_ENTRY_SIZE;
+  offset = get_u64(entry + 16);
+  length = get_u32(entry + 24);
+  /* records must live between the header and the index */
+  if(offset < ARCHIVE_HEADER_SIZE || offset > (uint64_t)(a->index - a->base) ||
+     length > (uint64_t)(a->index - a->base) - offset) return -1;
+  if(series) *series = get_u64(entry);
+  if(timestamp) *timestamp = (int64_t)get_u64(entry + 8);
+  if(data) *data = a->base + offset;
+  if(len) *len = length;
+  return 0;
+}
+
+int
+hist_archive_lookup(const hist_archive_t *a, uint64_t series, int64_t timestamp,
+                    histogram_t *out) {
+  const void *data;
+  ssize_t len;
+  uint64_t idx = hist_archive_lower_bound(a, series, timestamp);
+  if(idx >= a->count ||
+     archive_key_cmp(a->index + idx * ARCHIVE_ENTRY_SIZE, series, timestamp) != 0)
+    return -1;
+  if(hist_archive_entry(a, idx, NULL, NULL, &data, &len) != 0) return -1;
+  return (hist_deserialize(out, data, len) == len) ? 0 : -1;
+}
+
+int64_t
+hist_archive_merge_range(const hist_archive_t *a, uint64_t series,
+                         int64_t start, int64_t end, histogram_t *tgt) {
+  const void *data;
+  ssize_t len;
+  int64_t merged = 0;
+  uint64_t idx = hist_archive_lower_bound(a, series, start);
+  /* Records go into a scratch histogram first, so a corrupt record in the
+   * middle of the range leaves tgt untouched. */
+  histogram_t *scratch = hist_is_weighted(tgt) ? hist_fast_alloc_weighted()
+                                               : hist_fast_alloc();
+  const histogram_t *src[1];
+  if(!scratch) return -1;
+  for(; idx < a->count; idx++) {
+    if(archive_key_cmp(a->index + idx * ARCHIVE_ENTRY_SIZE, series, end) >= 0) break;
+    if(hist_archive_entry(a, idx, NULL, NULL, &data, &len) != 0 ||
+       hist_accumulate_serialized(scratch, data, len) != len) {
+      hist_free(scratch);
+      return -1;
+    }
+    merged++;
+  }
+  src[0] = scratch;
+  if(merged && hist_accumulate(tgt, src, 1) < 0) merged = -1;
+  hist_free(scratch);
+  return merged;
+}
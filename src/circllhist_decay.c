@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2016-2021, Circonus, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <math.h>
+#include <sys/types.h>
+
+#include "circllhist.h"
+
+/* Forward decay: rather than shrinking every bin as time passes, a sample at
+ * time t is stored with weight 2^((t - epoch) / halflife), and reads divide
+ * by the weight of "now".  Inserts stay O(1) and never touch other bins.
+ *
+ * Weights are kept as fixed point (FRAC_BITS fractional bits) in the counts
+ * of an ordinary histogram.  Once new weights exceed 2^RENORM_HALFLIVES the
+ * epoch moves forward and all bins are scaled down once, which bounds the
+ * stored values: each bin can absorb about 2^(64 - FRAC_BITS -
+ * RENORM_HALFLIVES) samples before it saturates.
+ */
+#define FRAC_BITS 16
+#define RENORM_HALFLIVES 8
+
+struct hist_decay {
+  double halflife;
+  int started;
+  uint64_t epoch;
+  uint64_t last_t;    //!< time the cached weight belongs to
+  double last_weight; //!< 2^((last_t - epoch) / halflife) * 2^FRAC_BITS
+  histogram_t *hist;
+};
+
+hist_decay_t *
+hist_decay_alloc(uint64_t halflife) {
+  hist_decay_t *d;
+  if(halflife == 0) return NULL;
+  d = calloc(1, sizeof(*d));
+  if(!d) return NULL;
+  d->halflife = (double)halflife;
+  if((d->hist = hist_fast_alloc()) == NULL) {
+    free(d);
+    return NULL;
+  }
+  return d;
+}
+
+void
+hist_decay_free(hist_decay_t *d) {
+  if(!d) return;
+  hist_free(d->hist);
+  free(d);
+}
+
+static inline double
+decay_exponent(const hist_decay_t *d, uint64_t t) {
+  return (t >= d->epoch) ? (double)(t - d->epoch) / d->halflife
+                         : -(double)(d->epoch - t) / d->halflife;
+}
+
+/* Move the epoch to t, scaling all stored weights down accordingly */
+static int
+decay_renormalize(hist_decay_t *d, uint64_t t) {
+  double scale = exp2(-decay_exponent(d, t));
+  histogram_t *renormed = hist_fast_alloc_nbins(hist_bucket_count(d->hist));
+  int i;
+  if(!renormed) return -1;
+  for(i=0;i<hist_bucket_count(d->hist);i++) {
+    hist_bucket_t hb;
+    uint64_t c;
+    double scaled;
+    hist_bucket_idx_bucket(d->hist, i, &hb, &c);
+    scaled = floor((double)c * scale + 0.5);
+    /* weights that decayed below the fixed point resolution are gone */
+    if(scaled >= 1) hist_insert_raw_end(renormed, hb, (uint64_t)scaled);
+  }
+  hist_free(d->hist);
+  d->hist = renormed;
+  d->epoch = t;
+  d->last_t = t;
+  d->last_weight = (double)(1 << FRAC_BITS);
+  return 0;
+}
+
+static inline double
+decay_weight(hist_decay_t *d, uint64_t t) {
+  if(!d->started) {
+    d->started = 1;
+    d->epoch = d->last_t = t;
+    d->last_weight = (double)(1 << FRAC_BITS);
+  }
+  if(t != d->last_t) {
+    if(decay_exponent(d, t) > RENORM_HALFLIVES && decay_renormalize(d, t) == 0)
+      return d->last_weight;
+    d->last_t = t;
+    d->last_weight = exp2(decay_exponent(d, t) + FRAC_BITS);
+  }
+  return d->last_weight;
+}
+
+uint64_t
+hist_decay_insert_raw(hist_decay_t *d, uint64_t t, hist_bucket_t hb, uint64_t count) {
+  double w = (double)count * decay_weight(d, t);
+  uint64_t stored;
+  if(w < 0.5) return 0;
+  stored = (w >= 18446744073709551615.0) ? ~(uint64_t)0 : (uint64_t)(w + 0.5);
+  return hist_insert_raw(d->hist, hb, stored) ? count : 0;
+}
+
+uint64_t
+hist_decay_insert(hist_decay_t *d, uint64_t t, double val, uint64_t count) {
+  return hist_decay_insert_raw(d, t, double_to_hist_bucket(val), count);
+}
+
+uint64_t
+hist_decay_insert_intscale(hist_decay_t *d, uint64_t t, int64_t val, int scale,
+                           uint64_t count) {
+  return hist_decay_insert_raw(d, t, int_scale_to_hist_bucket(val, scale), count);
+}
+
+/* Divide stored weights by this to get decayed counts as of now */
+static inline double
+decay_divisor(const hist_decay_t *d, uint64_t now) {
+  return exp2(decay_exponent(d, now) + FRAC_BITS);
+}
+
+double
+hist_decay_sample_count(const hist_decay_t *d, uint64_t now) {
+  if(!d->started) return 0;
+  return (double)hist_sample_count(d->hist) / decay_divisor(d, now);
+}
+
+int
+hist_decay_snapshot(const hist_decay_t *d, uint64_t now, uint64_t multiplier,
+                    histogram_t *out) {
+  int i, n = 0;
+  double divisor;
+  if(!d->started) return 0;
+  if(multiplier == 0) multiplier = 1;
+  divisor = decay_divisor(d, now) / (double)multiplier;
+  for(i=0;i<hist_bucket_count(d->hist);i++) {
+    hist_bucket_t hb;
+    uint64_t c;
+    double decayed;
+    hist_bucket_idx_bucket(d->hist, i, &hb, &c);
+    decayed = floor((double)c / divisor + 0.5);
+    if(decayed < 1) continue;
+    hist_insert_raw(out, hb, (decayed >= 18446744073709551615.0) ?
+                               ~(uint64_t)0 : (uint64_t)decayed);
+    n++;
+  }
+  return n;
+}
@@ -33,6 +33,7 @@ void help(const char *prog) {
   printf("\t-p <0-100>\tcompute approximate percentile\n");
   printf("\t-i <val>\tcompute approximate inverse quantile at <val>\n");
   printf("\t-C\t\tcalculate difference between cumulative histograms\n");
+  printf("\t-A <file>\tread histograms from an archive file\n");
   printf("\t[hist1 [hist2 [...]]]\n\n");
   printf("If no hists are specified, stdin is read\n");
   printf("\n\nExample:\n\n");
@@ -122,8 +123,9 @@ static int double_compare(const void *lv, const void *rv) {
 int main(int argc, char **argv) {
   double percent;
   char buff[256*1024];
+  const char *archive = NULL;
   int opt;
-  while((opt = getopt(argc, argv, "ha:b:p:i:C")) != -1) {
+  while((opt = getopt(argc, argv, "ha:b:p:i:CA:")) != -1) {
     switch(opt) {
     case 'a':
       add_to(&above, atof(optarg));
@@ -145,6 +147,9 @@ int main(int argc, char **argv) {
     case 'C':
       cumulative = true;
       break;
+    case 'A':
+      archive = optarg;
+      break;
     case 'h':
       help(argv[0]);
       exit(0);
@@ -158,7 +163,29 @@ int main(int argc, char **argv) {
   if(quantiles.cnt) qsort(quantiles.elements, quantiles.cnt, sizeof(double), double_compare);
 
   histogram_t *last = NULL;
-  if(optind < argc) {
+  if(archive) {
+    hist_archive_t *a = hist_archive_open(archive);
+    if(!a) {
+      fprintf(stderr, "archive invalid\n");
+      exit(-1);
+    }
+    for(uint64_t i=0; i<hist_archive_count(a); i++) {
+      const void *data;
+      ssize_t len;
+      histogram_t *hist = hist_alloc();
+      if(hist_archive_entry(a, i, NULL, NULL, &data, &len) != 0 ||
+         hist_deserialize(hist, data, len) != len) {
+        fprintf(stderr, "histogram invalid\n");
+        hist_free(hist);
+        continue;
+      }
+      histogram_t *toprint = calc_cum(last, hist, cumulative);
+      if(toprint) print(toprint);
+      if(last) hist_free(last);
+      last = hist;
+    }
+    hist_archive_close(a);
+  } else if(optind < argc) {
     for(int i=optind; i<argc; i++) {
       if(strlen(argv[i]) > sizeof(buff)-1) {
         fprintf(stderr, "histogram too large\n");
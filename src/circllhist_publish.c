@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2016-2021, Circonus, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include "circllhist.h"
+
+/* One writer publishes frozen copies (hist_clone, so publishing costs O(1)
+ * until the writer's next change) through an atomic pointer; readers pin
+ * the current one and may keep using it until they release it.
+ *
+ * Epochs decide when a replaced copy can go: a reader announces the global
+ * epoch in its slot before loading the pointer, and publishing swaps the
+ * pointer before advancing the epoch.  So a copy retired at epoch e can only
+ * be held by readers that announced e or earlier, and is freed once every
+ * busy slot shows a later epoch.  Epoch 0 means idle.
+ *
+ * Readers claim a slot by flipping its claimed flag with a CAS and give it
+ * back on unregister, so threads may come and go.
+ */
+#define CACHELINE 64
+#define MAX_READERS 4096
+
+struct reader_slot {
+  uint64_t epoch;
+  uint32_t claimed;
+  char pad[CACHELINE - sizeof(uint64_t) - sizeof(uint32_t)];
+};
+
+struct retired {
+  histogram_t *h;
+  uint64_t epoch;
+  struct retired *next;
+};
+
+struct hist_publisher {
+  histogram_t *current;
+  uint64_t epoch;
+  uint32_t nslots;
+  struct retired *retired;  //!< writer only, newest first
+  struct reader_slot *slots;
+};
+
+hist_publisher_t *
+hist_publisher_alloc(int max_readers) {
+  hist_publisher_t *p;
+  if(max_readers < 1 || max_readers > MAX_READERS) return NULL;
+  p = calloc(1, sizeof(*p));
+  if(!p) return NULL;
+  p->slots = calloc(max_readers, sizeof(*p->slots));
+  p->current = hist_alloc();
+  if(!p->slots || !p->current) {
+    hist_free(p->current);
+    free(p->slots);
+    free(p);
+    return NULL;
+  }
+  p->nslots = max_readers;
+  p->epoch = 1;
+  return p;
+}
+
+void
+hist_publisher_free(hist_publisher_t *p) {
+  struct retired *r, *next;
+  if(!p) return;
+  for(r=p->retired; r; r=next) {
+    next = r->next;
+    hist_free(r->h);
+    free(r);
+  }
+  hist_free(p->current);
+  free(p->slots);
+  free(p);
+}
+
+int
+hist_publisher_register(hist_publisher_t *p) {
+  uint32_t i;
+  for(i=0;i<p->nslots;i++) {
+    uint32_t idle = 0;
+    if(__atomic_load_n(&p->slots[i].claimed, __ATOMIC_RELAXED) == 0 &&
+       __atomic_compare_exchange_n(&p->slots[i].claimed, &idle, 1, 0,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      return (int)i;
+  }
+  return -1;
+}
+
+void
+hist_publisher_unregister(hist_publisher_t *p, int slot) {
+  if(slot < 0 || (uint32_t)slot >= p->nslots) return;
+  __atomic_store_n(&p->slots[slot].epoch, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&p->slots[slot].claimed, 0, __ATOMIC_RELEASE);
+}
+
+static void
+publisher_reclaim(hist_publisher_t *p) {
+  uint64_t oldest = ~(uint64_t)0;
+  struct retired **rp, *r;
+  uint32_t i;
+  for(i=0;i<p->nslots;i++) {
+    uint64_t e = __atomic_load_n(&p->slots[i].epoch, __ATOMIC_SEQ_CST);
+    if(e && e < oldest) oldest = e;
+  }
+  /* the list is newest first, find the first copy no reader can hold */
+  for(rp=&p->retired; *rp && (*rp)->epoch >= oldest; rp=&(*rp)->next);
+  while((r = *rp) != NULL) {
+    *rp = r->next;
+    hist_free(r->h);
+    free(r);
+  }
+}
+
+int
+hist_publish(hist_publisher_t *p, const histogram_t *h) {
+  struct retired *r = malloc(sizeof(*r));
+  if(!r) return -1;
+  r->h = hist_clone(h);
+  if(!r->h) {
+    free(r);
+    return -1;
+  }
+  r->h = __atomic_exchange_n(&p->current, r->h, __ATOMIC_SEQ_CST);
+  r->epoch = __atomic_fetch_add(&p->epoch, 1, __ATOMIC_SEQ_CST);
+  r->next = p->retired;
+  p->retired = r;
+  publisher_reclaim(p);
+  return 0;
+}
+
+const histogram_t *
+hist_snapshot_acquire(hist_publisher_t *p, int slot) {
+  uint64_t e = __atomic_load_n(&p->epoch, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&p->slots[slot].epoch, e, __ATOMIC_SEQ_CST);
+  return __atomic_load_n(&p->current, __ATOMIC_SEQ_CST);
+}
+
+void
+hist_snapshot_release(hist_publisher_t *p, int slot) {
+  __atomic_store_n(&p->slots[slot].epoch, 0, __ATOMIC_RELEASE);
+}
+
+int
+hist_publisher_retired(const hist_publisher_t *p) {
+  const struct retired *r;
+  int n = 0;
+  for(r=p->retired; r; r=r->next) n++;
+  return n;
+}
@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2016-2021, Circonus, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include "circllhist.h"
+
+/* A bounded queue of raw samples (Vyukov): every slot carries a sequence
+ * number telling whose turn it is.  A slot at position pos is free for the
+ * producer when seq == pos and holds a sample for the consumer when
+ * seq == pos + 1; the consumer hands it back for the next lap with
+ * seq = pos + capacity.  Producers never wait on each other or on the
+ * consumer, a full ring drops the sample and counts it.
+ *
+ * With a single producer the tail is owned by that thread and claiming a
+ * slot is a plain store; several producers claim slots with a CAS.
+ * Samples stay raw until the drain, which does all the bucketing.
+ */
+#define RING_MAX_CAPACITY (1U << 30)
+#define DRAIN_BATCH 1024
+#define CACHELINE 64
+
+enum ring_kind { RING_DOUBLE, RING_INTSCALE };
+
+struct ring_slot {
+  uint64_t seq;
+  union {
+    double d;
+    int64_t i;
+  } v;
+  int32_t scale;
+  int32_t kind;
+};
+
+struct hist_ring {
+  struct ring_slot *slots;
+  uint64_t mask;
+  int multi_producer;
+  char pad0[CACHELINE];
+  uint64_t tail;      //!< next position producers claim
+  char pad1[CACHELINE];
+  uint64_t head;      //!< next position the consumer reads
+  uint64_t dropped;
+  hist_bucket_t batch[DRAIN_BATCH];
+};
+
+hist_ring_t *
+hist_ring_alloc(uint32_t capacity, int multi_producer) {
+  hist_ring_t *r;
+  uint64_t size = 2, i;
+  if(capacity < 2 || capacity > RING_MAX_CAPACITY) return NULL;
+  while(size < capacity) size <<= 1;
+  r = calloc(1, sizeof(*r));
+  if(!r) return NULL;
+  r->slots = calloc(size, sizeof(*r->slots));
+  if(!r->slots) {
+    free(r);
+    return NULL;
+  }
+  for(i=0;i<size;i++) r->slots[i].seq = i;
+  r->mask = size - 1;
+  r->multi_producer = multi_producer;
+  return r;
+}
+
+void
+hist_ring_free(hist_ring_t *r) {
+  if(!r) return;
+  free(r->slots);
+  free(r);
+}
+
+static inline struct ring_slot *
+ring_claim(hist_ring_t *r) {
+  uint64_t pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+  for(;;) {
+    struct ring_slot *slot = &r->slots[pos & r->mask];
+    int64_t dif = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+    if(dif == 0) {
+      if(!r->multi_producer) {
+        __atomic_store_n(&r->tail, pos + 1, __ATOMIC_RELAXED);
+        return slot;
+      }
+      if(__atomic_compare_exchange_n(&r->tail, &pos, pos + 1, 1,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return slot;
+      /* lost the race, pos was reloaded */
+    }
+    else if(dif < 0) {
+      /* the consumer hasn't freed this slot yet: full */
+      __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+      return NULL;
+    }
+    else pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+  }
+}
+
+static inline void
+ring_publish(struct ring_slot *slot) {
+  /* seq was pos when we claimed it, pos + 1 hands it to the consumer */
+  __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+int
+hist_ring_record(hist_ring_t *r, double val) {
+  struct ring_slot *slot = ring_claim(r);
+  if(!slot) return 0;
+  slot->v.d = val;
+  slot->kind = RING_DOUBLE;
+  ring_publish(slot);
+  return 1;
+}
+
+int
+hist_ring_record_intscale(hist_ring_t *r, int64_t val, int scale) {
+  struct ring_slot *slot = ring_claim(r);
+  if(!slot) return 0;
+  slot->v.i = val;
+  slot->scale = scale;
+  slot->kind = RING_INTSCALE;
+  ring_publish(slot);
+  return 1;
+}
+
+uint64_t
+hist_ring_drain(hist_ring_t *r, histogram_t *h, uint64_t max) {
+  uint64_t pos = r->head, drained = 0;
+  if(max == 0) max = ~(uint64_t)0;
+  while(drained < max) {
+    int n = 0;
+    while(n < DRAIN_BATCH && drained + n < max) {
+      struct ring_slot *slot = &r->slots[pos & r->mask];
+      if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1) break;
+      r->batch[n++] = slot->kind == RING_DOUBLE ? double_to_hist_bucket(slot->v.d)
+                                                : int_scale_to_hist_bucket(slot->v.i, slot->scale);
+      __atomic_store_n(&slot->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+      pos++;
+    }
+    if(n == 0) break;
+    __atomic_store_n(&r->head, pos, __ATOMIC_RELAXED);
+    if(hist_insert_raw_batch(h, r->batch, n) != (uint64_t)n) {
+      /* out of memory: the slots are gone already, account for the loss */
+      __atomic_fetch_add(&r->dropped, n, __ATOMIC_RELAXED);
+      break;
+    }
+    drained += n;
+  }
+  return drained;
+}
+
+uint64_t
+hist_ring_pending(const hist_ring_t *r) {
+  uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+  uint64_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+  return tail > head ? tail - head : 0;
+}
+
+uint64_t
+hist_ring_capacity(const hist_ring_t *r) {
+  return r->mask + 1;
+}
+
+uint64_t
+hist_ring_dropped(const hist_ring_t *r) {
+  return __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,276 @@
+/*
+ * Copyright (c) 2016-2021, Circonus, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include "circllhist.h"
+
+#define NO_PERIOD (~(uint64_t)0)
+#define MAX_LEVELS ((int)(sizeof(((hist_rollup_config_t *)0)->levels) / \
+                          sizeof(((hist_rollup_config_t *)0)->levels[0])))
+
+/* Each level is a ring of retain slots, the slot for period p lives at
+ * p % retain and is tagged with p.  Data only ever enters through level 0;
+ * when a period closes at level l its histogram is folded into the slot of
+ * the enclosing period at level l+1.  So a closed, retained period at level
+ * l > 0 has a slot if and only if it saw data, and that slot is complete.
+ */
+struct rollup_level {
+  uint64_t period;
+  uint32_t retain;
+  uint64_t head;      //!< the open period at this level
+  uint64_t *tags;
+  histogram_t **slots;
+};
+
+struct hist_rollup {
+  int nlevels;
+  int started;
+  struct rollup_level levels[8];
+};
+
+struct rollup_bucket {
+  hist_bucket_t hb;
+  uint64_t count;
+};
+
+struct rollup_collect {
+  const histogram_t **hists;
+  int used, allocd;
+};
+
+hist_rollup_t *
+hist_rollup_alloc(const hist_rollup_config_t *config) {
+  int l;
+  uint32_t i;
+  hist_rollup_t *r;
+  if(!config || config->nlevels < 1 || config->nlevels > MAX_LEVELS) return NULL;
+  for(l=0;l<config->nlevels;l++) {
+    const hist_rollup_level_t *lvl = &config->levels[l];
+    if(lvl->period == 0 || lvl->retain == 0) return NULL;
+    if(l > 0 && (lvl->period <= config->levels[l-1].period ||
+                 lvl->period % config->levels[l-1].period)) return NULL;
+  }
+  r = calloc(1, sizeof(*r));
+  if(!r) return NULL;
+  r->nlevels = config->nlevels;
+  for(l=0;l<r->nlevels;l++) {
+    struct rollup_level *lvl = &r->levels[l];
+    lvl->period = config->levels[l].period;
+    lvl->retain = config->levels[l].retain;
+    lvl->tags = malloc(lvl->retain * sizeof(*lvl->tags));
+    lvl->slots = calloc(lvl->retain, sizeof(*lvl->slots));
+    if(!lvl->tags || !lvl->slots) {
+      hist_rollup_free(r);
+      return NULL;
+    }
+    for(i=0;i<lvl->retain;i++) lvl->tags[i] = NO_PERIOD;
+  }
+  return r;
+}
+
+void
+hist_rollup_free(hist_rollup_t *r) {
+  int l;
+  uint32_t i;
+  if(!r) return;
+  for(l=0;l<r->nlevels;l++) {
+    struct rollup_level *lvl = &r->levels[l];
+    if(lvl->slots)
+      for(i=0;i<lvl->retain;i++) hist_free(lvl->slots[i]);
+    free(lvl->slots);
+    free(lvl->tags);
+  }
+  free(r);
+}
+
+static inline int
+rollup_retained(const struct rollup_level *lvl, uint64_t p) {
+  return p <= lvl->head && lvl->head - p < lvl->retain;
+}
+
+/* The slot for period p, evicting whatever older period it held before.
+ * NULL if p is no longer retained (or we're out of memory). */
+static histogram_t *
+rollup_slot(struct rollup_level *lvl, uint64_t p, int create) {
+  uint32_t idx = p % lvl->retain;
+  if(!rollup_retained(lvl, p)) return NULL;
+  if(lvl->tags[idx] == p) return lvl->slots[idx];
+  if(!create) return NULL;
+  if(lvl->slots[idx] == NULL) {
+    if((lvl->slots[idx] = hist_alloc()) == NULL) return NULL;
+  }
+  else hist_clear(lvl->slots[idx]);
+  lvl->tags[idx] = p;
+  return lvl->slots[idx];
+}
+
+int
+hist_rollup_advance(hist_rollup_t *r, uint64_t now) {
+  int l, closed = 0;
+  if(!r->started) {
+    for(l=0;l<r->nlevels;l++) r->levels[l].head = now / r->levels[l].period;
+    r->started = 1;
+    return 0;
+  }
+  /* Bottom up, so a level folds upward whatever it just received from below.
+   * Periods nest, so once a level's head stays put the coarser ones do too. */
+  for(l=0;l<r->nlevels;l++) {
+    struct rollup_level *lvl = &r->levels[l];
+    uint64_t newhead = now / lvl->period;
+    histogram_t *closing;
+    if(newhead <= lvl->head) break;
+    /* inserts never run ahead of the head, only the open period has data
+     * that still needs folding */
+    closing = rollup_slot(lvl, lvl->head, 0);
+    if(closing && l + 1 < r->nlevels && hist_bucket_count(closing) > 0) {
+      struct rollup_level *up = &r->levels[l+1];
+      histogram_t *parent = rollup_slot(up, lvl->head * lvl->period / up->period, 1);
+      if(parent) hist_accumulate(parent, (const histogram_t * const *)&closing, 1);
+    }
+    lvl->head = newhead;
+    closed++;
+  }
+  return closed;
+}
+
+/* Data for t goes into level 0 and into every coarser level whose child
+ * period containing t has already been folded. */
+static int
+rollup_apply(hist_rollup_t *r, uint64_t t,
+             int (*apply)(histogram_t *, const void *), const void *closure) {
+  int l, applied = 0;
+  hist_rollup_advance(r, t);
+  for(l=0;l<r->nlevels;l++) {
+    struct rollup_level *lvl = &r->levels[l];
+    histogram_t *slot;
+    if(l > 0) {
+      const struct rollup_level *down = &r->levels[l-1];
+      if(t / down->period >= down->head) break; /* still open below */
+    }
+    slot = rollup_slot(lvl, t / lvl->period, 1);
+    if(slot) {
+      if(apply(slot, closure) < 0) return -1;
+      applied++;
+    }
+  }
+  return applied;
+}
+
+static int
+apply_bucket(histogram_t *slot, const void *closure) {
+  const struct rollup_bucket *bc = closure;
+  hist_insert_raw(slot, bc->hb, bc->count);
+  return 0;
+}
+
+static int
+apply_hist(histogram_t *slot, const void *closure) {
+  return hist_accumulate(slot, (const histogram_t * const *)&closure, 1) < 0 ? -1 : 0;
+}
+
+int
+hist_rollup_insert_raw(hist_rollup_t *r, uint64_t t, hist_bucket_t hb, uint64_t count) {
+  struct rollup_bucket bc = { hb, count };
+  return rollup_apply(r, t, apply_bucket, &bc);
+}
+
+int
+hist_rollup_insert(hist_rollup_t *r, uint64_t t, double val, uint64_t count) {
+  return hist_rollup_insert_raw(r, t, double_to_hist_bucket(val), count);
+}
+
+int
+hist_rollup_insert_intscale(hist_rollup_t *r, uint64_t t, int64_t val, int scale,
+                            uint64_t count) {
+  return hist_rollup_insert_raw(r, t, int_scale_to_hist_bucket(val, scale), count);
+}
+
+int
+hist_rollup_accumulate(hist_rollup_t *r, uint64_t t, const histogram_t *h) {
+  return rollup_apply(r, t, apply_hist, h);
+}
+
+static int
+collect(struct rollup_collect *c, const histogram_t *h) {
+  if(c->used == c->allocd) {
+    int newallocd = c->allocd ? c->allocd * 2 : 64;
+    const histogram_t **newhists = realloc(c->hists, newallocd * sizeof(*newhists));
+    if(!newhists) return -1;
+    c->hists = newhists;
+    c->allocd = newallocd;
+  }
+  c->hists[c->used++] = h;
+  return 0;
+}
+
+static inline uint64_t
+rollup_oldest(const struct rollup_level *lvl) {
+  return lvl->head >= lvl->retain - 1 ? lvl->head - (lvl->retain - 1) : 0;
+}
+
+/* Cover [start, end) with the coarsest complete periods available at level
+ * l or below.  Level 0 contributes every retained period starting in the
+ * range, including the open one. */
+static int
+rollup_cover(const hist_rollup_t *r, int l, uint64_t start, uint64_t end,
+             struct rollup_collect *c) {
+  struct rollup_level *lvl = (struct rollup_level *)&r->levels[l];
+  uint64_t p, earliest = NO_PERIOD, latest;
+  int k;
+  /* nothing before what this level or a finer one still retains, nothing
+   * after the open period; this keeps the walk proportional to retention */
+  for(k=0;k<=l;k++) {
+    uint64_t t = rollup_oldest(&r->levels[k]) * r->levels[k].period;
+    if(t < earliest) earliest = t;
+  }
+  latest = (r->levels[0].head + 1) * r->levels[0].period;
+  if(start < earliest) start = earliest;
+  if(end > latest) end = latest;
+  if(start >= end) return 0;
+
+  if(l == 0) {
+    for(p=start/lvl->period + (start % lvl->period != 0);p<=(end-1)/lvl->period;p++) {
+      const histogram_t *slot = rollup_slot(lvl, p, 0);
+      if(slot && collect(c, slot) < 0) return -1;
+    }
+    return 0;
+  }
+  for(p=start/lvl->period;p<=(end-1)/lvl->period;p++) {
+    uint64_t pstart = p * lvl->period, pend = pstart + lvl->period;
+    if(p < lvl->head && rollup_retained(lvl, p) && pstart >= start && pend <= end) {
+      const histogram_t *slot = rollup_slot(lvl, p, 0);
+      if(slot && collect(c, slot) < 0) return -1;
+    }
+    else if(rollup_cover(r, l - 1, pstart < start ? start : pstart,
+                         pend > end ? end : pend, c) < 0) return -1;
+  }
+  return 0;
+}
+
+int
+hist_rollup_query(const hist_rollup_t *r, uint64_t start, uint64_t end, histogram_t *out) {
+  struct rollup_collect c = { NULL, 0, 0 };
+  int rv;
+  if(!r->started || start >= end) return 0;
+  rv = rollup_cover(r, r->nlevels - 1, start, end, &c);
+  if(rv == 0 && c.used > 0)
+    rv = hist_accumulate(out, c.hists, c.used) < 0 ? -1 : 0;
+  if(rv == 0) rv = c.used;
+  free(c.hists);
+  return rv;
+}
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2016-2021, Circonus, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include "circllhist.h"
+
+/* The slice for period p lives at slices[p % nslices].  Periods
+ * head - nslices + 1 .. head are live; everything they hold is also in
+ * aggregate.  Reusing a slot for a new period subtracts the old contents
+ * from the aggregate, so expiry costs O(bins of that slice) and queries
+ * never merge. */
+struct hist_window {
+  int nslices;
+  int started;
+  uint64_t width;
+  uint64_t head;
+  histogram_t **slices;
+  histogram_t *aggregate;
+};
+
+hist_window_t *
+hist_window_alloc(int nslices, uint64_t slice_width) {
+  int i;
+  hist_window_t *w;
+  if(nslices < 1 || slice_width == 0) return NULL;
+  w = calloc(1, sizeof(*w));
+  if(!w) return NULL;
+  w->nslices = nslices;
+  w->width = slice_width;
+  w->slices = calloc(nslices, sizeof(*w->slices));
+  if(!w->slices) goto bail;
+  for(i=0;i<nslices;i++)
+    if((w->slices[i] = hist_alloc()) == NULL) goto bail;
+  /* the aggregate takes every insert, give it O(1) increments */
+  if((w->aggregate = hist_fast_alloc()) == NULL) goto bail;
+  return w;
+
+ bail:
+  hist_window_free(w);
+  return NULL;
+}
+
+void
+hist_window_free(hist_window_t *w) {
+  int i;
+  if(!w) return;
+  if(w->slices)
+    for(i=0;i<w->nslices;i++) hist_free(w->slices[i]);
+  free(w->slices);
+  hist_free(w->aggregate);
+  free(w);
+}
+
+int
+hist_window_advance(hist_window_t *w, uint64_t now) {
+  uint64_t p = now / w->width, q;
+  int expired = 0;
+  if(!w->started) {
+    w->started = 1;
+    w->head = p;
+    return 0;
+  }
+  if(p <= w->head) return 0;
+  if(p - w->head >= (uint64_t)w->nslices) {
+    /* the whole window is gone, no point in subtracting slice by slice */
+    for(q=0;q<(uint64_t)w->nslices;q++) {
+      if(hist_bucket_count(w->slices[q]) == 0) continue;
+      hist_clear(w->slices[q]);
+      expired++;
+    }
+    hist_clear(w->aggregate);
+  }
+  else {
+    for(q=w->head+1;q<=p;q++) {
+      histogram_t *slice = w->slices[q % w->nslices];
+      if(hist_bucket_count(slice) == 0) continue;
+      hist_subtract(w->aggregate, (const histogram_t * const *)&slice, 1);
+      hist_clear(slice);
+      expired++;
+    }
+    if(expired) hist_remove_zeroes(w->aggregate);
+  }
+  w->head = p;
+  return expired;
+}
+
+static histogram_t *
+hist_window_slice(hist_window_t *w, uint64_t t) {
+  uint64_t p = t / w->width;
+  hist_window_advance(w, t);
+  if(p + w->nslices <= w->head) return NULL; /* already expired */
+  return w->slices[p % w->nslices];
+}
+
+static uint64_t
+hist_window_insert_raw(hist_window_t *w, uint64_t t, hist_bucket_t hb, uint64_t count) {
+  histogram_t *slice = hist_window_slice(w, t);
+  if(!slice) return 0;
+  count = hist_insert_raw(slice, hb, count);
+  hist_insert_raw(w->aggregate, hb, count);
+  return count;
+}
+
+uint64_t
+hist_window_insert(hist_window_t *w, uint64_t t, double val, uint64_t count) {
+  return hist_window_insert_raw(w, t, double_to_hist_bucket(val), count);
+}
+
+uint64_t
+hist_window_insert_intscale(hist_window_t *w, uint64_t t, int64_t val, int scale,
+                            uint64_t count) {
+  return hist_window_insert_raw(w, t, int_scale_to_hist_bucket(val, scale), count);
+}
+
+int
+hist_window_accumulate(hist_window_t *w, uint64_t t, const histogram_t *h) {
+  histogram_t *slice = hist_window_slice(w, t);
+  if(!slice) return -1;
+  if(hist_accumulate(slice, &h, 1) < 0) return -1;
+  if(hist_accumulate(w->aggregate, &h, 1) < 0) return -1;
+  return 0;
+}
+
+const histogram_t *
+hist_window_aggregate(const hist_window_t *w) {
+  return w->aggregate;
+}
@@ -19,6 +19,7 @@ else
 fi
 
 cat |\
+  $SED '/FFI_SKIP_BEGIN/,/FFI_SKIP_END/d' |\
   $GREP -v -F '/* FFI_SKIP */' |\
   $GREP -v "^$" |\
   $SED 's|//.*$||' |\
@@ -0,0 +1,286 @@
+from cffi import FFI
+ffi = FFI()
+ffi.cdef("""
+/** \file circllhist.h */
+/*
+ * Copyright (c) 2016-2021, Circonus, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http:
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*! \mainpage A C implementation of Circonus log-linear histograms
+* \ref circllhist.h
+*/
+typedef long int ssize_t;
+typedef struct histogram histogram_t;
+typedef struct hist_rollup_config hist_rollup_config_t;
+typedef struct hist_bucket {
+  int8_t val; 
+  int8_t exp; 
+} hist_bucket_t;
+typedef struct hist_rng {
+  uint64_t s[4];
+} hist_rng_t;
+typedef struct hist_allocator {
+  void *(*malloc)(size_t);
+  void *(*calloc)(size_t, size_t);
+  void (*free)(void *);
+} hist_allocator_t;
+double hist_bucket_to_double(hist_bucket_t hb);
+double hist_bucket_midpoint(hist_bucket_t in);
+double hist_bucket_to_double_bin_width(hist_bucket_t hb);
+hist_bucket_t double_to_hist_bucket(double d);
+hist_bucket_t int_scale_to_hist_bucket(int64_t value, int scale);
+int hist_bucket_to_string(hist_bucket_t hb, char *buf);
+histogram_t * hist_alloc(void);
+/*! Up to 16 bins are kept inline with the histogram itself, so small
+ *  histograms cost a single allocation until they outgrow that. */
+histogram_t * hist_alloc_nbins(int nbins);
+/*! Fast allocations consume 2kb + N * 512b more memory
+ *  where N is the number of used exponents.  It allows for O(1) increments for
+ *  prexisting keys, uses default allocator */
+histogram_t * hist_fast_alloc(void);
+histogram_t * hist_fast_alloc_nbins(int nbins);
+/*! Compact allocations consume a fixed 6.5kb more memory: a bitmap over all
+ *  possible buckets with rank counts.  Finding a bucket or its insert position
+ *  is O(1) without any pointer chasing, uses default allocator */
+histogram_t * hist_compact_alloc(void);
+histogram_t * hist_compact_alloc_nbins(int nbins);
+/*! If other uses the same allocator, the copy shares other's bins and is
+ *  made in O(1); whichever of the two is modified first takes a private
+ *  copy then.  Several threads may clone the same histogram concurrently. */
+histogram_t * hist_clone(const histogram_t *other);
+histogram_t * hist_from_sorted(const hist_bucket_t *buckets, const uint64_t *counts, int n);
+histogram_t * hist_alloc_with_allocator(const hist_allocator_t *alloc);
+histogram_t * hist_alloc_nbins_with_allocator(int nbins, const hist_allocator_t *alloc);
+/*! Fast allocations consume 2kb + N * 512b more memory
+ *  where N is the number of used exponents.  It allows for O(1) increments for
+ *  prexisting keys, uses custom allocator */
+histogram_t * hist_fast_alloc_with_allocator(const hist_allocator_t *alloc);
+histogram_t * hist_fast_alloc_nbins_with_allocator(int nbins, const hist_allocator_t *alloc);
+histogram_t * hist_compact_alloc_with_allocator(const hist_allocator_t *alloc);
+histogram_t * hist_compact_alloc_nbins_with_allocator(int nbins, const hist_allocator_t *alloc);
+histogram_t * hist_clone_with_allocator(const histogram_t *other, const hist_allocator_t *alloc);
+histogram_t * hist_from_sorted_with_allocator(const hist_bucket_t *buckets, const uint64_t *counts, int n, const hist_allocator_t *alloc);
+void hist_free(histogram_t *hist);
+const hist_allocator_t * hist_pool_allocator(void);
+void hist_pool_flush(void);
+typedef struct hist_arena hist_arena_t;
+hist_arena_t * hist_arena_alloc(size_t chunk_size);
+void hist_arena_free(hist_arena_t *a);
+void hist_arena_reset(hist_arena_t *a);
+hist_arena_t * hist_arena_enter(hist_arena_t *a);
+const hist_allocator_t * hist_arena_allocator(void);
+typedef struct hist_query hist_query_t;
+hist_query_t * hist_query_alloc(size_t chunk_size);
+void hist_query_free(hist_query_t *q);
+void hist_query_begin(hist_query_t *q);
+void hist_query_end(hist_query_t *q);
+const hist_allocator_t * hist_query_allocator(void);
+histogram_t * hist_query_hist(hist_query_t *q);
+histogram_t * hist_query_clone(hist_query_t *q, const histogram_t *other);
+histogram_t * hist_query_compress_mbe(hist_query_t *q, const histogram_t *h, int8_t mbe);
+histogram_t * hist_query_merge(hist_query_t *q, const histogram_t * const *src, int cnt);
+/*! Inserting double values converts from IEEE double to a small static integer
+ *  base and can suffer from floating point math skew.  Using the intscale
+ *  variant is more precise and significantly faster if you already have
+ *  integer measurements. */
+uint64_t hist_insert(histogram_t *hist, double val, uint64_t count);
+uint64_t hist_remove(histogram_t *hist, double val, uint64_t count);
+uint64_t hist_remove_raw(histogram_t *hist, hist_bucket_t hb, uint64_t count);
+uint64_t hist_insert_raw(histogram_t *hist, hist_bucket_t hb, uint64_t count);
+uint64_t hist_insert_raw_batch(histogram_t *hist, hist_bucket_t *hb, int n);
+int hist_set_sorted(histogram_t *hist, const hist_bucket_t *buckets, const uint64_t *counts, int n);
+uint64_t hist_insert_raw_end(histogram_t *hist, hist_bucket_t hb, uint64_t count);
+int hist_bucket_count(const histogram_t *hist);
+int hist_num_buckets(const histogram_t *hist);
+uint64_t hist_sample_count(const histogram_t *hist);
+int hist_bucket_idx(const histogram_t *hist, int idx, double *v, uint64_t *c);
+int hist_bucket_idx_bucket(const histogram_t *hist, int idx, hist_bucket_t *b, uint64_t *c);
+int hist_accumulate(histogram_t *tgt, const histogram_t * const *src, int cnt);
+int hist_subtract(histogram_t *tgt, const histogram_t * const *src, int cnt);
+int hist_subtract_as_int64(histogram_t *tgt, const histogram_t *src);
+int hist_add_as_int64(histogram_t *tgt, const histogram_t *src);
+void hist_downsample(histogram_t *tgt, double factor);
+void hist_downsample_with_uniform(histogram_t *tgt, double factor, double (*uniform)(void *closure), void *closure);
+int hist_downsample_deterministic(histogram_t *tgt, double factor);
+void hist_downsample_r(histogram_t *tgt, double factor, hist_rng_t *rng);
+void hist_rng_seed(hist_rng_t *rng, uint64_t seed);
+uint64_t hist_rng_next(hist_rng_t *rng);
+void hist_clear(histogram_t *hist);
+uint64_t hist_insert_intscale(histogram_t *hist, int64_t val, int scale, uint64_t count);
+histogram_t * hist_alloc_weighted(void);
+histogram_t * hist_alloc_weighted_with_allocator(const hist_allocator_t *alloc);
+histogram_t * hist_fast_alloc_weighted(void);
+int hist_is_weighted(const histogram_t *hist);
+double hist_insert_raw_weighted(histogram_t *hist, hist_bucket_t hb, double weight);
+double hist_insert_weighted(histogram_t *hist, double val, double weight);
+double hist_insert_intscale_weighted(histogram_t *hist, int64_t val, int scale, double weight);
+double hist_sample_weight(const histogram_t *hist);
+int hist_bucket_idx_weight(const histogram_t *hist, int idx, hist_bucket_t *b, double *w);
+double hist_approx_weight_below(const histogram_t *hist, double threshold);
+double hist_approx_weight_above(const histogram_t *hist, double threshold);
+ssize_t hist_serialize(const histogram_t *h, void *buff, ssize_t len);
+ssize_t hist_deserialize(histogram_t *h, const void *buff, ssize_t len);
+ssize_t hist_serialize_estimate(const histogram_t *h);
+ssize_t hist_accumulate_serialized(histogram_t *tgt, const void *buff, ssize_t len);
+ssize_t hist_serialize_b64(const histogram_t *h, char *b64_serialized_histo_buff, ssize_t buff_len);
+ssize_t hist_deserialize_b64(histogram_t *h, const void *b64_string, ssize_t b64_string_len);
+ssize_t hist_serialize_b64_estimate(const histogram_t *h);
+ssize_t hist_serialize_b64_batch_layout(const histogram_t * const *h, int cnt, ssize_t *offsets);
+int hist_serialize_b64_batch(const histogram_t * const *h, const ssize_t *offsets, int first, int last, char *arena);
+ssize_t hist_serialize_framed_estimate(const histogram_t *h);
+ssize_t hist_serialize_framed(const histogram_t *h, void *buff, ssize_t len);
+ssize_t hist_framed_validate(const void *buff, ssize_t len);
+ssize_t hist_deserialize_framed(histogram_t *h, const void *buff, ssize_t len);
+void hist_remove_zeroes(histogram_t *h);
+histogram_t * hist_compress_mbe(const histogram_t *h, int8_t mbe);
+histogram_t * hist_compress_mbe_with_allocator(const histogram_t *h, int8_t mbe, const hist_allocator_t *alloc);
+typedef struct hist_archive_writer hist_archive_writer_t;
+typedef struct hist_archive hist_archive_t;
+hist_archive_writer_t * hist_archive_writer_open(const char *path);
+int hist_archive_writer_add(hist_archive_writer_t *w, uint64_t series, int64_t timestamp, const histogram_t *h);
+int hist_archive_writer_close(hist_archive_writer_t *w);
+hist_archive_t * hist_archive_open(const char *path);
+void hist_archive_close(hist_archive_t *a);
+uint64_t hist_archive_count(const hist_archive_t *a);
+uint64_t hist_archive_lower_bound(const hist_archive_t *a, uint64_t series, int64_t timestamp);
+int hist_archive_entry(const hist_archive_t *a, uint64_t idx, uint64_t *series, int64_t *timestamp, const void **data, ssize_t *len);
+int hist_archive_lookup(const hist_archive_t *a, uint64_t series, int64_t timestamp, histogram_t *out);
+int64_t hist_archive_merge_range(const hist_archive_t *a, uint64_t series, int64_t start, int64_t end, histogram_t *tgt);
+ssize_t hist_block_encode_estimate(const histogram_t * const *h, int n);
+ssize_t hist_block_encode(const histogram_t * const *h, const int64_t *timestamps, int n, void *buff, ssize_t len);
+int hist_block_steps(const void *buff, ssize_t len);
+int hist_block_timestamps(const void *buff, ssize_t len, int64_t *timestamps);
+int hist_block_merge_range(const void *buff, ssize_t len, int first, int last, histogram_t *tgt);
+typedef struct hist_window hist_window_t;
+hist_window_t * hist_window_alloc(int nslices, uint64_t slice_width);
+void hist_window_free(hist_window_t *w);
+int hist_window_advance(hist_window_t *w, uint64_t now);
+uint64_t hist_window_insert(hist_window_t *w, uint64_t t, double val, uint64_t count);
+uint64_t hist_window_insert_intscale(hist_window_t *w, uint64_t t, int64_t val, int scale, uint64_t count);
+int hist_window_accumulate(hist_window_t *w, uint64_t t, const histogram_t *h);
+const histogram_t * hist_window_aggregate(const hist_window_t *w);
+typedef struct hist_rollup_level {
+  uint64_t period; 
+  uint32_t retain; 
+} hist_rollup_level_t;
+struct hist_rollup_config {
+  int nlevels;
+  hist_rollup_level_t levels[8];
+};
+typedef struct hist_rollup hist_rollup_t;
+hist_rollup_t * hist_rollup_alloc(const hist_rollup_config_t *config);
+void hist_rollup_free(hist_rollup_t *r);
+int hist_rollup_advance(hist_rollup_t *r, uint64_t now);
+int hist_rollup_insert(hist_rollup_t *r, uint64_t t, double val, uint64_t count);
+int hist_rollup_insert_intscale(hist_rollup_t *r, uint64_t t, int64_t val, int scale, uint64_t count);
+int hist_rollup_insert_raw(hist_rollup_t *r, uint64_t t, hist_bucket_t hb, uint64_t count);
+int hist_rollup_accumulate(hist_rollup_t *r, uint64_t t, const histogram_t *h);
+int hist_rollup_query(const hist_rollup_t *r, uint64_t start, uint64_t end, histogram_t *out);
+typedef struct hist_decay hist_decay_t;
+hist_decay_t * hist_decay_alloc(uint64_t halflife);
+void hist_decay_free(hist_decay_t *d);
+uint64_t hist_decay_insert(hist_decay_t *d, uint64_t t, double val, uint64_t count);
+uint64_t hist_decay_insert_intscale(hist_decay_t *d, uint64_t t, int64_t val, int scale, uint64_t count);
+uint64_t hist_decay_insert_raw(hist_decay_t *d, uint64_t t, hist_bucket_t hb, uint64_t count);
+double hist_decay_sample_count(const hist_decay_t *d, uint64_t now);
+int hist_decay_snapshot(const hist_decay_t *d, uint64_t now, uint64_t multiplier, histogram_t *out);
+typedef struct hist_ring hist_ring_t;
+hist_ring_t * hist_ring_alloc(uint32_t capacity, int multi_producer);
+void hist_ring_free(hist_ring_t *r);
+int hist_ring_record(hist_ring_t *r, double val);
+int hist_ring_record_intscale(hist_ring_t *r, int64_t val, int scale);
+uint64_t hist_ring_drain(hist_ring_t *r, histogram_t *h, uint64_t max);
+uint64_t hist_ring_pending(const hist_ring_t *r);
+uint64_t hist_ring_capacity(const hist_ring_t *r);
+uint64_t hist_ring_dropped(const hist_ring_t *r);
+typedef struct hist_publisher hist_publisher_t;
+hist_publisher_t * hist_publisher_alloc(int max_readers);
+void hist_publisher_free(hist_publisher_t *p);
+int hist_publisher_register(hist_publisher_t *p);
+void hist_publisher_unregister(hist_publisher_t *p, int slot);
+int hist_publish(hist_publisher_t *p, const histogram_t *h);
+const histogram_t * hist_snapshot_acquire(hist_publisher_t *p, int slot);
+void hist_snapshot_release(hist_publisher_t *p, int slot);
+int hist_publisher_retired(const hist_publisher_t *p);
+double hist_approx_mean(const histogram_t *);
+double hist_approx_sum(const histogram_t *);
+double hist_approx_stddev(const histogram_t *);
+double hist_approx_moment(const histogram_t *hist, double k);
+void hist_clamp(histogram_t *hist, double lower, double upper);
+uint64_t hist_approx_count_below(const histogram_t *hist, double threshold);
+uint64_t hist_approx_count_below_inclusive(const histogram_t *hist, double threshold);
+uint64_t hist_approx_count_below_exclusive(const histogram_t *hist, double threshold);
+uint64_t hist_approx_count_above(const histogram_t *hist, double threshold);
+uint64_t hist_approx_count_above_inclusive(const histogram_t *hist, double threshold);
+uint64_t hist_approx_count_above_exclusive(const histogram_t *hist, double threshold);
+uint64_t hist_approx_count_nearby(const histogram_t *hist, double value);
+int hist_approx_quantile(const histogram_t *, const double *q_in, int nq, double *q_out);
+int hist_approx_quantile7(const histogram_t *, const double *q_in, int nq, double *q_out);
+int hist_approx_quantile_batch(const histogram_t * const *h, int first, int last, const double *q_in, int nq, double *q_out);
+int hist_approx_quantile7_batch(const histogram_t * const *h, int first, int last, const double *q_in, int nq, double *q_out);
+int hist_approx_quantile_merged(const histogram_t * const *src, int cnt, const double *q_in, int nq, double *q_out);
+int hist_approx_quantile7_merged(const histogram_t * const *src, int cnt, const double *q_in, int nq, double *q_out);
+int hist_approx_inverse_quantile(const histogram_t *, const double *iq_in, int niq, double *iq_out);
+typedef struct {
+  double value;
+  hist_bucket_t bucket;  
+  int8_t position;       
+  double fraction;       
+} hist_threshold_t;
+hist_threshold_t hist_threshold_compile(double value);
+uint64_t hist_threshold_count_below(const histogram_t *hist, const hist_threshold_t *t, int inclusive);
+uint64_t hist_threshold_count_above(const histogram_t *hist, const hist_threshold_t *t, int inclusive);
+double hist_threshold_inverse_quantile(const histogram_t *hist, const hist_threshold_t *t);
+typedef struct {
+  uint64_t count;
+  double lower;
+  double upper;
+} histogram_adhoc_bin_t;
+typedef enum {
+  HIST_APPROX_MID = 0,
+  HIST_APPROX_HARMONIC_MEAN,
+  HIST_APPROX_HIGH,
+  HIST_APPROX_LOW
+} histogram_approx_mode_t;
+histogram_t * hist_create_approximation_from_adhoc(histogram_approx_mode_t mode, const histogram_adhoc_bin_t *bins, size_t nbins, double sum);
+""")
+C = None
+
+import platform
+plt = platform.system()
+libext = ".so"
+if plt == "Darwin":
+    libext = ".dylib"
+
+for path in [ # Search for libcircllhist.so
+    "./libcircllhist" + libext, # 1. cwd
+    "/usr/local/lib/libcircllhist" + libext, # 2. default path
+    "/opt/circonus/lib/libcircllhist" + libext, # 3. vendor path
+    "libcircllhist" + libext # 4. system paths via ld.so
+    ]:
+    try:
+        C = ffi.dlopen(path)
+        break
+    except OSError:
+        pass
+
+if not C:
+    # let dlopen throw it's error
+    print("""
+
+libcircllhist.so was not found on your system.
+Please install libcircllhist from: https://github.com/openhistogram/libcircllhist/
+
+    """)
+    ffi.dlopen("libcircllhist.so")
@@ -5,6 +5,7 @@ The circllhist python module provides a wrapper around the libcircllhist data st
 import sys
 import json
 import math
+import threading
 import circllhist.ffi as ffi
 
 if sys.version_info[0] == 3:
@@ -138,6 +139,42 @@ class Circllhist(object):
             raise("Quantile type not supported: " + qtype)
         return q_out[0]
 
+    @staticmethod
+    def quantiles(hists, qs, qtype=1, threads=1):
+        """
+        Returns the q-quantiles of type 1 or 7 for each histogram in hists,
+        as one list of len(qs) values per histogram.  qs must be ascending.
+        With threads > 1 the histograms are split into that many ranges
+        evaluated concurrently.
+        """
+        if qtype == 1:
+            fn = ffi.C.hist_approx_quantile_batch
+        elif qtype == 7:
+            fn = ffi.C.hist_approx_quantile7_batch
+        else:
+            raise ValueError("Quantile type not supported: %s" % qtype)
+        n, nq = len(hists), len(qs)
+        h = ffi.ffi.new("histogram_t*[]", [x._h for x in hists])
+        q_in = ffi.ffi.new("double[]", qs)
+        q_out = ffi.ffi.new("double[]", n * nq)
+        rv = [0]
+        def run(first, last):
+            r = fn(h, first, last, q_in, nq, q_out)
+            if r != 0:
+                rv[0] = r
+        step = max(1, -(-n // max(1, threads)))
+        ranges = [(i, min(n, i + step)) for i in range(0, n, step)]
+        workers = [threading.Thread(target=run, args=r) for r in ranges[1:]]
+        for w in workers:
+            w.start()
+        if ranges:
+            run(*ranges[0])
+        for w in workers:
+            w.join()
+        if rv[0] != 0:
+            raise ValueError("Invalid quantiles: %s" % (qs,))
+        return [list(q_out[i * nq:(i + 1) * nq]) for i in range(n)]
+
     def to_dict(self):
         "Use this to generate JSON output"
         d = {}
@@ -148,10 +185,13 @@ class Circllhist(object):
     @classmethod
     def from_dict(cls, d):
         "Create a histogram from a dict of the form bin => count"
-        h = cls()
-        for k, v in d.items():
-            h.insert(float(k), v)
-        return h
+        n = len(d)
+        buckets = ffi.ffi.new("hist_bucket_t[]", n)
+        counts = ffi.ffi.new("uint64_t[]", n)
+        for i, k in enumerate(sorted(d, key=float)):
+            buckets[i] = ffi.C.double_to_hist_bucket(float(k))
+            counts[i] = d[k]
+        return cls(ffi.C.hist_from_sorted(buckets, counts, n), gc=True)
 
     def to_b64(self):
         "Returns a base64 encoded binary representation of the histogram"
@@ -25,6 +25,18 @@ class TestHistogram(unittest.TestCase):
         h.clear()
         self.assertEqual(h.count(), 0)
 
+    def test_quantiles(self):
+        hists = [Circllhist() for _ in range(5)]
+        for i, h in enumerate(hists):
+            for v in range(1, 101):
+                h.insert(v * (i + 1))
+        qs = [0.5, 0.9, 0.99]
+        rows = Circllhist.quantiles(hists, qs, threads=2)
+        self.assertEqual(len(rows), 5)
+        for h, row in zip(hists, rows):
+            self.assertEqual(row, [h.quantile(q) for q in qs])
+        self.assertRaises(ValueError, Circllhist.quantiles, hists, [0.9, 0.5])
+
     def test_bin(self):
         b = Circllbin.from_number(123.3)
         self.assertEqual(b.width,10)
@@ -9,6 +9,8 @@
 #include <string.h>
 #include <inttypes.h>
 #include <sys/time.h>
+#include <unistd.h>
+#include <pthread.h>
 
 typedef histogram_t *(*halloc_func)();
 halloc_func halloc = NULL;
@@ -313,6 +315,114 @@ void downsample() {
   hist_free(h);
 }
 
+static double
+lcg_uniform(void *closure) {
+  uint64_t *state = closure;
+  *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+  return (*state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* mean and variance of the binomial samples must match n*p and n*p*(1-p) */
+static void
+downsample_binomial_check(uint64_t n, double p) {
+  const int trials = 4000;
+  uint64_t state = 42;
+  double sum = 0, sumsq = 0;
+  histogram_t *h = hist_alloc();
+  for(int t=0; t<trials; t++) {
+    hist_clear(h);
+    hist_insert_intscale(h, 5, 0, n);
+    hist_downsample_with_uniform(h, p, lcg_uniform, &state);
+    double x = hist_sample_count(h);
+    sum += x;
+    sumsq += x * x;
+  }
+  double mean = sum / trials, var = sumsq / trials - mean * mean;
+  double emean = n * p, evar = n * p * (1 - p);
+  isf(fabs(mean - emean) < 5 * sqrt(evar / trials) &&
+      fabs(var - evar) < 0.15 * evar,
+      "n=%llu p=%g mean %g (%g) var %g (%g)", (unsigned long long)n, p,
+      mean, emean, var, evar);
+  hist_free(h);
+}
+
+void downsample_binomial() {
+  downsample_binomial_check(20, 0.3);         /* inversion */
+  downsample_binomial_check(1000, 0.99);      /* inversion on the dropped side */
+  downsample_binomial_check(1000, 0.3);       /* BTPE */
+  downsample_binomial_check(10000000, 0.7);   /* BTPE on the dropped side */
+}
+
+void downsample_reproducible() {
+  hist_rng_t rng1, rng2;
+  histogram_t *h1 = hist_alloc(), *h2;
+  for(int i=10; i<100; i++) hist_insert_intscale(h1, i, 0, 1000 + i);
+  h2 = hist_clone(h1);
+  /* xoshiro256** reference output for this splitmix64 seeding */
+  hist_rng_seed(&rng1, 0);
+  is(hist_rng_next(&rng1) == 0x99ec5f36cb75f2b4ULL);
+  hist_rng_seed(&rng1, 1234);
+  hist_rng_seed(&rng2, 1234);
+  hist_downsample_r(h1, 0.25, &rng1);
+  hist_downsample_r(h2, 0.25, &rng2);
+  is(hists_equal(h1, h2));
+  is(hist_rng_next(&rng1) == hist_rng_next(&rng2));
+  hist_free(h1);
+  hist_free(h2);
+}
+
+void downsample_deterministic() {
+  histogram_t *h = hist_alloc();
+  uint64_t c;
+  hist_bucket_t b;
+  /* 3 bins of 1 at factor 0.5: total 1, the tie goes to the lowest bin */
+  hist_insert_intscale(h, 1, 0, 1);
+  hist_insert_intscale(h, 2, 0, 1);
+  hist_insert_intscale(h, 3, 0, 1);
+  is(hist_downsample_deterministic(h, 0.5) == 0);
+  is(hist_sample_count(h) == 1);
+  is(hist_bucket_count(h) == 1);
+  is(hist_bucket_idx_bucket(h, 0, &b, &c) && hist_bucket_to_double(b) == 1);
+
+  /* 7 * 0.3 = 2.1, 5 * 0.3 = 1.5, 9 * 0.3 = 2.7 -> floors 2 1 2, target 6 */
+  hist_clear(h);
+  hist_insert_intscale(h, 1, 0, 7);
+  hist_insert_intscale(h, 2, 0, 5);
+  hist_insert_intscale(h, 3, 0, 9);
+  hist_downsample_deterministic(h, 0.3);
+  is(hist_sample_count(h) == 6);
+  is(hist_bucket_idx_bucket(h, 2, &b, &c) && c == 3);
+
+  int exact = 1;
+  hist_clear(h);
+  for(int i=10; i<100; i++) hist_insert_intscale(h, i, 0, 1 + (i * 7919) % 1000);
+  for(int k=0; k<10; k++) {
+    uint64_t before = hist_sample_count(h);
+    hist_downsample_deterministic(h, 0.9);
+    if(hist_sample_count(h) != (uint64_t)(before * 0.9)) exact = 0;
+  }
+  is(exact);
+
+  /* shares beyond double and long double precision are still exact:
+   * (2^63 + 1) * 0.5 twice leaves one unit for the lower bin */
+  hist_clear(h);
+  hist_insert_intscale(h, 1, 0, ((uint64_t)1 << 63) + 1);
+  hist_insert_intscale(h, 2, 0, ((uint64_t)1 << 63) + 1);
+  hist_downsample_deterministic(h, 0.5);
+  is(hist_bucket_idx_bucket(h, 0, &b, &c) && c == ((uint64_t)1 << 62) + 1);
+  is(hist_bucket_idx_bucket(h, 1, &b, &c) && c == ((uint64_t)1 << 62));
+
+  /* 5000 * (2^64 - 1) * 2^-76 = 1.22: the remainders overflow 128 bits */
+  hist_clear(h);
+  for(int i=0; i<5000; i++) {
+    hist_bucket_t hb = { 10 + i % 90, -64 + i / 90 };
+    hist_insert_raw(h, hb, ~(uint64_t)0);
+  }
+  hist_downsample_deterministic(h, ldexp(1, -76));
+  is(hist_bucket_count(h) == 1 && hist_sample_count(h) == 1);
+  hist_free(h);
+}
+
 void simple_clear() {
   histogram_t *h = hist_alloc();
   double out[1], in[1] = {0};
@@ -397,6 +507,39 @@ void serialize_test() {
   free(serial);
 }
 
+void serialize_batch_test() {
+  int i, lfailed = 0;
+  histogram_t *h[5];
+  ssize_t offsets[6];
+  double s[] = { 0.123, 0, 0.43, 0.41, 0.415, 0.2201, 0.3201, 0.125, 0.13, 13 };
+  h[0] = build(s, 10);
+  h[1] = halloc();
+  h[2] = NULL;
+  h[3] = build(s, 3);
+  h[4] = halloc();
+  for(i=0; i<2000; i++) hist_insert_intscale(h[4], i, i % 7, i + 1);
+
+  ssize_t total = hist_serialize_b64_batch_layout((const histogram_t * const *)h, 5, offsets);
+  char *arena = malloc(total);
+  /* two disjoint ranges, as separate threads would do */
+  is(hist_serialize_b64_batch((const histogram_t * const *)h, offsets, 0, 2, arena) == 0);
+  is(hist_serialize_b64_batch((const histogram_t * const *)h, offsets, 2, 5, arena) == 0);
+  for(i=0; i<5; i++) {
+    ssize_t len = offsets[i+1] - offsets[i];
+    char *single = malloc(hist_serialize_b64_estimate(h[i]));
+    ssize_t single_len = hist_serialize_b64(h[i], single, hist_serialize_b64_estimate(h[i]));
+    if(single_len != len || memcmp(single, arena + offsets[i], len)) lfailed = 1;
+    histogram_t *out = hist_alloc();
+    if(hist_deserialize_b64(out, arena + offsets[i], len) < 0) lfailed = 1;
+    if(h[i] && !hists_equal(h[i], out)) lfailed = 1;
+    hist_free(out);
+    free(single);
+  }
+  isf(!lfailed, "%d strings in %zd bytes", 5, total);
+  for(i=0; i<5; i++) hist_free(h[i]);
+  free(arena);
+}
+
 void sample_count_roll() {
   histogram_t *toobig;
   toobig = hist_alloc();
@@ -637,6 +780,1137 @@ diff_test() {
   hist_free(result);
 }
 
+void
+archive_test() {
+  const char *path = "histogram_test.archive";
+  histogram_t *h[6];
+  int i;
+  hist_archive_writer_t *w = hist_archive_writer_open(path);
+  is(w != NULL);
+  /* series 2 and 1 interleaved and out of timestamp order */
+  for(i=5; i>=0; i--) {
+    h[i] = hist_alloc();
+    hist_insert_intscale(h[i], i + 1, 0, i + 1);
+    hist_insert_intscale(h[i], 42, -3, 1);
+    is(hist_archive_writer_add(w, 1 + i % 2, 1000 * (i / 2), h[i]) == 0);
+  }
+  is(hist_archive_writer_close(w) == 0);
+
+  hist_archive_t *a = hist_archive_open(path);
+  is(a != NULL);
+  is(hist_archive_count(a) == 6);
+  uint64_t series, prev_series = 0;
+  int64_t ts, prev_ts = INT64_MIN;
+  int sorted = 1;
+  for(uint64_t idx=0; idx<hist_archive_count(a); idx++) {
+    is(hist_archive_entry(a, idx, &series, &ts, NULL, NULL) == 0);
+    if(series < prev_series || (series == prev_series && ts < prev_ts)) sorted = 0;
+    prev_series = series;
+    prev_ts = ts;
+  }
+  is(sorted);
+  is(hist_archive_entry(a, 6, NULL, NULL, NULL, NULL) == -1);
+
+  histogram_t *out = hist_alloc();
+  is(hist_archive_lookup(a, 2, 1000, out) == 0);
+  is(hists_equal(out, h[3]));
+  is(hist_archive_lookup(a, 2, 1001, out) == -1);
+  is(hist_archive_lookup(a, 3, 0, out) == -1);
+  hist_free(out);
+
+  /* series 1 holds h[0], h[2], h[4] at 0, 1000, 2000 */
+  histogram_t *merged = hist_alloc(), *expected = hist_alloc();
+  is(hist_archive_merge_range(a, 1, 0, 2000, merged) == 2);
+  hist_accumulate(expected, (const histogram_t * const *)h, 1);
+  hist_accumulate(expected, (const histogram_t * const *)&h[2], 1);
+  is(hists_equal(merged, expected));
+  is(hist_archive_merge_range(a, 1, 2001, 5000, merged) == 0);
+  hist_free(merged);
+  hist_free(expected);
+  hist_archive_close(a);
+
+  /* a weighted record in the middle of the range can't go into a plain
+   * histogram, the records before it must not be merged either */
+  histogram_t *wh = hist_alloc_weighted();
+  hist_insert_weighted(wh, 5, 0.5);
+  unlink(path);
+  w = hist_archive_writer_open(path);
+  is(hist_archive_writer_add(w, 1, 0, h[0]) == 0);
+  is(hist_archive_writer_add(w, 1, 1000, wh) == 0);
+  is(hist_archive_writer_add(w, 1, 2000, h[1]) == 0);
+  is(hist_archive_writer_close(w) == 0);
+  a = hist_archive_open(path);
+  merged = hist_alloc();
+  hist_insert_intscale(merged, 7, 0, 1);
+  is(hist_archive_merge_range(a, 1, 0, 5000, merged) == -1);
+  is(hist_sample_count(merged) == 1 && hist_bucket_count(merged) == 1);
+  is(hist_archive_merge_range(a, 1, 0, 1000, merged) == 1);
+  is(hist_sample_count(merged) == 1 + hist_sample_count(h[0]));
+  hist_free(merged);
+  hist_free(wh);
+  hist_archive_close(a);
+
+  /* a failed write poisons the writer */
+  w = hist_archive_writer_open("/dev/full");
+  if(w) {
+    histogram_t *big = hist_alloc();
+    for(i=0; i<5000; i++) hist_insert_raw(big, (hist_bucket_t){ 10 + i % 90, i / 90 }, 1);
+    is(hist_archive_writer_add(w, 1, 0, big) == -1);
+    is(hist_archive_writer_add(w, 1, 1, h[0]) == -1);
+    is(hist_archive_writer_close(w) == -1);
+    hist_free(big);
+  }
+
+  is(hist_archive_open("histogram_test.missing") == NULL);
+  unlink(path);
+  for(i=0; i<6; i++) hist_free(h[i]);
+}
+
+static uint32_t
+crc32c_bitwise(const uint8_t *cp, size_t len) {
+  uint32_t crc = ~0U;
+  int k;
+  while(len--) {
+    crc ^= *cp++;
+    for(k=0; k<8; k++) crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+  }
+  return ~crc;
+}
+
+void
+window_test() {
+  hist_window_t *w = hist_window_alloc(3, 10);
+  histogram_t *expected = hist_alloc();
+  int i;
+  is(hist_window_alloc(0, 10) == NULL);
+  /* t = 0 .. 29 fills all three slices, one value per slice */
+  for(i=0; i<30; i++) is(hist_window_insert_intscale(w, i, 1 + i / 10, 0, 1) == 1);
+  is(hist_sample_count(hist_window_aggregate(w)) == 30);
+  is(hist_bucket_count(hist_window_aggregate(w)) == 3);
+
+  /* t = 30 expires slice [0, 10) */
+  is(hist_window_advance(w, 30) == 1);
+  hist_insert_intscale(expected, 2, 0, 10);
+  hist_insert_intscale(expected, 3, 0, 10);
+  is(hists_equal((histogram_t *)hist_window_aggregate(w), expected));
+
+  /* late data for a live slice is kept, for an expired one it is dropped */
+  is(hist_window_insert(w, 15, 2.5, 4) == 4);
+  is(hist_window_insert(w, 5, 1.5, 4) == 0);
+  hist_insert(expected, 2.5, 4);
+  is(hists_equal((histogram_t *)hist_window_aggregate(w), expected));
+
+  /* t = 40 expires [10, 20) including the late data */
+  histogram_t *other = hist_alloc();
+  hist_insert_intscale(other, 7, 0, 2);
+  is(hist_window_accumulate(w, 35, other) == 0);
+  is(hist_window_advance(w, 45) == 1);
+  hist_clear(expected);
+  hist_insert_intscale(expected, 3, 0, 10);
+  hist_insert_intscale(expected, 7, 0, 2);
+  is(hists_equal((histogram_t *)hist_window_aggregate(w), expected));
+  is(hist_window_accumulate(w, 0, other) == -1);
+
+  /* jumping far ahead empties everything */
+  is(hist_window_advance(w, 1000) == 2);
+  is(hist_bucket_count(hist_window_aggregate(w)) == 0);
+  is(hist_window_advance(w, 10) == 0);
+
+  hist_free(other);
+  hist_free(expected);
+  hist_window_free(w);
+}
+
+static histogram_t *
+rollup_expected(uint64_t start, uint64_t end) {
+  histogram_t *h = hist_alloc();
+  for(uint64_t t=start; t<end; t++) hist_insert_intscale(h, t % 100, 0, 1);
+  return h;
+}
+
+void
+rollup_test() {
+  hist_rollup_config_t config = { 3, { { 1, 120 }, { 60, 60 }, { 3600, 48 } } };
+  hist_rollup_config_t bad = { 2, { { 60, 10 }, { 90, 10 } } };
+  hist_rollup_t *r = hist_rollup_alloc(&config);
+  histogram_t *out = hist_alloc(), *expected;
+  is(r != NULL);
+  is(hist_rollup_alloc(&bad) == NULL);
+  for(uint64_t t=0; t<3 * 3600; t++) hist_rollup_insert_intscale(r, t, t % 100, 0, 1);
+  /* closing hour 2 also closes second 10799 and minute 179 */
+  is(hist_rollup_advance(r, 3 * 3600) == 3);
+
+  /* three whole hours read three histograms */
+  is(hist_rollup_query(r, 0, 3 * 3600, out) == 3);
+  expected = rollup_expected(0, 3 * 3600);
+  is(hists_equal(out, expected));
+  hist_free(expected);
+
+  /* half an hour comes from the minute level, the last 50s from seconds */
+  hist_clear(out);
+  is(hist_rollup_query(r, 9000, 10800, out) == 30);
+  expected = rollup_expected(9000, 10800);
+  is(hists_equal(out, expected));
+  hist_free(expected);
+  hist_clear(out);
+  is(hist_rollup_query(r, 10750, 10800, out) == 50);
+  expected = rollup_expected(10750, 10800);
+  is(hists_equal(out, expected));
+  hist_free(expected);
+
+  /* late data reaches every level that already folded its period */
+  is(hist_rollup_insert_intscale(r, 10700, 7, 0, 5) == 3);
+  is(hist_rollup_insert_intscale(r, 10, 7, 0, 5) == 1);
+  hist_clear(out);
+  is(hist_rollup_query(r, 0, 3 * 3600, out) == 3);
+  expected = rollup_expected(0, 3 * 3600);
+  hist_insert_intscale(expected, 7, 0, 10);
+  is(hists_equal(out, expected));
+  hist_free(expected);
+
+  /* the open period is visible at the finest level */
+  is(hist_rollup_insert_intscale(r, 3 * 3600, 1, 0, 1) == 1);
+  hist_clear(out);
+  is(hist_rollup_query(r, 3 * 3600, 4 * 3600, out) == 1);
+  is(hist_sample_count(out) == 1);
+
+  hist_free(out);
+  hist_rollup_free(r);
+}
+
+void
+decay_test() {
+  hist_decay_t *d = hist_decay_alloc(10);
+  histogram_t *out = hist_alloc();
+  uint64_t c;
+  hist_bucket_t b;
+  is(hist_decay_alloc(0) == NULL);
+  is(hist_decay_sample_count(d, 0) == 0);
+  is(hist_decay_insert_intscale(d, 0, 5, 0, 1000) == 1000);
+  is(fabs(hist_decay_sample_count(d, 0) - 1000) < 1e-6);
+  is(fabs(hist_decay_sample_count(d, 10) - 500) < 1e-6);
+  is(fabs(hist_decay_sample_count(d, 20) - 250) < 1e-6);
+  is(hist_decay_snapshot(d, 30, 1, out) == 1);
+  is(hist_bucket_idx_bucket(out, 0, &b, &c) && c == 125);
+
+  /* newer samples weigh more, without touching the old bin */
+  is(hist_decay_insert_intscale(d, 10, 7, 0, 100) == 100);
+  is(fabs(hist_decay_sample_count(d, 10) - 600) < 1e-6);
+  hist_clear(out);
+  is(hist_decay_snapshot(d, 20, 4, out) == 2);
+  is(hist_sample_count(out) == 4 * 300);
+
+  /* inserting 10 half-lives later renormalizes, the old bins keep decaying */
+  is(hist_decay_insert_intscale(d, 110, 9, 0, 64) == 64);
+  is(fabs(hist_decay_sample_count(d, 110) - (64 + 1200.0 / 2048)) < 1e-3);
+  is(fabs(hist_decay_sample_count(d, 120) - (32 + 1200.0 / 4096)) < 1e-3);
+  hist_clear(out);
+  /* the old bins have decayed below 1/2 */
+  is(hist_decay_snapshot(d, 120, 1, out) == 1);
+  is(hist_approx_count_above(out, 8) == 32);
+
+  hist_free(out);
+  hist_decay_free(d);
+}
+
+void
+framed_test() {
+  histogram_t *h = hist_alloc(), *out = hist_alloc();
+  int i;
+  for(i=-20; i<20; i++) hist_insert_intscale(h, i * 7, i % 3, 1 + abs(i));
+  ssize_t est = hist_serialize_framed_estimate(h);
+  uint8_t *buff = malloc(est + 1);
+  ssize_t len = hist_serialize_framed(h, buff, est);
+  is(len == est);
+  is(hist_serialize_framed(h, buff, est - 1) == -1);
+  is(hist_framed_validate(buff, len) == len);
+  is(hist_deserialize_framed(out, buff, len) == len);
+  is(hists_equal(h, out));
+
+  /* trailing data after a frame is not part of it */
+  buff[len] = 0xff;
+  is(hist_framed_validate(buff, len + 1) == len);
+  /* truncation and any flipped bit in the payload are caught */
+  is(hist_framed_validate(buff, len - 1) == -1);
+  is(hist_framed_validate(buff, 15) == -1);
+  int caught = 1;
+  for(i=16; i<len; i++) {
+    buff[i] ^= 0x10;
+    if(hist_framed_validate(buff, len) != -1) caught = 0;
+    buff[i] ^= 0x10;
+  }
+  is(caught);
+  buff[0] = 'X';
+  is(hist_deserialize_framed(out, buff, len) == -1);
+  is(hists_equal(h, out));
+
+  /* a correctly checksummed payload with an invalid bucket is still rejected */
+  uint8_t bad[16 + 2 + 4] = { 'C', 'L', 'H', 'F', 1, 0, 0, 0, 0, 0, 0, 6 };
+  uint32_t crc;
+  bad[17] = 1;
+  bad[18] = 10; bad[19] = 0; bad[20] = 0; bad[21] = 1;
+  crc = crc32c_bitwise(bad + 16, 6);
+  bad[12] = crc >> 24; bad[13] = crc >> 16; bad[14] = crc >> 8; bad[15] = crc;
+  is(hist_framed_validate(bad, sizeof(bad)) == sizeof(bad));
+  bad[18] = 5; /* val 5 is not a bucket */
+  crc = crc32c_bitwise(bad + 16, 6);
+  bad[12] = crc >> 24; bad[13] = crc >> 16; bad[14] = crc >> 8; bad[15] = crc;
+  is(hist_framed_validate(bad, sizeof(bad)) == -1);
+  is(hist_deserialize(out, bad + 16, 6) == 6); /* the plain format skips it */
+
+  hist_free(h);
+  hist_free(out);
+  free(buff);
+}
+
+void
+block_test() {
+  histogram_t *h[5];
+  int64_t ts[5], ts_out[5];
+  int i, j;
+  for(i=0; i<5; i++) {
+    h[i] = hist_alloc();
+    ts[i] = 1600000000 + 60 * i;
+    /* a steady core of buckets plus one that comes and goes */
+    for(j=1; j<20; j++) hist_insert_intscale(h[i], j, 0, 100 + i * j);
+    if(i % 2) hist_insert_intscale(h[i], -7, 2, i);
+  }
+  hist_free(h[2]);
+  h[2] = NULL; /* an empty step */
+
+  ssize_t est = hist_block_encode_estimate((const histogram_t * const *)h, 5);
+  void *buff = malloc(est);
+  ssize_t len = hist_block_encode((const histogram_t * const *)h, ts, 5, buff, est);
+  is(len > 0 && len <= est);
+  is(hist_block_encode((const histogram_t * const *)h, ts, 5, buff, 4) == -1);
+  is(hist_block_steps(buff, len) == 5);
+  is(hist_block_timestamps(buff, len, ts_out) == 5);
+  is(memcmp(ts, ts_out, sizeof(ts)) == 0);
+
+  histogram_t *out = hist_alloc(), *expected = hist_alloc();
+  for(i=0; i<5; i++) {
+    hist_clear(out);
+    is(hist_block_merge_range(buff, len, i, i + 1, out) == 1);
+    if(h[i]) is(hists_equal(out, h[i]));
+    else is(hist_bucket_count(out) == 0);
+  }
+  hist_clear(out);
+  is(hist_block_merge_range(buff, len, 0, 5, out) == 5);
+  hist_accumulate(expected, (const histogram_t * const *)h, 5);
+  is(hists_equal(out, expected));
+  is(hist_block_merge_range(buff, len, 3, 99, out) == 2);
+  is(hist_block_merge_range(buff, len - 1, 0, 5, out) == -1);
+  is(hist_block_steps(buff, 1) == -1);
+
+  hist_free(out);
+  hist_free(expected);
+  free(buff);
+  for(i=0; i<5; i++) hist_free(h[i]);
+}
+
+void
+weighted_test() {
+  histogram_t *w = hist_alloc_weighted(), *plain = hist_alloc(), *out;
+  hist_bucket_t hb;
+  double weight;
+  is(hist_is_weighted(w) && !hist_is_weighted(plain));
+  is(hist_insert_weighted(w, 1.0, 0.25) == 0.25);
+  is(hist_insert_weighted(w, 2.0, 0.75) == 0.75);
+  is(hist_insert_weighted(w, 2.0, -1) == 0);
+  is(hist_bucket_count(w) == 2);
+  is(double_equals(hist_sample_weight(w), 1.0));
+  is(hist_sample_count(w) == 1);
+  hist_insert(plain, 1.0, 1);
+  hist_insert(plain, 2.0, 3);
+  is(double_equals(hist_approx_mean(w), hist_approx_mean(plain)));
+  /* integral weights behave exactly like counts */
+  double qin[] = { 0.2, 0.6, 0.9 }, qw[3], qp[3];
+  out = hist_alloc_weighted();
+  hist_insert_weighted(out, 1.0, 1);
+  hist_insert_weighted(out, 2.0, 3);
+  is(hist_approx_quantile(out, qin, 3, qw) == 0 && hist_approx_quantile(plain, qin, 3, qp) == 0);
+  is(double_equals(qw[0], qp[0]) && double_equals(qw[1], qp[1]) && double_equals(qw[2], qp[2]));
+  hist_free(out);
+  hist_clear(plain);
+  is(double_equals(hist_approx_weight_below(w, 1.5), 0.25));
+  is(double_equals(hist_approx_weight_above(w, 1.5), 0.75));
+  is(hist_bucket_idx_weight(w, 1, &hb, &weight) && double_equals(weight, 0.75));
+
+  /* fractional weights survive serialization, but only into weighted histograms */
+  char buff[1024];
+  ssize_t len = hist_serialize(w, buff, sizeof(buff));
+  is(len > 0);
+  out = hist_alloc_weighted();
+  is(hist_deserialize(out, buff, len) == len);
+  is(double_equals(hist_sample_weight(out), 1.0));
+  is(hist_bucket_idx_weight(out, 0, &hb, &weight) && double_equals(weight, 0.25));
+  is(hist_deserialize(plain, buff, len) < 0);
+  is(hist_accumulate_serialized(plain, buff, len) < 0);
+  is(hist_bucket_count(plain) == 0);
+
+  /* counts merge into weights, not the other way around */
+  is(hist_accumulate(plain, (const histogram_t * const *)&w, 1) == -1);
+  hist_insert(plain, 1.0, 2);
+  is(hist_insert_weighted(plain, 1.0, 2.6) == 3);
+  is(hist_accumulate(w, (const histogram_t * const *)&plain, 1) == 2);
+  is(hist_bucket_idx_weight(w, 0, &hb, &weight) && double_equals(weight, 5.25));
+  is(hist_remove(w, 1.0, 1) == 1);
+  is(hist_bucket_idx_weight(w, 0, &hb, &weight) && double_equals(weight, 4.25));
+  /* removing at least the whole weight empties the bin, residues included */
+  histogram_t *residue = hist_alloc_weighted();
+  hist_insert_weighted(residue, 2.0, 0.4);
+  hist_insert_weighted(residue, 3.0, 2.6);
+  is(hist_remove(residue, 2.0, 1) == 0);
+  is(hist_remove(residue, 3.0, 3) == 3);
+  is(hist_sample_weight(residue) == 0);
+  hist_free(residue);
+  is(hist_subtract_as_int64(plain, w) == -1);
+
+  /* downsampling scales weights exactly */
+  hist_downsample(w, 0.5);
+  is(double_equals(hist_sample_weight(w), 2.5));
+
+  hist_free(out);
+  hist_free(plain);
+  hist_free(w);
+}
+
+void
+ring_test() {
+  hist_ring_t *r = hist_ring_alloc(5, 0);
+  histogram_t *h = hist_fast_alloc(), *expected = hist_alloc();
+  int i, recorded = 0;
+  is(hist_ring_capacity(r) == 8);
+  for(i=0; i<10; i++) recorded += hist_ring_record_intscale(r, i % 3, 0);
+  is(recorded == 8);
+  is(hist_ring_dropped(r) == 2);
+  is(hist_ring_pending(r) == 8);
+  is(hist_ring_drain(r, h, 5) == 5);
+  is(hist_ring_pending(r) == 3);
+  /* wrap around */
+  for(i=0; i<5; i++) is(hist_ring_record(r, 2.0));
+  is(!hist_ring_record(r, 2.0));
+  is(hist_ring_drain(r, h, 0) == 8);
+  is(hist_ring_drain(r, h, 0) == 0);
+  for(i=0; i<8; i++) hist_insert_intscale(expected, i % 3, 0, 1);
+  hist_insert(expected, 2.0, 5);
+  is(hists_equal(h, expected));
+  /* the fast index follows the batch merges */
+  hist_insert_intscale(h, 2, 0, 1);
+  is(hist_approx_count_nearby(h, 2.0) == 8);
+  hist_ring_free(r);
+
+  /* samples that can't be stored are counted as dropped, not drained */
+  hist_arena_t *arena = hist_arena_alloc(0), *prev = hist_arena_enter(arena);
+  histogram_t *stuck = hist_alloc_with_allocator(hist_arena_allocator());
+  hist_arena_enter(prev);
+  r = hist_ring_alloc(8, 0);
+  for(i=0; i<4; i++) hist_ring_record(r, 1.0 + i);
+  is(hist_ring_drain(r, stuck, 0) == 0);
+  is(hist_ring_dropped(r) == 4 && hist_ring_pending(r) == 0);
+  is(hist_sample_count(stuck) == 0);
+  hist_ring_free(r);
+  hist_arena_free(arena);
+
+  /* larger than the on-stack batch */
+  hist_bucket_t hb[3000];
+  for(i=0; i<3000; i++) hb[i] = int_scale_to_hist_bucket(i % 101, -1);
+  is(hist_insert_raw_batch(h, hb, 3000) == 3000);
+  is(hist_sample_count(h) == 3000 + 14);
+  is(hist_approx_count_nearby(h, 5.0) == 30);
+  hist_free(h);
+  hist_free(expected);
+}
+
+void
+from_sorted_test() {
+  hist_bucket_t b[5];
+  uint64_t c[5] = { 1, 2, 3, 4, 5 };
+  histogram_t *h, *expected = hist_alloc(), *f = hist_fast_alloc();
+  int i;
+  for(i=0; i<5; i++) {
+    b[i] = int_scale_to_hist_bucket(i * 10 - 20, 0);
+    hist_insert_raw(expected, b[i], c[i]);
+  }
+  h = hist_from_sorted(b, c, 5);
+  is(hists_equal(h, expected));
+  hist_free(h);
+
+  /* out of order and duplicate buckets get sorted and merged */
+  b[0] = b[4];
+  b[1] = b[3];
+  h = hist_from_sorted(b, c, 5);
+  is(hist_bucket_count(h) == 3);
+  is(hist_sample_count(h) == 15);
+  is(hist_approx_count_nearby(h, 20) == 6);
+  hist_free(h);
+
+  /* the fast index is built for bulk loads and deserialization */
+  is(hist_set_sorted(f, b, c, 5) == 3);
+  hist_insert_intscale(f, 20, 0, 1);
+  is(hist_approx_count_nearby(f, 20) == 7);
+  char buff[128];
+  ssize_t len = hist_serialize(expected, buff, sizeof(buff));
+  is(hist_deserialize(f, buff, len) == len);
+  hist_insert_intscale(f, 0, 0, 1);
+  is(hist_approx_count_nearby(f, 0) == 4);
+  is(hist_sample_count(f) == 16);
+
+  hist_free(f);
+  hist_free(expected);
+}
+
+void
+fast_index_test() {
+  histogram_t *f = hist_fast_alloc(), *h = hist_alloc();
+  int i, round;
+  /* front inserts and removals leave stale hints behind */
+  for(round=0; round<3; round++) {
+    for(i=500; i>0; i--) {
+      hist_insert_intscale(f, i, round - 1, 1);
+      hist_insert_intscale(h, i, round - 1, 1);
+    }
+    for(i=1; i<=500; i+=7) {
+      hist_remove(f, i * pow(10, round - 1), 1);
+      hist_remove(h, i * pow(10, round - 1), 1);
+    }
+    hist_remove_zeroes(f);
+    hist_remove_zeroes(h);
+    for(i=1; i<=500; i+=3) {
+      hist_insert_intscale(f, i, round - 1, 2);
+      hist_insert_intscale(h, i, round - 1, 2);
+    }
+  }
+  is(hists_equal(f, h));
+  hist_free(f);
+  hist_free(h);
+}
+
+void
+compact_test() {
+  static hist_bucket_t all[46082];
+  static uint64_t counts[46082];
+  int i, n = 0;
+  uint64_t x = 12345;
+  histogram_t *c = hist_compact_alloc(), *h, *clone;
+  all[n++] = double_to_hist_bucket(NAN);
+  all[n++] = double_to_hist_bucket(0);
+  for(int e=-128; e<128; e++)
+    for(int v=10; v<100; v++) {
+      all[n++] = (hist_bucket_t){ .val = v, .exp = e };
+      all[n++] = (hist_bucket_t){ .val = -v, .exp = e };
+    }
+  is(n == 46082);
+  /* a shuffled tenth of the bucket space */
+  for(i=n-1; i>0; i--) {
+    hist_bucket_t t;
+    int j;
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    j = (x >> 33) % (i + 1);
+    t = all[i]; all[i] = all[j]; all[j] = t;
+  }
+  n /= 10;
+  for(i=0; i<n; i++) {
+    counts[i] = i % 5 + 1;
+    hist_insert_raw(c, all[i], counts[i]);
+  }
+  h = hist_from_sorted(all, counts, n);
+  is(hists_equal(c, h));
+  for(i=0; i<n; i+=3) {
+    hist_remove_raw(c, all[i], counts[i]);
+    hist_remove_raw(h, all[i], counts[i]);
+  }
+  hist_remove_zeroes(c);
+  hist_remove_zeroes(h);
+  for(i=0; i<n; i+=2) {
+    hist_insert_raw(c, all[i], 1);
+    hist_insert_raw(h, all[i], 1);
+  }
+  clone = hist_clone(c);
+  is(hists_equal(c, h));
+  is(hists_equal(clone, h));
+  hist_free(clone);
+  hist_free(h);
+  hist_free(c);
+
+  /* merged zeroes of any exponent end up in the one zero bin */
+  h = hist_alloc();
+  c = hist_compact_alloc();
+  hist_insert_raw(h, (hist_bucket_t){ 0, 5 }, 1);
+  hist_insert_raw(h, (hist_bucket_t){ 0, 0 }, 1);
+  is(hist_accumulate(c, (const histogram_t * const *)&h, 1) == 1);
+  is(hist_sample_count(c) == 2);
+  hist_insert(c, 2.0, 1);
+  hist_insert(c, 1.0, 2);
+  hist_bucket_t b0, b1;
+  uint64_t c0, c1;
+  is(hist_bucket_idx_bucket(c, 1, &b0, &c0) && hist_bucket_idx_bucket(c, 2, &b1, &c1) &&
+     b0.val == 10 && b1.val == 20);
+  is(hist_approx_count_nearby(c, 1.0) == 2);
+  hist_free(h);
+  hist_free(c);
+
+  /* deserializing nothing or garbage leaves no stale bits behind */
+  char buff[64];
+  ssize_t len;
+  h = hist_alloc();
+  len = hist_serialize(h, buff, sizeof(buff));
+  for(i=0; i<2; i++) {
+    c = hist_compact_alloc();
+    hist_insert(c, 1.0, 5);
+    hist_insert(c, 3.0, 5);
+    if(i == 0) is(hist_deserialize(c, buff, len) == len);
+    else is(hist_deserialize(c, buff, 1) == -1);
+    hist_insert(c, 1.0, 1);
+    hist_insert(c, 2.0, 1);
+    is(hist_bucket_count(c) == 2 && hist_sample_count(c) == 2 &&
+       hist_approx_count_nearby(c, 1.0) == 1 && hist_approx_count_nearby(c, 3.0) == 0);
+    hist_free(c);
+  }
+  /* and a truncated payload of a populated histogram */
+  hist_insert(h, 7.0, 3);
+  hist_insert(h, 8.0, 3);
+  len = hist_serialize(h, buff, sizeof(buff));
+  c = hist_compact_alloc();
+  hist_insert(c, 1.0, 5);
+  is(hist_deserialize(c, buff, len - 1) == -1);
+  hist_insert(c, 8.0, 1);
+  hist_insert(c, 1.0, 1);
+  is(hist_bucket_count(c) == 2 && hist_approx_count_nearby(c, 1.0) == 1);
+  hist_free(c);
+  hist_free(h);
+}
+
+void
+pool_arena_test() {
+  const hist_allocator_t *pool = hist_pool_allocator(), *arena_alloc = hist_arena_allocator();
+  histogram_t *h, *expected = hist_alloc();
+  void *p, *q;
+  int i, j;
+
+  p = pool->malloc(1000);
+  pool->free(p);
+  q = pool->malloc(900);
+  is(p == q); /* same size class, recycled */
+  pool->free(q);
+  for(i=0; i<100; i++) {
+    h = i % 2 ? hist_fast_alloc_with_allocator(pool) : hist_alloc_with_allocator(pool);
+    for(j=0; j<300; j++) hist_insert_intscale(h, j, 0, 1);
+    if(i == 99) is(hist_sample_count(h) == 300);
+    hist_free(h);
+  }
+  hist_pool_flush();
+
+  for(j=0; j<300; j++) hist_insert_intscale(expected, j, 0, 1);
+  hist_arena_t *arena = hist_arena_alloc(4096);
+  is(arena_alloc->malloc(16) == NULL); /* not entered yet */
+  is(hist_arena_enter(arena) == NULL);
+  for(i=0; i<3; i++) {
+    histogram_t *hs[10];
+    for(j=0; j<10; j++) {
+      hs[j] = hist_alloc_with_allocator(arena_alloc);
+      for(int k=0; k<300; k++) hist_insert_intscale(hs[j], k, 0, 1);
+    }
+    is(hists_equal(hs[9], expected));
+    if(i == 0) p = hs[0];
+    else is(p == (void *)hs[0]); /* memory is reused after a reset */
+    hist_arena_reset(arena);
+  }
+  is(hist_arena_enter(NULL) == arena);
+  hist_arena_free(arena);
+  hist_free(expected);
+}
+
+static int counting_allocs = 0, counting_frees = 0;
+static void *counting_malloc(size_t x) { counting_allocs++; return malloc(x); }
+static void *counting_calloc(size_t n, size_t x) { counting_allocs++; return calloc(n, x); }
+static void counting_free(void *x) { if(x) counting_frees++; free(x); }
+
+void
+small_hist_test() {
+  hist_allocator_t counting = {
+    .malloc = counting_malloc, .calloc = counting_calloc, .free = counting_free
+  };
+  histogram_t *h = hist_alloc_with_allocator(&counting), *other = hist_alloc();
+  const histogram_t *otherp = other;
+  int i;
+  for(i=0; i<16; i++) hist_insert_intscale(h, i + 10, 0, 1);
+  is(counting_allocs == 1); /* bins live inline */
+  hist_insert_intscale(h, 99, 0, 1);
+  is(counting_allocs == 2); /* spilled to the heap */
+  hist_clear(h);
+  hist_insert_intscale(other, 42, 0, 3);
+  hist_accumulate(h, &otherp, 1);
+  is(hist_bucket_count(h) == 1 && hist_sample_count(h) == 3);
+  char buff[64];
+  ssize_t len = hist_serialize(other, buff, sizeof(buff));
+  is(hist_deserialize(h, buff, len) == len);
+  hist_insert_intscale(h, 43, 0, 1);
+  is(hist_sample_count(h) == 4);
+  hist_free(h);
+  is(counting_allocs == counting_frees);
+  hist_free(other);
+}
+
+void
+query_test() {
+  hist_allocator_t counting = {
+    .malloc = counting_malloc, .calloc = counting_calloc, .free = counting_free
+  };
+  histogram_t *src[4], *c;
+  hist_query_t *q = hist_query_alloc(0);
+  int i, round, before;
+  for(i=0;i<4;i++) {
+    src[i] = hist_alloc();
+    hist_insert(src[i], 1.0 + i, 10);
+    hist_insert(src[i], 123.0, 1);
+  }
+
+  /* compress allocates like its source */
+  c = hist_alloc_with_allocator(&counting);
+  hist_insert(c, 1.5, 1);
+  before = counting_allocs;
+  histogram_t *cc = hist_compress_mbe(c, 0);
+  is(counting_allocs == before + 1);
+  hist_free(cc);
+  hist_free(c);
+
+  for(round=0; round<3; round++) {
+    hist_query_begin(q);
+    histogram_t *m = hist_query_merge(q, (const histogram_t * const *)src, 4);
+    is(m && hist_sample_count(m) == 44 && hist_bucket_count(m) == 5);
+    histogram_t *z = hist_query_compress_mbe(q, m, 2);
+    is(z && hist_bucket_count(z) == 2 && hist_sample_count(z) == 44);
+    histogram_t *k = hist_query_clone(q, z);
+    /* query histograms can keep growing past their inline bins */
+    for(i=0;i<100;i++) hist_insert_intscale(k, i + 10, i % 5, 1);
+    is(hist_sample_count(k) == 144);
+    histogram_t *h = hist_alloc_with_allocator(hist_query_allocator());
+    hist_insert(h, 5.0, 1);
+    is(hist_sample_count(h) == 1);
+    hist_query_end(q);
+  }
+  /* without a running query the arena allocator has nothing to give */
+  is(hist_alloc_with_allocator(hist_query_allocator()) == NULL);
+  is(hist_query_hist(q) == NULL);
+  is(hist_query_clone(q, src[0]) == NULL);
+  is(hist_query_merge(q, (const histogram_t * const *)src, 4) == NULL);
+
+  /* growing a query histogram where the query isn't running fails softly */
+  hist_query_begin(q);
+  histogram_t *fast = hist_fast_alloc();
+  histogram_t *g = hist_query_hist(q), *fg = hist_query_clone(q, fast);
+  hist_arena_t *prev = hist_arena_enter(NULL);
+  uint64_t inserted = 0;
+  for(i=0;i<500;i++) {
+    inserted += hist_insert_intscale(g, 10 + i % 90, i / 90, 1);
+    hist_insert_intscale(fg, 10 + i % 90, i / 90, 1);
+  }
+  is(inserted < 500 && hist_sample_count(g) == inserted);
+  hist_arena_enter(prev);
+  hist_query_end(q);
+  hist_query_free(q);
+  hist_free(fast);
+  for(i=0;i<4;i++) hist_free(src[i]);
+}
+
+void
+cow_test() {
+  hist_allocator_t counting = {
+    .malloc = counting_malloc, .calloc = counting_calloc, .free = counting_free
+  };
+  histogram_t *h = hist_fast_alloc_with_allocator(&counting), *a, *b, *c;
+  const histogram_t *hp;
+  int i, before;
+  char buff[1024];
+  ssize_t len;
+  for(i=0;i<200;i++) hist_insert_intscale(h, 10 + i % 90, i / 90, 1);
+
+  before = counting_allocs;
+  a = hist_clone_with_allocator(h, &counting);
+  b = hist_clone_with_allocator(h, &counting);
+  /* a shared count and two headers, nothing copied */
+  is(counting_allocs == before + 3);
+  is(hist_bucket_count(a) == 200 && hist_sample_count(b) == 200);
+
+  hist_insert_intscale(a, 5, 0, 10);
+  is(hist_sample_count(a) == 210);
+  is(hist_sample_count(h) == 200 && hist_sample_count(b) == 200);
+  hist_insert_intscale(h, 3, 0, 1);
+  is(hist_bucket_count(h) == 201 && hist_bucket_count(b) == 200);
+
+  c = hist_clone_with_allocator(b, &counting);
+  hist_clear(b);
+  is(hist_sample_count(b) == 0 && hist_sample_count(c) == 200);
+  hist_insert_intscale(b, 7, 0, 1);
+  is(hist_sample_count(b) == 1);
+  hp = a;
+  hist_accumulate(c, &hp, 1);
+  is(hist_sample_count(c) == 410 && hist_sample_count(a) == 210);
+
+  len = hist_serialize(h, buff, sizeof(buff));
+  hist_free(b);
+  b = hist_clone_with_allocator(a, &counting);
+  is(hist_deserialize(a, buff, len) == len);
+  is(hist_sample_count(a) == 201 && hist_sample_count(b) == 210);
+
+  /* a failed deserialize into a clone must not take the shared bins along */
+  hist_free(b);
+  b = hist_clone_with_allocator(a, &counting);
+  is(hist_deserialize(b, buff, 1) == -1);
+  is(hist_sample_count(b) == 0 && hist_sample_count(a) == 201);
+  hist_free(b);
+  b = hist_clone_with_allocator(a, &counting);
+  is(hist_deserialize(b, buff, len - 1) == -1);
+  is(hist_sample_count(b) == 0 && hist_sample_count(a) == 201);
+
+  hist_free(h);
+  hist_free(b);
+  hist_free(a);
+  hist_free(c);
+  is(counting_allocs == counting_frees);
+}
+
+void
+publish_test() {
+  hist_publisher_t *p = hist_publisher_alloc(2);
+  histogram_t *h = hist_fast_alloc();
+  const histogram_t *snap;
+  double q = 0.5, out;
+  int r0 = hist_publisher_register(p), r1 = hist_publisher_register(p);
+  is(r0 == 0 && r1 == 1 && hist_publisher_register(p) == -1);
+  snap = hist_snapshot_acquire(p, r1);
+  is(snap && hist_sample_count(snap) == 0);
+  hist_snapshot_release(p, r1);
+
+  hist_insert(h, 10.0, 5);
+  is(hist_publish(p, h) == 0);
+  is(hist_publisher_retired(p) == 0);
+  snap = hist_snapshot_acquire(p, r0);
+  /* the writer carries on, the snapshot stays put */
+  hist_insert(h, 90.0, 5);
+  is(hist_publish(p, h) == 0);
+  is(hist_publisher_retired(p) == 1);
+  is(hist_sample_count(snap) == 5);
+  is(hist_approx_quantile(snap, &q, 1, &out) == 0);
+  is(out >= 10.0 && out < 11.0);
+  hist_snapshot_release(p, r0);
+
+  snap = hist_snapshot_acquire(p, r1);
+  is(hist_sample_count(snap) == 10);
+  hist_snapshot_release(p, r1);
+  hist_insert(h, 50.0, 1);
+  is(hist_publish(p, h) == 0);
+  is(hist_publisher_retired(p) == 0);
+
+  /* slots go back to the pool */
+  hist_publisher_unregister(p, r0);
+  is(hist_publisher_register(p) == r0);
+  hist_publisher_unregister(p, r1);
+  hist_publisher_unregister(p, r0);
+  is(hist_publisher_register(p) == 0 && hist_publisher_register(p) == 1);
+  hist_publisher_free(p);
+  hist_free(h);
+}
+
+struct publish_reader {
+  hist_publisher_t *p;
+  int bad;
+};
+
+static void *
+publish_reader_thread(void *vr) {
+  struct publish_reader *r = vr;
+  uint64_t last = 0;
+  int round, i, slot;
+  /* more threads than slots, so registration churns */
+  for(round=0;round<200;round++) {
+    while((slot = hist_publisher_register(r->p)) < 0);
+    for(i=0;i<20;i++) {
+      const histogram_t *snap = hist_snapshot_acquire(r->p, slot);
+      uint64_t n = hist_sample_count(snap);
+      if(n % 2 || n < last) r->bad++;
+      last = n;
+      hist_snapshot_release(r->p, slot);
+    }
+    hist_publisher_unregister(r->p, slot);
+  }
+  return NULL;
+}
+
+void
+publish_thread_test() {
+  hist_publisher_t *p = hist_publisher_alloc(2);
+  histogram_t *h = hist_fast_alloc();
+  struct publish_reader r[3];
+  pthread_t tid[3];
+  int i, bad = 0, ok = 1;
+  for(i=0;i<3;i++) {
+    r[i].p = p;
+    r[i].bad = 0;
+    ok = ok && pthread_create(&tid[i], NULL, publish_reader_thread, &r[i]) == 0;
+  }
+  is(ok);
+  for(i=0;i<5000;i++) {
+    hist_insert(h, 1.0, 1);
+    hist_insert(h, 2.0, 1);
+    if(hist_publish(p, h) != 0) ok = 0;
+  }
+  is(ok);
+  for(i=0;i<3;i++) {
+    pthread_join(tid[i], NULL);
+    bad += r[i].bad;
+  }
+  /* every snapshot held both halves of a publish, never an older one */
+  is(bad == 0);
+  is(hist_publish(p, h) == 0);
+  is(hist_publisher_retired(p) == 0);
+  hist_publisher_free(p);
+  hist_free(h);
+}
+
+void
+quantile_batch_test() {
+  histogram_t *h[4];
+  double q[4] = { 0.5, 0.9, 0.99, 0.999 }, bad[2] = { 0.9, 0.5 }, out[16], one[4], one7[4];
+  int i, j, ok = 1;
+  for(i=0;i<3;i++) {
+    h[i] = hist_alloc();
+    for(j=1;j<=1000;j++) hist_insert_intscale(h[i], j * (i + 1), 0, 1);
+  }
+  h[3] = NULL;
+  /* disjoint ranges fill disjoint rows */
+  is(hist_approx_quantile_batch((const histogram_t * const *)h, 0, 2, q, 4, out) == 0);
+  is(hist_approx_quantile_batch((const histogram_t * const *)h, 2, 4, q, 4, out) == 0);
+  for(i=0;i<3;i++) {
+    hist_approx_quantile(h[i], q, 4, one);
+    for(j=0;j<4;j++) if(out[i*4+j] != one[j]) ok = 0;
+  }
+  is(ok);
+  is(isnan(out[12]) && isnan(out[15]));
+  is(hist_approx_quantile7_batch((const histogram_t * const *)h, 0, 3, q, 4, out) == 0);
+  hist_approx_quantile7(h[1], q, 4, one7);
+  is(memcmp(out + 4, one7, sizeof(one7)) == 0);
+  is(hist_approx_quantile_batch((const histogram_t * const *)h, 0, 3, bad, 2, out) == -2);
+  bad[1] = 1.5;
+  is(hist_approx_quantile_batch((const histogram_t * const *)h, 0, 3, bad, 2, out) == -3);
+  for(i=0;i<3;i++) hist_free(h[i]);
+}
+
+void
+quantile_merged_test() {
+  int cnt = 1100, i, j, ok = 1, ok7 = 1;
+  histogram_t **h = calloc(cnt, sizeof(*h)), *merged = hist_alloc();
+  double q[6] = { 0, 0.25, 0.5, 0.9, 0.999, 1 }, out[6], expect[6];
+  for(i=0;i<cnt;i++) {
+    if(i % 7 == 3) continue; /* NULLs are skipped */
+    h[i] = hist_alloc();
+    if(i % 11 == 5) continue; /* and so are empty ones */
+    for(j=0;j<5;j++) hist_insert_intscale(h[i], (i * 37 + j * 101) % 997 - 300, -(j % 3), 1 + j);
+    if(i == 10) hist_insert(h[i], NAN, 5);
+  }
+  hist_accumulate(merged, (const histogram_t * const *)h, cnt);
+  is(hist_approx_quantile_merged((const histogram_t * const *)h, cnt, q, 6, out) == 0);
+  hist_approx_quantile(merged, q, 6, expect);
+  for(i=0;i<6;i++) if(out[i] != expect[i]) ok = 0;
+  is(ok);
+  is(hist_approx_quantile7_merged((const histogram_t * const *)h, 32, q, 6, out) == 0);
+  hist_clear(merged);
+  hist_accumulate(merged, (const histogram_t * const *)h, 32);
+  hist_approx_quantile7(merged, q, 6, expect);
+  for(i=0;i<6;i++) if(out[i] != expect[i]) ok7 = 0;
+  is(ok7);
+  is(hist_approx_quantile_merged((const histogram_t * const *)h, 0, q, 6, out) == 0 && isnan(out[5]));
+  q[0] = 0.5;
+  is(hist_approx_quantile_merged((const histogram_t * const *)h, cnt, q, 6, out) == -2);
+  for(i=0;i<cnt;i++) hist_free(h[i]);
+  free(h);
+  hist_free(merged);
+}
+
+/* the upper-half walks must agree with the walk from the bottom, which a
+ * low first quantile (threshold) forces */
+static bool
+top_walks_agree(const histogram_t *h) {
+  double q[4] = { 0, 0.9, 0.999, 1 }, fwd[4], top[3], fwd7[4], top7[3];
+  double t[4] = { -1e300, 0, 1e5, 1e300 }, ifwd[4], itop[3];
+  uint64_t sum = 0, c;
+  hist_bucket_t b;
+  int i;
+  for(i=0;i<hist_bucket_count(h);i++) {
+    hist_bucket_idx_bucket(h, i, &b, &c);
+    if(!isnan(hist_bucket_to_double(b))) sum += c;
+  }
+  hist_approx_quantile(h, q, 4, fwd);
+  hist_approx_quantile(h, q + 1, 3, top);
+  hist_approx_quantile7(h, q, 4, fwd7);
+  hist_approx_quantile7(h, q + 1, 3, top7);
+  hist_approx_inverse_quantile(h, t, 4, ifwd);
+  hist_approx_inverse_quantile(h, t + 1, 3, itop);
+  if(memcmp(fwd + 1, top, sizeof(top)) || memcmp(fwd7 + 1, top7, sizeof(top7)) ||
+     memcmp(ifwd + 1, itop, sizeof(itop))) return false;
+  return hist_approx_count_below(h, 1e120) == sum;
+}
+
+void
+total_cache_test() {
+  histogram_t *h = hist_alloc(), *f = hist_fast_alloc(), *other = hist_alloc();
+  const histogram_t *otherp = other;
+  int i;
+  for(i=0;i<2000;i++) {
+    hist_insert_intscale(h, 10 + i % 90, i / 90 - 5, 1 + i % 7);
+    hist_insert_intscale(f, -(10 + i % 90), i / 90 - 5, 1 + i % 3);
+  }
+  hist_insert(h, -3.0, 20);
+  is(top_walks_agree(h) && top_walks_agree(f));
+  hist_insert(h, NAN, 5);
+  hist_remove(h, 1e3, 2);
+  hist_remove(f, -5.5, 100);
+  is(top_walks_agree(h) && top_walks_agree(f));
+  is(hist_sample_count(h) == hist_approx_count_below(h, 1e120) + 5);
+  hist_insert_intscale(other, 77, 2, 1000);
+  hist_accumulate(h, &otherp, 1);
+  hist_subtract(f, &otherp, 1);
+  is(top_walks_agree(h) && top_walks_agree(f));
+  hist_clamp(h, 0, 5e6);
+  hist_downsample_deterministic(f, 0.5);
+  is(top_walks_agree(h) && top_walks_agree(f));
+  hist_clear(h);
+  hist_insert(h, 42.0, 1);
+  is(top_walks_agree(h) && hist_sample_count(h) == 1);
+  hist_free(h);
+  hist_free(f);
+  hist_free(other);
+}
+
+void
+threshold_test() {
+  histogram_t *h[4] = { hist_alloc(), hist_fast_alloc(), hist_alloc_weighted(), hist_alloc() };
+  double values[] = { 0, -0.0, 1e-130, 0.2, 200, 199.9, 12, -12, -12.5, -1000, 5e7,
+                      1e300, -1e300, NAN, INFINITY };
+  int i, j, ok = 1;
+  for(i=0;i<3000;i++) {
+    double v = (i % 2 ? -1 : 1) * (i % 97 + 1) * pow(10, i % 11 - 4);
+    hist_insert(h[0], v, 1 + i % 5);
+    hist_insert(h[1], v / 3, 1);
+    hist_insert_weighted(h[2], v, 2.0);
+  }
+  hist_insert(h[0], NAN, 3);
+  hist_insert(h[0], 0, 4);
+  for(j=0;j<4;j++) {
+    for(i=0;i<(int)(sizeof(values)/sizeof(*values));i++) {
+      hist_threshold_t t = hist_threshold_compile(values[i]);
+      double iq, ciq = hist_threshold_inverse_quantile(h[j], &t);
+      hist_approx_inverse_quantile(h[j], &values[i], 1, &iq);
+      if(!(iq == ciq || (isnan(iq) && isnan(ciq)))) ok = 0;
+      if(hist_threshold_count_below(h[j], &t, 1) != hist_approx_count_below_inclusive(h[j], values[i]) ||
+         hist_threshold_count_below(h[j], &t, 0) != hist_approx_count_below_exclusive(h[j], values[i]) ||
+         hist_threshold_count_above(h[j], &t, 1) != hist_approx_count_above_inclusive(h[j], values[i]) ||
+         hist_threshold_count_above(h[j], &t, 0) != hist_approx_count_above_exclusive(h[j], values[i]))
+        ok = 0;
+    }
+    if(!ok) notokf("histogram %d", j);
+  }
+  is(ok);
+  for(j=0;j<4;j++) hist_free(h[j]);
+}
+
+/* the divide-by-ten normalization int_scale_to_hist_bucket used to do */
+static hist_bucket_t
+intscale_reference(int64_t value, int scale) {
+  hist_bucket_t hb = { 0, 0 };
+  int sign = 1;
+  if(value == 0) return hb;
+  scale++;
+  if(value < 0) {
+    value = value == INT64_MIN ? INT64_MAX : -value;
+    sign = -1;
+  }
+  if(value < 10) {
+    value *= 10;
+    scale -= 1;
+  }
+  while(value >= 100) {
+    value /= 10;
+    scale++;
+  }
+  if(scale < -128) return hb;
+  if(scale > 127) { hb.val = (int8_t)0xff; return hb; }
+  hb.val = sign * value;
+  hb.exp = scale;
+  return hb;
+}
+
+void
+intscale_fast_test() {
+  int64_t values[] = { 0, 1, 9, 10, 11, 99, 100, 101, 999, 1000, 123456789,
+                       INT64_MAX, INT64_MIN, INT64_MAX / 10, INT64_MIN + 1 };
+  int scales[] = { -200, -146, -130, -128, -9, -6, -3, 0, 1, 100, 108, 127, 200 };
+  int i, j, s, ok = 1;
+  hist_bucket_t a, b;
+  histogram_t *h = hist_alloc(), *ref = hist_alloc();
+  for(i=0; i<19; i++) {
+    /* around every power of ten, both signs */
+    int64_t p = 1;
+    for(j=0; j<i; j++) p *= 10;
+    for(j=-1; j<=1; j++) {
+      int64_t v = p + j;
+      for(s=0; s<(int)(sizeof(scales)/sizeof(*scales)); s++) {
+        a = int_scale_to_hist_bucket(v, scales[s]);
+        b = intscale_reference(v, scales[s]);
+        if(a.val != b.val || a.exp != b.exp) ok = 0;
+        a = int_scale_to_hist_bucket(-v, scales[s]);
+        b = intscale_reference(-v, scales[s]);
+        if(a.val != b.val || a.exp != b.exp) ok = 0;
+      }
+    }
+  }
+  for(i=0; i<(int)(sizeof(values)/sizeof(*values)); i++) {
+    for(s=0; s<(int)(sizeof(scales)/sizeof(*scales)); s++) {
+      a = int_scale_to_hist_bucket(values[i], scales[s]);
+      b = intscale_reference(values[i], scales[s]);
+      if(a.val != b.val || a.exp != b.exp) ok = 0;
+    }
+  }
+  for(i=0; i<100000; i++) {
+    int64_t v = (int64_t)((uint64_t)lrand48() << 33 ^ (uint64_t)lrand48() << 2) >> (i % 63);
+    a = int_scale_to_hist_bucket(v, i % 40 - 20);
+    b = intscale_reference(v, i % 40 - 20);
+    if(a.val != b.val || a.exp != b.exp) ok = 0;
+  }
+  is(ok);
+
+  /* fixed scale helpers match the generic path */
+  a = int_ns_to_hist_bucket(1300000000);
+  b = int_scale_to_hist_bucket(1300000000, -9);
+  is(a.val == b.val && a.exp == b.exp && a.val == 13 && a.exp == 0);
+  a = int_us_to_hist_bucket(-2700);
+  b = int_scale_to_hist_bucket(-2700, -6);
+  is(a.val == b.val && a.exp == b.exp);
+  a = int_ms_to_hist_bucket(7);
+  b = int_scale_to_hist_bucket(7, -3);
+  is(a.val == b.val && a.exp == b.exp);
+  for(i=1; i<1000; i++) {
+    hist_insert_ns(h, i * 1234567, 1);
+    hist_insert_us(h, i * 89, 2);
+    hist_insert_ms(h, i, 3);
+    hist_insert_intscale(ref, i * 1234567, -9, 1);
+    hist_insert_intscale(ref, i * 89, -6, 2);
+    hist_insert_intscale(ref, i, -3, 3);
+  }
+  is(hist_bucket_count(h) == hist_bucket_count(ref) &&
+     hist_sample_count(h) == hist_sample_count(ref));
+  for(i=0, ok=1; i<hist_bucket_count(h); i++) {
+    uint64_t c1, c2;
+    hist_bucket_idx_bucket(h, i, &a, &c1);
+    hist_bucket_idx_bucket(ref, i, &b, &c2);
+    if(a.val != b.val || a.exp != b.exp || c1 != c2) ok = 0;
+  }
+  is(ok);
+  hist_free(h);
+  hist_free(ref);
+}
+
 int main() {
   struct timeval now;
   gettimeofday(&now, NULL);
@@ -724,6 +1998,8 @@ int main() {
 
     T(serialize_test());
 
+    T(serialize_batch_test());
+
     T(clone_test());
 
     T(allocator_test());
@@ -737,6 +2013,9 @@ int main() {
   compress_test();
 
   T(downsample());
+  T(downsample_binomial());
+  T(downsample_reproducible());
+  T(downsample_deterministic());
 
   T(simple_clear());
 
@@ -744,6 +2023,29 @@ int main() {
 
   T(diff_test());
 
+  T(archive_test());
+  T(block_test());
+  T(framed_test());
+  T(window_test());
+  T(rollup_test());
+  T(decay_test());
+  T(weighted_test());
+  T(ring_test());
+  T(from_sorted_test());
+  T(fast_index_test());
+  T(compact_test());
+  T(pool_arena_test());
+  T(small_hist_test());
+  T(query_test());
+  T(cow_test());
+  T(publish_test());
+  T(publish_thread_test());
+  T(quantile_batch_test());
+  T(quantile_merged_test());
+  T(total_cache_test());
+  T(threshold_test());
+  T(intscale_fast_test());
+
   T(is(isnan(hist_approx_mean(NULL))));
   T(is(isnan(hist_approx_stddev(NULL))));
   T(is(isnan(hist_approx_moment(NULL, 1))));